@@ -1,27 +1,10 @@
 #include "../../config/limits.h"
+#include "../estimators/ocv.h"
 
 #include <stdint.h>
 
-float nmc_ocv_to_soc(float ocv);
-
-uint16_t calculate_cell_voltage_charge_current_limit(uint32_t cell_voltage_min_mV, uint32_t cell_voltage_max_mV) {
-    uint16_t charge_limit = 0xFFFF;
-
-    if(cell_voltage_max_mV > 4000) {
-        int16_t delta_from_max = CELL_VOLTAGE_SOFT_MAX_mV - cell_voltage_max_mV;
-        // TODO: Add a nonlinear curve to reduce charge current as delta falls to zero.
-        
-
-
-        // TODO - handle LFP or use EKF SoC?
-        // We're onto the steeper part of the curve now, so SoC estimation is more accurate
-        float soc = nmc_ocv_to_soc(cell_voltage_max_mV / 1000.0f);
-        int32_t derate_dA = (int32_t)((1.0f - soc) * 100.0f * CHARGE_CELL_VOLTAGE_DERATE_dA_PER_SoC);
-        if(derate_dA < charge_limit) {
-            charge_limit = derate_dA;
-        }
-    }
-
+// Stops/limits current once the cells are outside their soft limits
+static uint16_t cell_voltage_charge_stops(uint16_t charge_limit, uint32_t cell_voltage_min_mV, uint32_t cell_voltage_max_mV) {
     if(cell_voltage_max_mV > CELL_VOLTAGE_SOFT_MAX_mV) {
         // Above max cell voltage, stop charging
         charge_limit = 0;
@@ -36,17 +19,7 @@ uint16_t calculate_cell_voltage_charge_current_limit(uint32_t cell_voltage_min_m
     return charge_limit;
 }
 
-uint16_t calculate_cell_voltage_discharge_current_limit(uint32_t cell_voltage_min_mV, uint32_t cell_voltage_max_mV) {
-    uint16_t discharge_limit = 0xFFFF;
-
-    if(cell_voltage_min_mV < 3500) {
-        float soc = nmc_ocv_to_soc(cell_voltage_min_mV / 1000.0f);
-        int32_t derate_dA = (int32_t)(soc * 100.0f * DISCHARGE_CELL_VOLTAGE_DERATE_dA_PER_SoC);
-        if(derate_dA < discharge_limit) {
-            discharge_limit = derate_dA;
-        }
-    }
-
+static uint16_t cell_voltage_discharge_stops(uint16_t discharge_limit, uint32_t cell_voltage_min_mV, uint32_t cell_voltage_max_mV) {
     if(cell_voltage_min_mV < CELL_VOLTAGE_SOFT_MIN_mV) {
         // Hit min cell voltage, stop discharging
         discharge_limit = 0;
@@ -61,6 +34,49 @@ uint16_t calculate_cell_voltage_discharge_current_limit(uint32_t cell_voltage_mi
     return discharge_limit;
 }
 
+uint16_t calculate_cell_voltage_charge_current_limit(uint32_t cell_voltage_min_mV, uint32_t cell_voltage_max_mV, int16_t temperature_dC) {
+    uint16_t charge_limit = 0xFFFF;
+
+    if(cell_voltage_max_mV > CHARGE_CELL_VOLTAGE_DERATE_START_mV) {
+        int16_t delta_from_max = CELL_VOLTAGE_SOFT_MAX_mV - cell_voltage_max_mV;
+        // TODO: Add a nonlinear curve to reduce charge current as delta falls to zero.
+        
+
+
+        // TODO - use EKF SoC?
+        // We're onto the steeper part of the curve now, so SoC estimation is more accurate
+        uint16_t soc = ocv_mV_to_soc(cell_voltage_max_mV, temperature_dC);
+        int32_t derate_dA = (10000 - soc) * CHARGE_CELL_VOLTAGE_DERATE_dA_PER_SoC / 100;
+        if(derate_dA < charge_limit) {
+            charge_limit = derate_dA;
+        }
+    }
+
+    return cell_voltage_charge_stops(charge_limit, cell_voltage_min_mV, cell_voltage_max_mV);
+}
+
+uint16_t calculate_sop_charge_current_limit(uint32_t cell_voltage_min_mV, uint32_t cell_voltage_max_mV, uint16_t sop_limit_dA) {
+    return cell_voltage_charge_stops(sop_limit_dA, cell_voltage_min_mV, cell_voltage_max_mV);
+}
+
+uint16_t calculate_cell_voltage_discharge_current_limit(uint32_t cell_voltage_min_mV, uint32_t cell_voltage_max_mV, int16_t temperature_dC) {
+    uint16_t discharge_limit = 0xFFFF;
+
+    if(cell_voltage_min_mV < DISCHARGE_CELL_VOLTAGE_DERATE_START_mV) {
+        uint16_t soc = ocv_mV_to_soc(cell_voltage_min_mV, temperature_dC);
+        int32_t derate_dA = soc * DISCHARGE_CELL_VOLTAGE_DERATE_dA_PER_SoC / 100;
+        if(derate_dA < discharge_limit) {
+            discharge_limit = derate_dA;
+        }
+    }
+
+    return cell_voltage_discharge_stops(discharge_limit, cell_voltage_min_mV, cell_voltage_max_mV);
+}
+
+uint16_t calculate_sop_discharge_current_limit(uint32_t cell_voltage_min_mV, uint32_t cell_voltage_max_mV, uint16_t sop_limit_dA) {
+    return cell_voltage_discharge_stops(sop_limit_dA, cell_voltage_min_mV, cell_voltage_max_mV);
+}
+
 uint16_t calculate_temperature_charge_current_limit(int16_t temperature_min_dC, int16_t temperature_max_dC) {
     if(temperature_max_dC >= MAX_CHARGE_TEMPERATURE_LIMIT_dC || temperature_min_dC <= MIN_CHARGE_TEMPERATURE_LIMIT_dC) {
         return 0;
@@ -0,0 +1,66 @@
+#include "overcurrent_trip.h"
+
+#include "../model.h"
+#include "../../config/limits.h"
+#include "../../config/settings.h"
+
+// How often the trip currents are stepped down towards the limits
+#define OVERCURRENT_TRIP_FALL_INTERVAL_MS 100
+
+static int32_t trip_current_dA(uint16_t limit_dA) {
+    int32_t proportional_dA = (int32_t)limit_dA * OVERCURRENT_TRIP_PERCENT / 100;
+    int32_t margin_dA = (int32_t)limit_dA + OVERCURRENT_TRIP_MARGIN_dA;
+    return proportional_dA > margin_dA ? proportional_dA : margin_dA;
+}
+
+// Jumps up to the target, but only falls at OVERCURRENT_TRIP_FALL_dA_PER_S
+static int32_t follow(int32_t trip_dA, int32_t target_dA, uint32_t elapsed_ms) {
+    if(target_dA >= trip_dA) {
+        return target_dA;
+    }
+    int64_t fall_dA = (int64_t)elapsed_ms * OVERCURRENT_TRIP_FALL_dA_PER_S / 1000;
+    if(trip_dA - fall_dA < target_dA) {
+        return target_dA;
+    }
+    return trip_dA - (int32_t)fall_dA;
+}
+
+int16_t overcurrent_trip_shunt_limit(int32_t current_dA, int32_t current_offset) {
+    // With ADCRANGE set, the limits have a 1.25µV LSB, which works out at
+    // SHUNT_CAL/65536 per CURRENT LSB (0.25mA, so 400 per 0.1A)
+    int64_t current_raw = (int64_t)current_dA * 400 + current_offset;
+    int64_t limit = current_raw * INA228_SHUNT_CAL / 65536;
+    if(limit > INT16_MAX) return INT16_MAX;
+    if(limit < INT16_MIN) return INT16_MIN;
+    return (int16_t)limit;
+}
+
+bool overcurrent_trip_update(overcurrent_trip_t *trip, const bms_model_t *model, millis_t now) {
+    int32_t charge_target_dA = trip_current_dA(model->charge_current_limit_dA);
+    int32_t discharge_target_dA = trip_current_dA(model->discharge_current_limit_dA);
+
+    if(trip->updated_millis == 0) {
+        trip->charge_trip_dA = charge_target_dA;
+        trip->discharge_trip_dA = discharge_target_dA;
+        trip->updated_millis = now;
+    } else if(now - trip->updated_millis >= OVERCURRENT_TRIP_FALL_INTERVAL_MS) {
+        uint32_t elapsed_ms = now - trip->updated_millis;
+        trip->charge_trip_dA = follow(trip->charge_trip_dA, charge_target_dA, elapsed_ms);
+        trip->discharge_trip_dA = follow(trip->discharge_trip_dA, discharge_target_dA, elapsed_ms);
+        trip->updated_millis = now;
+    } else {
+        // In between, only rises are taken
+        if(charge_target_dA > trip->charge_trip_dA) trip->charge_trip_dA = charge_target_dA;
+        if(discharge_target_dA > trip->discharge_trip_dA) trip->discharge_trip_dA = discharge_target_dA;
+    }
+
+    int16_t sovl = overcurrent_trip_shunt_limit(trip->charge_trip_dA, model->current_offset);
+    int16_t suvl = overcurrent_trip_shunt_limit(-trip->discharge_trip_dA, model->current_offset);
+    if(trip->programmed && sovl == trip->sovl && suvl == trip->suvl) {
+        return false;
+    }
+    trip->sovl = sovl;
+    trip->suvl = suvl;
+    trip->programmed = false;
+    return true;
+}
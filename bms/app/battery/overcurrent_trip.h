@@ -0,0 +1,35 @@
+#pragma once
+
+#include "../../sys/time/time.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct bms_model bms_model_t;
+
+// Hardware overcurrent protection: the INA228 compares each shunt sample
+// against its over/under-voltage limits (SOVL/SUVL), and pulls its ALERT pin
+// low if they're exceeded, which opens the contactors from an interrupt. This
+// keeps those limits in step with the live current limits.
+
+typedef struct {
+    // Trip currents, which follow the limits up immediately, but down slowly
+    // (in 0.1A units)
+    int32_t charge_trip_dA;
+    int32_t discharge_trip_dA;
+    millis_t updated_millis;
+
+    // The shunt voltage limits, as last programmed (INA228 SOVL/SUVL LSBs)
+    int16_t sovl;
+    int16_t suvl;
+    bool programmed;
+} overcurrent_trip_t;
+
+// Converts a current (positive charging) into a shunt voltage limit, allowing
+// for the shunt's offset (in raw CURRENT LSBs, see model->current_offset)
+int16_t overcurrent_trip_shunt_limit(int32_t current_dA, int32_t current_offset);
+
+// Recalculates the trip currents from the live current limits. Returns true
+// if the shunt voltage limits (in sovl and suvl) need programming, in which
+// case the caller should set programmed once they have been.
+bool overcurrent_trip_update(overcurrent_trip_t *trip, const bms_model_t *model, millis_t now);
@@ -1,7 +1,19 @@
 #include "app/model.h"
+#include "app/estimators/current_history.h"
 #include "config/limits.h"
 #include "sys/events/events.h"
 
+static bool current_steady_between(micros_t a_us, micros_t b_us) {
+    // If we don't know the current at either instant, assume it was steady (as
+    // we always used to).
+    int32_t a_mA, b_mA;
+    if(!current_history_at(a_us, &a_mA) || !current_history_at(b_us, &b_mA)) {
+        return true;
+    }
+    int32_t change_mA = a_mA - b_mA;
+    return change_mA > -VOLTAGE_MISMATCH_MAX_CURRENT_CHANGE_mA && change_mA < VOLTAGE_MISMATCH_MAX_CURRENT_CHANGE_mA;
+}
+
 void confirm_battery_safety(bms_model_t *model) {
     bool not_fully_initialized = (
        model->system_sm.state == SYSTEM_STATE_UNINITIALIZED ||
@@ -103,10 +115,12 @@ void confirm_battery_safety(bms_model_t *model) {
 
     // TODO: Is this the right place for this?
 
-    if(model->battery_voltage_millis > 0 && model->cell_voltage_millis > 0 && (model->battery_voltage_millis - model->cell_voltage_millis) < 1000) {
+    if(model->battery_voltage_millis > 0 && model->cell_voltage_millis > 0 && (model->battery_voltage_millis - model->cell_voltage_millis) < 1000
+        && current_steady_between(model->battery_voltage_us, model->cell_voltages_us)) {
         // If we have a recent cell voltage reading, compare total to battery
         // voltage. We may be sampling the cell voltages very infrequently, so
-        // only do this check if the voltage readings are close in time.
+        // only do this check if the voltage readings are close in time, and
+        // the current didn't step in between (or the IR drops would differ).
         int32_t expected_total = model->battery_voltage_mV;
         int32_t voltage_diff = model->cell_voltage_total_mV - expected_total;
         confirm(
@@ -0,0 +1,74 @@
+#include "state_of_power.h"
+
+#include "../model.h"
+#include "../estimators/current_history.h"
+#include "../estimators/ekf.h"
+#include "../estimators/ocv.h"
+#include "../../config/limits.h"
+
+#include <math.h>
+
+static const uint16_t horizons_s[SOP_HORIZONS] = SOP_HORIZONS_S;
+
+float sop_current_to_limit(const sop_cell_t *cell, float voltage_V, float current_A, float ocv_slope_V, float limit_V, float horizon_s) {
+    float tau = cell->R1 * cell->C1;
+    float e = tau > 0.0f ? expf(-horizon_s / tau) : 0.0f;
+    float k = cell->capacity_Ah > 0.0f ? ocv_slope_V / (3600.0f * cell->capacity_Ah) : 0.0f;
+
+    // What the voltage would settle towards at zero current, by the horizon
+    float relaxed_V = voltage_V - current_A * cell->R0 - cell->polarization_V * (1.0f - e);
+    float resistance = cell->R0 + cell->R1 * (1.0f - e) + k * horizon_s;
+    if(resistance <= 0.0f) {
+        return 0.0f;
+    }
+    return (limit_V - relaxed_V) / resistance;
+}
+
+static uint16_t amps_to_dA(float amps) {
+    if(amps <= 0.0f) return 0;
+    if(amps >= 6553.5f) return 0xFFFF;
+    return (uint16_t)(amps * 10.0f);
+}
+
+void sop_tick(bms_model_t *model) {
+    const EKF *ekf = ekf_instance_get();
+    if(ekf == NULL || model->cell_voltage_millis == 0) {
+        return;
+    }
+
+    sop_cell_t cell = {
+        .R0 = ekf->R0,
+        .R1 = ekf->R1,
+        .C1 = ekf->C1,
+        // The EKF's V_c1 is subtracted from the OCV
+        .polarization_V = -ekf->x[1],
+        .capacity_Ah = ekf->x[2],
+    };
+    // The current flowing when the cell voltages were snapshotted (whose IR
+    // drop they include), rather than the latest reading
+    int32_t current_mA;
+    if(!current_history_at(model->cell_voltages_us, &current_mA)) {
+        current_mA = model->current_mA;
+    }
+    float current_A = current_mA / 1000.0f;
+    float min_V = model->cell_voltage_min_mV / 1000.0f;
+    float max_V = model->cell_voltage_max_mV / 1000.0f;
+
+    // The slope of the OCV curve where each of the extreme cells is
+    int16_t temperature_dC = ocv_model_temperature_dC(model);
+    int32_t min_ocv_mV = model->cell_voltage_min_mV - (int32_t)((current_A * cell.R0 + cell.polarization_V) * 1000.0f);
+    int32_t max_ocv_mV = model->cell_voltage_max_mV - (int32_t)((current_A * cell.R0 + cell.polarization_V) * 1000.0f);
+    // uV per 1% to V per unit SoC
+    float min_slope = ocv_slope(ocv_mV_to_soc(min_ocv_mV, temperature_dC), temperature_dC) / 10000.0f;
+    float max_slope = ocv_slope(ocv_mV_to_soc(max_ocv_mV, temperature_dC), temperature_dC) / 10000.0f;
+
+    for(int i=0; i<SOP_HORIZONS; i++) {
+        float discharge_A = -sop_current_to_limit(&cell, min_V, current_A, min_slope,
+            CELL_VOLTAGE_SOFT_MIN_mV / 1000.0f, horizons_s[i]);
+        float charge_A = sop_current_to_limit(&cell, max_V, current_A, max_slope,
+            CELL_VOLTAGE_SOFT_MAX_mV / 1000.0f, horizons_s[i]);
+        model->sop_discharge_current_limit_dA[i] = amps_to_dA(discharge_A);
+        model->sop_charge_current_limit_dA[i] = amps_to_dA(charge_A);
+    }
+    model->sop_millis = millis();
+}
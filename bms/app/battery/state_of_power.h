@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+
+typedef struct bms_model bms_model_t;
+
+// State of power: the largest constant current each way that the weakest
+// (or, charging, the fullest) cell could sustain for each horizon without
+// crossing its soft voltage limit, from the EKF's RC model of the cell.
+//
+// Under a constant current I from a cell now at V under current I0:
+//
+//   V(T) = V - I0*R0 - Vp*(1-e) + I*(R0 + R1*(1-e) + k*T)
+//
+// where Vp is the polarization voltage, e = exp(-T/(R1*C1)) and k is how
+// fast the OCV moves per amp-second. Setting V(T) to the limit gives I.
+#define SOP_HORIZONS 3
+#define SOP_HORIZONS_S {2, 10, 30}
+// The horizon whose limits go to the inverter, which holds a limit for a
+// while
+#define SOP_LIMIT_HORIZON 2
+// Results older than this aren't used
+#define SOP_STALE_MS 3000
+
+typedef struct {
+    float R0; // ohms
+    float R1; // ohms
+    float C1; // farads
+    float polarization_V; // positive when charging has pushed the voltage up
+    float capacity_Ah;
+} sop_cell_t;
+
+// The constant current (A, positive charging) that would take a cell at
+// voltage_V (under current_A, on an OCV curve of the given slope in V per unit
+// SoC) to limit_V after horizon_s.
+float sop_current_to_limit(const sop_cell_t *cell, float voltage_V, float current_A, float ocv_slope_V, float limit_V, float horizon_s);
+
+// Works out the limits for each horizon from the latest EKF state and cell
+// voltages, and stores them in the model. Call whenever the EKF steps.
+void sop_tick(bms_model_t *model);
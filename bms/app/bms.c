@@ -1,6 +1,7 @@
 #include "drivers/bmb3y/bmb3y.h"
 #include "drivers/chip/pwm.h"
 #include "drivers/chip/watchdog.h"
+#include "drivers/contactors/contactors.h"
 #include "drivers/comms/duart.h"
 #include "drivers/sensors/ina228.h"
 #include "drivers/sensors/internal_adc.h"
@@ -8,11 +9,19 @@
 #include "hardware_checks.h"
 #include "config/limits.h"
 #include "config/pins.h"
+#include "estimators/current_history.h"
 #include "estimators/ekf.h"
 #include "estimators/estimators.h"
+#include "estimators/runtime.h"
+#include "estimators/soh.h"
 #include "calibration/offline.h"
+#include "monitoring/cycles.h"
+#include "monitoring/energy.h"
+#include "monitoring/telemetry.h"
 #include "state_machines/contactors.h"
 #include "battery/balancing.h"
+#include "battery/overcurrent_trip.h"
+#include "battery/state_of_power.h"
 #include "battery/safety_checks.h"
 #include "protocols/hmi_serial/hmi_serial.h"
 #include "protocols/internal_serial/internal_serial.h"
@@ -27,16 +36,57 @@
 #include "../../vendor/littlefs/lfs.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 
 #define CRC16_INIT                  ((uint16_t)-1l)
 void memcpy_with_crc16(uint8_t *dest, const uint8_t *src, size_t len, uint16_t *crc16);
 
-extern uint16_t adc_samples_raw[8];
-extern uint32_t adc_samples_smooth_accum[8];
-extern uint16_t adc_samples_smoothed[8];
-extern uint32_t adc_samples_variance_accum[8];
-extern uint16_t adc_samples_variance[8];
-extern millis_t adc_samples_millis[8];
+// A change in current this big between readings counts as a transient, and
+// the INA228 samples quickly for this long afterwards
+#define CURRENT_TRANSIENT_STEP_mA 10000
+#define CURRENT_TRANSIENT_HOLD_MS 2000
+
+// Whether the INA228 should use its fast profile, while the current is (or is
+// about to be) changing quickly
+static bool current_transient(bms_model_t *model) {
+    static int32_t last_current_mA = 0;
+    static millis_t last_current_millis = 0;
+    static millis_t last_step_millis = 0;
+
+    if(model->current_millis != last_current_millis) {
+        if(last_current_millis != 0 && abs(model->current_mA - last_current_mA) >= CURRENT_TRANSIENT_STEP_mA) {
+            last_step_millis = model->current_millis;
+        }
+        last_current_mA = model->current_mA;
+        last_current_millis = model->current_millis;
+    }
+
+    return contactors_transient_expected(model) || (
+        last_step_millis != 0 && millis() - last_step_millis < CURRENT_TRANSIENT_HOLD_MS
+    );
+}
+
+// Keeps the INA228's shunt limits in step with the current limits, and
+// records a trip (opened by ALERT's interrupt or, if that was missed, as soon
+// as polling sees the limit flags)
+static void update_overcurrent_trip(bms_model_t *model) {
+    static overcurrent_trip_t overcurrent_trip;
+    static bool trip_recorded = false;
+    extern ina228_t ina228_dev;
+
+    if(ina228_dev.limit_flags && !contactors_tripped()) {
+        contactors_trip();
+    }
+    if(contactors_tripped() && !trip_recorded) {
+        printf("Overcurrent trip! Current %ld mA\n", (long)model->current_mA);
+        raise_bms_event(ERR_OVERCURRENT_TRIP, ((uint64_t)ina228_dev.limit_flags << 32) | (uint32_t)model->current_mA);
+        trip_recorded = true;
+    }
+
+    if(overcurrent_trip_update(&overcurrent_trip, model, millis())) {
+        overcurrent_trip.programmed = ina228_set_shunt_limits(&ina228_dev, overcurrent_trip.sovl, overcurrent_trip.suvl);
+    }
+}
 
 
 
@@ -54,6 +104,7 @@ void read_inputs(bms_model_t *model) {
 
     int32_t battery_voltage_mul = model->battery_voltage_mul ? model->battery_voltage_mul : 54500;
     model->battery_voltage_millis = ads1115_get_sample_millis(0);
+    model->battery_voltage_us = ads1115_get_sample_us(0);
     model->battery_voltage_mV = ads1115_scaled_sample(0, battery_voltage_mul);//(int32_t)((float)full_scale_mv * 1.0011809966896306f));
     model->battery_voltage_range_mV = ads1115_scaled_sample_range(0, full_scale_mv);
 
@@ -99,17 +150,19 @@ void read_inputs(bms_model_t *model) {
     // model->pos_contactor_voltage_millis = raw_bat_plus_millis < raw_out_plus_millis ? raw_bat_plus_millis : raw_out_plus_millis; // Use older value
 
     // INA228 current and charge readings
+
+    extern ina228_t ina228_dev;
+    ina228_set_profile(&ina228_dev, current_transient(model) ? INA228_PROFILE_FAST : INA228_PROFILE_LOW_NOISE);
     
-    if((timestep() & 0x7) == 0) {
-        // Only query every 160ms or so (readings are available every 531ms but
-        // we want to be sure we don't miss any). This is currently blocking due
-        // to the I2C transaction but doesn't have to wait for the reading
-        // itself.
+    if((timestep() & 0x7) == 0 || ina228_dev.profile == INA228_PROFILE_FAST) {
+        // Only query every 160ms or so (readings are available every 544ms but
+        // we want to be sure we don't miss any), or every tick while sampling
+        // quickly. This is currently blocking due to the I2C transaction but
+        // doesn't have to wait for the reading itself.
 
         // This reads current, and also updates the charge accumulator if it is
         // a new reading
 
-        extern ina228_t ina228_dev;
         if(!ina228_read_current_blocking(&ina228_dev)) {
             printf("INA228 current read failed\n");
         }
@@ -117,6 +170,7 @@ void read_inputs(bms_model_t *model) {
 
     /* Read supply voltages */
 
+    internal_adc_tick();
     model->supply_voltage_3V3_mV = internal_adc_read_3v3_mv();
     model->supply_voltage_3V3_millis = internal_adc_read_3v3_millis();
     model->supply_voltage_5V_mV = internal_adc_read_5v_mv();
@@ -150,34 +204,55 @@ void bms_tick() {
     //model.cell_voltage_slow_mode = true;
     bmb3y_tick(&model);
 
-    // For debugging, prepare for restart (zero current) if 'R' received on USB stdio
-    if(stdio_getchar_timeout_us(0) == 'R') {
+    // For debugging, prepare for restart (zero current) if 'R' received on USB
+    // stdio, or toggle the text debug output with 'T'.
+    int stdio_char = stdio_getchar_timeout_us(0);
+    if(stdio_char == 'R') {
         printf("Preparing to restart due to 'R' on USB stdio\n");
         count_bms_event(ERR_RESTARTING, 1);
+    } else if(stdio_char == 'T') {
+        telemetry_set_text_mode(!telemetry_text_mode());
     }
 
     // Phase 2: Update model
 
-    static int32_t last_charge_raw = 0;
+    static int64_t last_charge_raw = 0;
+    static basic_count_t basic_count;
     millis_t now = millis();
     if(now - model.soc_millis >= 1000) {
+        // Use the current flowing when the cell voltages were snapshotted,
+        // rather than the latest reading, which may be a second apart.
+        int32_t cell_current_mA;
+        if(!current_history_at(model.cell_voltages_us, &cell_current_mA)) {
+            cell_current_mA = model.current_mA;
+        }
         uint32_t soc = ekf_tick(
-            raw_charge_to_mC(model.charge_raw - last_charge_raw),
-            model.current_mA,
+            &ekf_tracker,
+            &model,
+            // (converted separately, so the rounding doesn't build up)
+            raw_charge_to_mC(model.charge_raw) - raw_charge_to_mC(last_charge_raw),
+            cell_current_mA,
             model.cell_voltage_total_mV / NUM_CELLS
         );
         if(soc != 0xFFFFFFFF) {
             model.soc = (uint16_t)soc;
             model.soc_millis = now;
+            sop_tick(&model);
         }
         last_charge_raw = model.charge_raw;
     }
 
+    soh_tick(&model, raw_charge_to_mC(model.charge_raw));
+    cycles_tick(&model);
+    runtime_tick(&model);
+    energy_tick(&model);
+
     model.soc_voltage_based = voltage_based_soc_estimate(&model);
-    model.soc_basic_count = basic_count_soc_estimate(&model);
+    model.soc_basic_count = basic_count_soc_estimate(&basic_count, &model);
     model.soc_fancy_count = fancy_count_soc_estimate(&model);
 
     model_tick(&model);
+    update_overcurrent_trip(&model);
 
     // Phase 3: Checks
 
@@ -194,63 +269,12 @@ void bms_tick() {
     // Phase 5: Comms
 
     inverter_tick(&model);
-    internal_serial_tick();
+    internal_serial_tick(&model);
     hmi_serial_tick(&model);
 
-    // Phase 6: Debug output
-
-    if((timestep() & 0x3f) == 32) {
-        //isosnoop_print_buffer();
-        uint32_t total = 0;
-        for(int i=0; i<NUM_CELLS; i++) {
-            printf("[c%3d]: %4d mV | ", i, model.raw_cell_voltages_mV[i]);
-            total += model.raw_cell_voltages_mV[i];
-            if((i % 5) == 4) {
-                printf("\n");
-            }
-        }
-        printf("Total: %lu mV | Temps: %ddC - %ddC | Delta: %d mV\n\n", 
-            total, 
-            model.temperature_min_dC, model.temperature_max_dC, 
-            model.cell_voltage_max_mV - model.cell_voltage_min_mV
-        );
-
-        //printf("Bal mask: %02X %02X\n", bitmap_set[14], bitmap_set[15]);
-    }
+    // Phase 6: Telemetry
 
-    if((timestep() & 0x3f) == 32) {
-        // every 64 ticks, output stuff
-        //isosnoop_print_buffer();
-        print_bms_events();
-
-        printf("Temp: %3ld dC | 3V3: %4ld mV | 5V: %4ld mV | 12V: %5ld mV | CtrV: %5ld mV\n",
-            get_temperature_c_times10(),
-            model.supply_voltage_3V3_mV,
-            model.supply_voltage_5V_mV,
-            model.supply_voltage_12V_mV,
-            model.supply_voltage_contactor_mV
-        );
-
-        printf("Batt: %6ldmV (%3ldmV) | Out: %6ldmV (%3ldmV) | NegCtr: %6ldmV (%3ldmV) | PosCtr: %6ldmV (%3ldmV)\n",
-            model.battery_voltage_mV,
-            model.battery_voltage_range_mV,
-            model.output_voltage_mV,
-            model.output_voltage_range_mV,
-            model.neg_contactor_voltage_mV,
-            model.neg_contactor_voltage_range_mV,
-            model.pos_contactor_voltage_mV,
-            model.pos_contactor_voltage_range_mV
-        );
-        int64_t charge_mC = raw_charge_to_mC(model.charge_raw);
-        printf("Current: %6ld mA | Charge: %lld mC | SoC: %2.2f %% | SoC(VB): %2.2f %% | SoC(BC): %2.2f %% | SoC(FC): %2.2f %%\n\n",
-            model.current_mA,
-            charge_mC,
-            model.soc / 100.0f,
-            model.soc_voltage_based / 100.0f,
-            model.soc_basic_count / 100.0f,
-            model.soc_fancy_count / 100.0f
-        );
-    }
+    telemetry_tick(&model);
 }
 
 uint32_t average_loop_time_256_ms = 0;
@@ -262,7 +286,10 @@ void synchronize_time() {
 
     int32_t delta = millis() - prev;
     if(delta <= 20) {
+        // HMI requests can be handled straight away while we sleep
+        hmi_serial_set_idle(true);
         sleep_ms(20 - delta);
+        hmi_serial_set_idle(false);
     } else if(model.ignore_missed_deadline) {
         printf("Notice: loop overran but ignored (%ld ms)\n", delta);
     } else {
@@ -0,0 +1,65 @@
+#include "current_history.h"
+
+typedef struct {
+    int32_t current_mA;
+    micros_t measured_us;
+} current_history_entry_t;
+
+static current_history_entry_t history[CURRENT_HISTORY_LEN];
+// Index of the newest entry, and number of valid entries
+static uint8_t newest = 0;
+static uint8_t count = 0;
+
+// Longest we'll hold the newest reading beyond when it was measured
+#define CURRENT_HISTORY_HOLD_US 600000
+
+void current_history_add(int32_t current_mA, micros_t measured_us) {
+    newest = (newest + 1) % CURRENT_HISTORY_LEN;
+    history[newest].current_mA = current_mA;
+    history[newest].measured_us = measured_us;
+    if(count < CURRENT_HISTORY_LEN) {
+        count++;
+    }
+}
+
+bool current_history_at(micros_t t_us, int32_t *current_mA) {
+    if(count == 0) {
+        return false;
+    }
+
+    // Differences are taken as signed so that the microsecond counter wrapping
+    // doesn't matter
+    const current_history_entry_t *after = &history[newest];
+    int32_t since_newest = (int32_t)(t_us - after->measured_us);
+    if(since_newest >= 0) {
+        if(since_newest > CURRENT_HISTORY_HOLD_US) {
+            return false;
+        }
+        *current_mA = after->current_mA;
+        return true;
+    }
+
+    // Walk back to find the pair of readings either side
+    for(uint8_t i = 1; i < count; i++) {
+        const current_history_entry_t *before = &history[(newest + CURRENT_HISTORY_LEN - i) % CURRENT_HISTORY_LEN];
+        int32_t since_before = (int32_t)(t_us - before->measured_us);
+        if(since_before >= 0) {
+            int32_t span = (int32_t)(after->measured_us - before->measured_us);
+            if(span <= 0) {
+                *current_mA = after->current_mA;
+            } else {
+                *current_mA = before->current_mA
+                    + (int32_t)((int64_t)(after->current_mA - before->current_mA) * since_before / span);
+            }
+            return true;
+        }
+        after = before;
+    }
+
+    // Older than anything we have
+    return false;
+}
+
+void current_history_reset() {
+    count = 0;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "../../sys/time/time.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// A short history of current readings, stamped with the instant they were
+// measured, so that voltages taken at a different moment can be paired with
+// the current flowing at the time.
+//
+// Polled every tick while the INA228 is sampling quickly, this covers about 4
+// seconds (and much more at ~544ms per low noise conversion), which is more
+// than the gap between a BMB snapshot and it being read.
+#define CURRENT_HISTORY_LEN 200
+
+void current_history_add(int32_t current_mA, micros_t measured_us);
+
+// Interpolates the current at the given instant. Instants after the newest
+// reading get the newest reading (for up to one conversion period). Returns
+// false if the instant isn't covered by the history.
+bool current_history_at(micros_t t_us, int32_t *current_mA);
+
+void current_history_reset();
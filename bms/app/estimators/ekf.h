@@ -1,32 +1,79 @@
 #pragma once
 
+#include "ocv.h"
+#include "rls.h"
+#include "../../sys/time/time.h"
+
 #include <math.h>
+#include <stdbool.h>
 #include <stdint.h>
 
+#define EKF_STATES 4
+
+// Innovations averaged over this many steps to adapt R, and for the NIS
+#define EKF_INNOVATION_WINDOW 64
+
 typedef struct {
     // --- State Vector x ---
     // x[0] = Ah_used (Consumed Charge in Ah)
     // x[1] = V_c1 (Polarization Voltage in V)
     // x[2] = Capacity (Total Battery Capacity in Ah)
-    float x[3];
+    // x[3] = V_h (Hysteresis Voltage in V, stays zero unless modelled)
+    float x[EKF_STATES];
 
-    // --- Covariance Matrix P (3x3) ---
-    float P[3][3];
+    // --- Covariance Matrix P (4x4) ---
+    float P[EKF_STATES][EKF_STATES];
 
     // --- Tuning Parameters ---
-    float Q[3];    // Process Noise Variances (Diagonal)
+    float Q[EKF_STATES]; // Process Noise Variances (Diagonal)
     float R;       // Measurement Noise Variance
+    float R_effective; // R after adapting to the OCV slope, for the last step
+
+    // Innovation-based adaptation of R: over a window, the mean of y^2 should
+    // be H*P*H' + R, so the difference is an estimate of R that follows the
+    // actual sensor noise (and model error) of this pack. Kept within bounds,
+    // since a short run of good or bad fits shouldn't make the filter ignore
+    // or chase the voltage.
+    bool adapt_R;
+    float R_min;
+    float R_max;
+    float innovation_R[EKF_INNOVATION_WINDOW]; // y^2 - H*P*H', per unit of R
+    float innovation_nis[EKF_INNOVATION_WINDOW]; // y^2 / S
+    uint8_t innovation_index;
+    uint8_t innovation_count;
+    // Mean normalised innovation squared over the window, which is about 1
+    // when the filter's idea of its own uncertainty is consistent with what
+    // it sees, larger when overconfident, smaller when too cautious
+    float nis;
     
     // --- Model Parameters ---
     float R0;      // Ohmic Resistance
     float R1;      // Polarization Resistance
     float C1;      // Polarization Capacitance
 
+    // Online identification of R0/R1/C1, which moves the model parameters
+    // towards what it finds (a little each step)
+    bool identify;
+    rls_t rls;
+
+    // --- Flat-plateau chemistries (zero to disable) ---
+    float hysteresis_V;    // Largest hysteresis voltage (M)
+    float hysteresis_rate; // How fast it builds, per fraction of capacity passed
+    float flat_slope;      // dOCV/dSOC (V) at which R is doubled; R rises as
+                           // (flat_slope / dOCV)^2 as the curve flattens
+
+    // Cell temperature for the OCV model (0.1C units), set before each step
+    int16_t temperature_dC;
+
 } EKF;
 
 // Initialize the filter
 void ekf_init(EKF *ekf, float initial_soc, float initial_capacity);
 
+// Feeds a fresh voltage sample, dt seconds after the last one, to the online
+// identification of R0/R1/C1 (if enabled)
+void ekf_identify(EKF *ekf, float current_amps, float voltage_measured, float dt);
+
 // Run one iteration of the filter
 // current_amps: Positive = Discharge, Negative = Charge
 // voltage_measured: Terminal voltage
@@ -35,4 +82,26 @@ void ekf_step(EKF *ekf, float charge_Ah, float current_amps, float voltage_measu
 // Helper to get current SOC
 float ekf_get_soc(EKF *ekf);
 
-uint32_t ekf_tick(int32_t charge_mC, int32_t current_mA, int32_t voltage_mV);
+typedef struct bms_model bms_model_t;
+
+// Everything ekf_tick() keeps between calls. The firmware runs the one below,
+// but keeping it all here means several filters can run side by side (eg,
+// when replaying logs on the host with different tunings).
+typedef struct {
+    bool initialized;
+    EKF ekf;
+    ocv_scaling_t scaling;
+    // The cell voltage snapshot last used for identification
+    millis_t voltages_millis;
+    micros_t voltages_us;
+} ekf_tracker_t;
+
+extern ekf_tracker_t ekf_tracker;
+
+// Starts the filter from the first voltage seen, then steps it. Returns the
+// SoC (0.01%, scaled to the model's working voltage range), or 0xFFFFFFFF
+// until started. Sets the model's working capacity.
+uint32_t ekf_tick(ekf_tracker_t *tracker, bms_model_t *model, int32_t charge_mC, int32_t current_mA, int32_t voltage_mV);
+
+// The filter run by the firmware's ekf_tick(), or NULL until it has started
+const EKF *ekf_instance_get();
@@ -0,0 +1,205 @@
+#include "ocv.h"
+
+#include "app/model.h"
+#include "config/limits.h"
+
+#if CHEMISTRY == LFP
+
+// Only the 25C curve has been characterised so far. Add columns here (in
+// ascending temperature order) as they are measured.
+static const int16_t chemistry_temperatures_dC[] = { 250 };
+static const int32_t chemistry_ocv_uV[][OCV_SOC_POINTS] = {
+    {
+        2508271, 2812775, 2925628, 2999236, 3054360, 3098886, 3135581, 3166604,
+        3191731, 3204600, 3209403, 3212333, 3214945, 3217512, 3220779, 3225805,
+        3231128, 3236077, 3240438, 3244875, 3249335, 3253618, 3257502, 3261238,
+        3264333, 3267539, 3270554, 3273410, 3275911, 3278634, 3281250, 3283789,
+        3286565, 3289081, 3291754, 3294386, 3297239, 3299398, 3300897, 3301910,
+        3302609, 3303260, 3303545, 3304045, 3304385, 3304693, 3304864, 3305259,
+        3305502, 3305924, 3306222, 3306381, 3306820, 3307085, 3307309, 3307626,
+        3307784, 3308141, 3308477, 3308877, 3309257, 3309655, 3310021, 3310649,
+        3311156, 3311854, 3312541, 3313612, 3314686, 3316326, 3318527, 3321370,
+        3325735, 3330955, 3335828, 3339468, 3341662, 3342898, 3343646, 3344197,
+        3344746, 3344967, 3345532, 3345869, 3346475, 3346819, 3347318, 3347889,
+        3348493, 3349416, 3350183, 3351313, 3353014, 3355037, 3358201, 3363195,
+        3370595, 3383339, 3406874, 3452163, 3543373,
+    },
+};
+// The plateau is very flat, so the inverse needs a finer grid than NMC
+#define INVERSE_STEP_uV 1000
+#define INVERSE_POINTS 1045 // up to 3544mV, just above the top of the curve
+
+#elif CHEMISTRY == NMC
+
+// Only the 25C curve has been characterised so far. Add columns here (in
+// ascending temperature order) as they are measured.
+static const int16_t chemistry_temperatures_dC[] = { 250 };
+static const int32_t chemistry_ocv_uV[][OCV_SOC_POINTS] = {
+    {
+        2500058, 3100319, 3246258, 3336186, 3400734, 3448974, 3468939, 3473951,
+        3478644, 3483337, 3488341, 3494095, 3501300, 3509671, 3519316, 3529770,
+        3539577, 3549364, 3559795, 3568460, 3576216, 3585624, 3595204, 3601268,
+        3605411, 3609241, 3612640, 3615736, 3618670, 3621648, 3624292, 3627130,
+        3629794, 3632707, 3635403, 3638209, 3641048, 3643735, 3646666, 3649649,
+        3652612, 3655687, 3659109, 3662443, 3666044, 3669604, 3673416, 3677559,
+        3682025, 3686643, 3691444, 3697044, 3702669, 3709699, 3717402, 3727371,
+        3739535, 3750546, 3758896, 3766541, 3773823, 3781429, 3789224, 3797289,
+        3805644, 3814433, 3823020, 3832082, 3841145, 3850591, 3860394, 3869975,
+        3880146, 3889982, 3900011, 3910239, 3920536, 3930828, 3941247, 3951799,
+        3962353, 3973037, 3983777, 3994560, 4005727, 4017051, 4028059, 4039549,
+        4051005, 4062431, 4074342, 4086186, 4098163, 4110364, 4122569, 4135029,
+        4147749, 4160339, 4173480, 4186524, 4200086,
+    },
+};
+// A 2mV grid keeps the error against the piecewise-linear curve well under
+// 0.1% SoC
+#define INVERSE_STEP_uV 2000
+#define INVERSE_POINTS 852 // up to 4202mV, just above the top of the curve
+
+#endif
+
+#define TEMPERATURE_POINTS (sizeof(chemistry_temperatures_dC) / sizeof(chemistry_temperatures_dC[0]))
+
+static uint16_t chemistry_inverse[TEMPERATURE_POINTS * INVERSE_POINTS];
+
+ocv_table_t ocv_table = {
+    .temperature_points = TEMPERATURE_POINTS,
+    .temperatures_dC = chemistry_temperatures_dC,
+    .ocv_uV = &chemistry_ocv_uV[0][0],
+    .inverse_min_uV = 2500000,
+    .inverse_step_uV = INVERSE_STEP_uV,
+    .inverse_points = INVERSE_POINTS,
+    .inverse = chemistry_inverse,
+};
+
+// Finds the temperature column at or below the given temperature, and how far
+// towards the next column it lies (in 1/256ths). Temperatures beyond the ends
+// of the table use the end columns.
+static int find_temperature(const ocv_table_t *table, int16_t temperature_dC, int32_t *frac) {
+    *frac = 0;
+    if (table->temperature_points < 2 || temperature_dC <= table->temperatures_dC[0]) {
+        return 0;
+    }
+    int i = 0;
+    while (i < table->temperature_points - 2 && temperature_dC >= table->temperatures_dC[i + 1]) {
+        i++;
+    }
+    int32_t span = table->temperatures_dC[i + 1] - table->temperatures_dC[i];
+    int32_t offset = temperature_dC - table->temperatures_dC[i];
+    *frac = offset >= span ? 256 : offset * 256 / span;
+    return i;
+}
+
+static inline int32_t blend(int32_t a, int32_t b, int32_t frac) {
+    return a + (b - a) * frac / 256;
+}
+
+// Interpolates the OCV in one temperature column
+static int32_t column_ocv(const int32_t *column, uint16_t soc) {
+    if (soc > 10000) soc = 10000;
+    int i = soc / 100;
+    if (i >= OCV_SOC_POINTS - 1) i = OCV_SOC_POINTS - 2;
+    return column[i] + (column[i + 1] - column[i]) * (soc - i * 100) / 100;
+}
+
+static int32_t column_slope(const int32_t *column, uint16_t soc) {
+    if (soc > 10000) soc = 10000;
+    int i = soc / 100;
+    if (i >= OCV_SOC_POINTS - 1) i = OCV_SOC_POINTS - 2;
+    return column[i + 1] - column[i];
+}
+
+int32_t ocv_table_from_soc(const ocv_table_t *table, uint16_t soc, int16_t temperature_dC) {
+    int32_t frac;
+    int t = find_temperature(table, temperature_dC, &frac);
+    int32_t lower = column_ocv(&table->ocv_uV[t * OCV_SOC_POINTS], soc);
+    if (frac == 0) return lower;
+    int32_t upper = column_ocv(&table->ocv_uV[(t + 1) * OCV_SOC_POINTS], soc);
+    return blend(lower, upper, frac);
+}
+
+int32_t ocv_table_slope(const ocv_table_t *table, uint16_t soc, int16_t temperature_dC) {
+    int32_t frac;
+    int t = find_temperature(table, temperature_dC, &frac);
+    int32_t lower = column_slope(&table->ocv_uV[t * OCV_SOC_POINTS], soc);
+    if (frac == 0) return lower;
+    int32_t upper = column_slope(&table->ocv_uV[(t + 1) * OCV_SOC_POINTS], soc);
+    return blend(lower, upper, frac);
+}
+
+static void build_inverse(ocv_table_t *table) {
+    for (int t = 0; t < table->temperature_points; t++) {
+        const int32_t *column = &table->ocv_uV[t * OCV_SOC_POINTS];
+        uint16_t *inverse = &table->inverse[t * table->inverse_points];
+
+        // The grid and the curve are both ascending, so walk them together
+        int i = 0;
+        for (int j = 0; j < table->inverse_points; j++) {
+            int32_t v = table->inverse_min_uV + j * table->inverse_step_uV;
+            while (i < OCV_SOC_POINTS - 2 && v >= column[i + 1]) i++;
+
+            if (v <= column[0]) {
+                inverse[j] = 0;
+            } else if (v >= column[OCV_SOC_POINTS - 1]) {
+                inverse[j] = 65535;
+            } else {
+                int64_t span = column[i + 1] - column[i];
+                int64_t q = ((int64_t)i * span + (v - column[i])) * 65535 / (span * (OCV_SOC_POINTS - 1));
+                inverse[j] = (uint16_t)q;
+            }
+        }
+    }
+    table->inverse_built = true;
+}
+
+// Returns SoC in 1/65535 units
+static int32_t column_inverse(const ocv_table_t *table, int t, int32_t ocv_uV) {
+    const uint16_t *inverse = &table->inverse[t * table->inverse_points];
+    int32_t offset_uV = ocv_uV - table->inverse_min_uV;
+    if (offset_uV <= 0) return inverse[0];
+    int32_t idx = offset_uV / table->inverse_step_uV;
+    if (idx >= table->inverse_points - 1) return inverse[table->inverse_points - 1];
+
+    int32_t lower = inverse[idx];
+    int32_t upper = inverse[idx + 1];
+    return lower + (upper - lower) * (offset_uV - idx * table->inverse_step_uV) / table->inverse_step_uV;
+}
+
+uint16_t ocv_table_to_soc(ocv_table_t *table, int32_t ocv_uV, int16_t temperature_dC) {
+    if (!table->inverse_built) {
+        build_inverse(table);
+    }
+
+    int32_t frac;
+    int t = find_temperature(table, temperature_dC, &frac);
+    int32_t q = column_inverse(table, t, ocv_uV);
+    if (frac != 0) {
+        q = blend(q, column_inverse(table, t + 1, ocv_uV), frac);
+    }
+    return (uint16_t)((q * 10000 + 32767) / 65535);
+}
+
+int16_t ocv_model_temperature_dC(const bms_model_t *model) {
+    if (model->temperature_millis == 0) {
+        return OCV_DEFAULT_TEMPERATURE_dC;
+    }
+    return (model->temperature_min_dC + model->temperature_max_dC) / 2;
+}
+
+bool ocv_scaling_update(ocv_scaling_t *scaling, uint16_t min_mV, uint16_t max_mV) {
+    if (scaling->soc_max != 0 && min_mV == scaling->min_mV && max_mV == scaling->max_mV) {
+        return false;
+    }
+    scaling->soc_min = ocv_mV_to_soc(min_mV, OCV_DEFAULT_TEMPERATURE_dC);
+    scaling->soc_max = ocv_mV_to_soc(max_mV, OCV_DEFAULT_TEMPERATURE_dC);
+    scaling->min_mV = min_mV;
+    scaling->max_mV = max_mV;
+    return true;
+}
+
+uint16_t ocv_to_soc_scaled(const ocv_scaling_t *scaling, int32_t ocv_uV, int16_t temperature_dC) {
+    int32_t soc = ocv_to_soc(ocv_uV, temperature_dC);
+    if (soc <= scaling->soc_min || scaling->soc_max <= scaling->soc_min) return 0;
+    if (soc >= scaling->soc_max) return 10000;
+    return (uint16_t)((soc - scaling->soc_min) * 10000 / (scaling->soc_max - scaling->soc_min));
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct bms_model bms_model_t;
+
+// Open-circuit voltage model for the cell chemistry selected by CHEMISTRY in
+// limits.h. The OCV is tabulated at every 1% SoC for one or more temperatures,
+// and interpolated bilinearly in fixed point. The table is chosen at compile
+// time, so there's no dispatch at runtime.
+//
+// Units are as elsewhere: SoC in 0.01%, temperature in 0.1C, and voltage in uV
+// (so that the flat part of the LFP curve isn't lost to rounding).
+
+#define OCV_SOC_POINTS 101
+
+// Temperature to use when we don't have one (and at which the working voltage
+// range is defined)
+#define OCV_DEFAULT_TEMPERATURE_dC 250
+
+typedef struct {
+    uint8_t temperature_points;
+    const int16_t *temperatures_dC; // ascending
+    const int32_t *ocv_uV; // [temperature_points][OCV_SOC_POINTS]
+
+    // Inverse tables (SoC in 1/65535 units) on a uniform voltage grid, one per
+    // temperature, so that OCV->SoC is a single interpolation rather than a
+    // search. These are built on first use.
+    int32_t inverse_min_uV;
+    int32_t inverse_step_uV;
+    uint16_t inverse_points;
+    uint16_t *inverse; // [temperature_points][inverse_points]
+    bool inverse_built;
+} ocv_table_t;
+
+// The table for the configured chemistry
+extern ocv_table_t ocv_table;
+
+int32_t ocv_table_from_soc(const ocv_table_t *table, uint16_t soc, int16_t temperature_dC);
+// dOCV/dSoC, in uV per 1% SoC
+int32_t ocv_table_slope(const ocv_table_t *table, uint16_t soc, int16_t temperature_dC);
+uint16_t ocv_table_to_soc(ocv_table_t *table, int32_t ocv_uV, int16_t temperature_dC);
+
+static inline int32_t ocv_from_soc(uint16_t soc, int16_t temperature_dC) {
+    return ocv_table_from_soc(&ocv_table, soc, temperature_dC);
+}
+
+static inline int32_t ocv_slope(uint16_t soc, int16_t temperature_dC) {
+    return ocv_table_slope(&ocv_table, soc, temperature_dC);
+}
+
+static inline uint16_t ocv_to_soc(int32_t ocv_uV, int16_t temperature_dC) {
+    return ocv_table_to_soc(&ocv_table, ocv_uV, temperature_dC);
+}
+
+static inline uint16_t ocv_mV_to_soc(int32_t ocv_mV, int16_t temperature_dC) {
+    // Keep the conversion to uV from overflowing
+    if (ocv_mV < 0) ocv_mV = 0;
+    if (ocv_mV > 10000) ocv_mV = 10000;
+    return ocv_to_soc(ocv_mV * 1000, temperature_dC);
+}
+
+// The temperature to look the OCV up at: the middle of the measured range, or
+// the default until we have readings.
+int16_t ocv_model_temperature_dC(const bms_model_t *model);
+
+// The SoC range covered by a working voltage range, for rescaling SoC to it.
+// Each user keeps its own, so they don't invalidate each other's.
+typedef struct {
+    uint16_t min_mV;
+    uint16_t max_mV;
+    uint16_t soc_min; // in 0.01% units
+    uint16_t soc_max; // in 0.01% units, or zero if not yet set up
+} ocv_scaling_t;
+
+// Updates the scaling for a new voltage range. Returns true if it changed.
+bool ocv_scaling_update(ocv_scaling_t *scaling, uint16_t min_mV, uint16_t max_mV);
+// OCV to SoC (in 0.01% units) rescaled to the working voltage range
+uint16_t ocv_to_soc_scaled(const ocv_scaling_t *scaling, int32_t ocv_uV, int16_t temperature_dC);
@@ -0,0 +1,196 @@
+#include "rls.h"
+
+#include <math.h>
+#include <string.h>
+
+// Forgets with a time constant of about an hour of excitation
+#define RLS_LAMBDA 0.9997f
+// A change in current this big (A) counts as a step
+#define RLS_MIN_STEP_A 1.0f
+// How long (samples) to keep updating after a step, long enough to see the
+// polarization relax
+#define RLS_WINDOW 300
+// Starting covariance, ie, how little the initial parameters are trusted
+#define RLS_INITIAL_P 100.0f
+// Sample period assumed until the first pair of samples says otherwise (s)
+#define RLS_INITIAL_DT 1.0f
+// How far (fraction) a gap between samples can be from the sample period and
+// still count as the next sample
+#define RLS_DT_TOLERANCE 0.1f
+
+// Limits on the identified parameters (per cell)
+#define RLS_R_MIN 0.0001f
+#define RLS_R_MAX 0.1f
+#define RLS_TAU_MIN 5.0f
+#define RLS_TAU_MAX 3000.0f
+
+static float clampf(float v, float lo, float hi) {
+    return v < lo ? lo : (v > hi ? hi : v);
+}
+
+// Sets the regression coefficients from the RC model, for samples dt apart
+static void rls_set_theta(rls_t *rls, float R0, float R1, float C1, float dt) {
+    float a = expf(-dt / (R1 * C1));
+    rls->theta[0] = a;
+    rls->theta[1] = R0 + R1 * (1.0f - a);
+    rls->theta[2] = -a * R0;
+    rls->dt = dt;
+}
+
+void rls_init(rls_t *rls, float R0, float R1, float C1) {
+    memset(rls, 0, sizeof(*rls));
+    rls->lambda = RLS_LAMBDA;
+
+    rls_set_theta(rls, R0, R1, C1, RLS_INITIAL_DT);
+    for(int i=0; i<RLS_PARAMS; i++) {
+        rls->P[i][i] = RLS_INITIAL_P;
+    }
+
+    rls->R0 = R0;
+    rls->R1 = R1;
+    rls->C1 = C1;
+    rls->since_step = RLS_WINDOW;
+}
+
+static bool rls_period_matches(const rls_t *rls, float dt) {
+    return fabsf(dt - rls->dt) <= rls->dt * RLS_DT_TOLERANCE;
+}
+
+// Turns the regression coefficients back into the RC model, if they make
+// physical sense
+static bool rls_extract(rls_t *rls) {
+    float a = rls->theta[0];
+    float b0 = rls->theta[1];
+    float b1 = rls->theta[2];
+    if(a <= 0.0f || a >= 1.0f) {
+        return false;
+    }
+
+    float R0 = -b1 / a;
+    float R1 = (b0 - R0) / (1.0f - a);
+    if(R0 <= 0.0f || R1 <= 0.0f) {
+        return false;
+    }
+
+    float tau = -rls->dt / logf(a);
+    R0 = clampf(R0, RLS_R_MIN, RLS_R_MAX);
+    R1 = clampf(R1, RLS_R_MIN, RLS_R_MAX);
+    tau = clampf(tau, RLS_TAU_MIN, RLS_TAU_MAX);
+
+    rls->R0 = R0;
+    rls->R1 = R1;
+    rls->C1 = tau / R1;
+    return true;
+}
+
+bool rls_step(rls_t *rls, float current_amps, float voltage, float dt) {
+    if(rls->samples == 2 && !rls_period_matches(rls, dt)) {
+        // A gap (eg, a missed snapshot, or a pause for balancing), so start
+        // the differences again from here
+        rls->samples = 0;
+    }
+    if(rls->samples < 2) {
+        if(rls->samples == 1) {
+            if(!rls_period_matches(rls, dt)) {
+                // Samples now come at a different rate, so carry what's been
+                // learnt over to it
+                rls_set_theta(rls, rls->R0, rls->R1, rls->C1, dt);
+            }
+            rls->dv = voltage - rls->voltage;
+            rls->di = current_amps - rls->current;
+            rls->dv_model = rls->dv;
+        }
+        rls->samples++;
+        rls->voltage = voltage;
+        rls->current = current_amps;
+        return false;
+    }
+
+    float dv = voltage - rls->voltage;
+    float di = current_amps - rls->current;
+    // Regressors, from the previous differences
+    float phi[RLS_PARAMS] = {rls->dv, di, rls->di};
+    // Instruments: the same, but with the voltage difference the model
+    // predicts from the current alone, which is free of measurement noise
+    float z[RLS_PARAMS] = {rls->dv_model, di, rls->di};
+
+    float dv_model = 0.0f;
+    for(int i=0; i<RLS_PARAMS; i++) {
+        dv_model += rls->theta[i] * z[i];
+    }
+
+    rls->voltage = voltage;
+    rls->current = current_amps;
+    rls->dv = dv;
+    rls->di = di;
+    rls->dv_model = dv_model;
+
+    if(fabsf(di) >= RLS_MIN_STEP_A) {
+        rls->since_step = 0;
+    } else if(rls->since_step < RLS_WINDOW) {
+        rls->since_step++;
+    }
+    if(rls->since_step >= RLS_WINDOW) {
+        return false;
+    }
+
+    // K = P*z / (lambda + phi'*P*z)
+    float Pz[RLS_PARAMS];
+    for(int i=0; i<RLS_PARAMS; i++) {
+        Pz[i] = 0.0f;
+        for(int j=0; j<RLS_PARAMS; j++) {
+            Pz[i] += rls->P[i][j] * z[j];
+        }
+    }
+    float denom = rls->lambda;
+    for(int i=0; i<RLS_PARAMS; i++) {
+        denom += phi[i] * Pz[i];
+    }
+    if(fabsf(denom) < 1e-9f) {
+        return false;
+    }
+
+    float error = dv;
+    for(int i=0; i<RLS_PARAMS; i++) {
+        error -= rls->theta[i] * phi[i];
+    }
+
+    float K[RLS_PARAMS];
+    for(int i=0; i<RLS_PARAMS; i++) {
+        K[i] = Pz[i] / denom;
+        rls->theta[i] += K[i] * error;
+    }
+
+    // P = (P - K*phi'*P) / lambda
+    float phiP[RLS_PARAMS];
+    for(int j=0; j<RLS_PARAMS; j++) {
+        phiP[j] = 0.0f;
+        for(int i=0; i<RLS_PARAMS; i++) {
+            phiP[j] += phi[i] * rls->P[i][j];
+        }
+    }
+    for(int i=0; i<RLS_PARAMS; i++) {
+        for(int j=0; j<RLS_PARAMS; j++) {
+            rls->P[i][j] = (rls->P[i][j] - K[i] * phiP[j]) / rls->lambda;
+        }
+    }
+
+    // Don't let the covariance grow past where it started, in case the
+    // excitation is poor for a long time
+    float max_p = 0.0f;
+    for(int i=0; i<RLS_PARAMS; i++) {
+        if(rls->P[i][i] > max_p) max_p = rls->P[i][i];
+    }
+    if(max_p > RLS_INITIAL_P) {
+        float scale = RLS_INITIAL_P / max_p;
+        for(int i=0; i<RLS_PARAMS; i++) {
+            for(int j=0; j<RLS_PARAMS; j++) {
+                rls->P[i][j] *= scale;
+            }
+        }
+    }
+
+    rls->updates++;
+    rls->valid = rls_extract(rls);
+    return rls->valid;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Online identification of the cell's first-order RC model (R0 in series with
+// R1 || C1) by recursive least squares, with a forgetting factor so that it
+// follows the cell as temperature and age change it.
+//
+// Sampled every dt seconds, the model is
+//
+//   V(k) = OCV + a*(V(k-1) - OCV) + b0*I(k) + b1*I(k-1)
+//
+// where a = exp(-dt/(R1*C1)), b0 = R0 + R1*(1-a) and b1 = -a*R0. Taking
+// differences between samples cancels the OCV (which barely moves in a
+// second), leaving
+//
+//   dV(k) = a*dV(k-1) + b0*dI(k) + b1*dI(k-1)
+//
+// which is linear in the parameters, so doesn't depend on the SoC estimate.
+//
+// That only holds for evenly spaced samples, so each sample must be a fresh
+// measurement (not a repeat of the last one), and a gap that doesn't match
+// the sample period starts the differences again. If the period itself
+// changes (eg, the BMBs going into slow mode), the parameters are carried
+// over to the new one.
+//
+// Plain least squares would be biased by the noise on dV(k-1) (even just the
+// 1mV resolution of the cell voltages halves the time constant it finds), so
+// this uses instrumental variables: dV(k-1) is correlated against the model's
+// own noise-free prediction of it instead.
+//
+// The estimate only improves while the current is changing, so updates are
+// made for a while after each current step, and not otherwise (which would
+// just fit the noise, and let the covariance wind up).
+
+#define RLS_PARAMS 3
+
+typedef struct {
+    float theta[RLS_PARAMS]; // a, b0, b1
+    float P[RLS_PARAMS][RLS_PARAMS];
+    float lambda; // forgetting factor
+
+    // Previous sample, and previous differences
+    float voltage;
+    float current;
+    float dv;
+    float di;
+    float dv_model; // dv as predicted by the model
+    uint8_t samples; // up to 2, until the differences are valid
+    float dt; // sample period (s) that theta is for
+
+    uint16_t since_step; // samples since the last current step
+    uint32_t updates;
+
+    // The model parameters from the latest estimate, clamped to sane values.
+    // Only meaningful if valid is set.
+    float R0;
+    float R1;
+    float C1;
+    bool valid;
+} rls_t;
+
+// Starts from (and trusts a little) the given parameters
+void rls_init(rls_t *rls, float R0, float R1, float C1);
+
+// Adds a fresh sample (current positive when charging), taken dt seconds after
+// the last one (ignored for the first). Returns true if the parameters were
+// updated.
+bool rls_step(rls_t *rls, float current_amps, float voltage, float dt);
@@ -0,0 +1,135 @@
+#include "runtime.h"
+
+#include "ocv.h"
+#include "../model.h"
+#include "../battery/state_of_power.h"
+#include "../../config/limits.h"
+
+#include <math.h>
+
+static int64_t power_trend_fixed = 0; // the trend, in 1/65536 mW
+static millis_t last_current_millis = 0;
+static millis_t last_soc_millis = 0;
+static ocv_scaling_t scaling;
+
+uint32_t runtime_to_limit_s(float distance, float end_distance, float current_A, float capacity_Ah, float taper_A, float taper_distance) {
+    if(distance <= end_distance) {
+        return 0;
+    }
+    if(end_distance < 0.001f) {
+        // The derate would never quite get there
+        end_distance = 0.001f;
+    }
+
+    // Where the derate drops below the current being drawn
+    float knee = current_A / taper_A;
+    if(knee > taper_distance) {
+        knee = taper_distance;
+    }
+    if(knee < end_distance) {
+        knee = end_distance;
+    }
+
+    float seconds = 0.0f;
+    if(distance > knee) {
+        seconds += (distance - knee) * capacity_Ah * 3600.0f / current_A;
+        distance = knee;
+    }
+    if(distance > end_distance) {
+        seconds += capacity_Ah * 3600.0f / taper_A * logf(distance / end_distance);
+    }
+    return seconds >= (float)(RUNTIME_UNKNOWN - 1) ? RUNTIME_UNKNOWN - 1 : (uint32_t)seconds;
+}
+
+// The state of power only gives today's limit, so assume (like the cell
+// voltage derates) that it falls in proportion to the distance left from here
+static void runtime_sop_taper(uint16_t sop_limit_dA, float distance, float *taper_A, float *taper_distance) {
+    if(distance < 0.001f) {
+        distance = 0.001f;
+    }
+    float limit_A = sop_limit_dA > 0 ? sop_limit_dA / 10.0f : 0.1f;
+    *taper_A = limit_A / distance;
+    *taper_distance = distance;
+}
+
+// Recomputes the predictions from the trend, once a second
+static void update_predictions(bms_model_t *model) {
+    model->time_to_empty_s = RUNTIME_UNKNOWN;
+    model->time_to_full_s = RUNTIME_UNKNOWN;
+    if(model->battery_voltage_mV <= 0) {
+        return;
+    }
+
+    int32_t current_mA = (int64_t)model->power_trend_mW * 1000 / model->battery_voltage_mV;
+    if(current_mA > -RUNTIME_IDLE_mA && current_mA < RUNTIME_IDLE_mA) {
+        return;
+    }
+
+    uint16_t working_min_mV = model->cell_voltage_working_min_mV ? model->cell_voltage_working_min_mV : CELL_VOLTAGE_WORKING_MIN_mV;
+    uint16_t working_max_mV = model->cell_voltage_working_max_mV ? model->cell_voltage_working_max_mV : CELL_VOLTAGE_WORKING_MAX_mV;
+    ocv_scaling_update(&scaling, working_min_mV, working_max_mV);
+
+    // The SoC over the whole OCV curve, which is what the derates work in
+    int16_t temperature_dC = ocv_model_temperature_dC(model);
+    float soc = (scaling.soc_min + (float)model->soc * (scaling.soc_max - scaling.soc_min) / 10000.0f) / 10000.0f;
+    uint32_t capacity_mC = model->capacity_mC ? model->capacity_mC : model->nameplate_capacity_mC;
+    float capacity_Ah = capacity_mC / 3600000.0f;
+
+    // Same choice of limit as model_calculate_cell_current_limits: the state
+    // of power while it's fresh, otherwise the cell voltage derates
+    bool sop_fresh = millis_recent_enough(model->sop_millis, SOP_STALE_MS);
+
+    if(current_mA > 0) {
+        float distance = 1.0f - soc;
+        float taper_A, taper_distance;
+        if(sop_fresh) {
+            runtime_sop_taper(model->sop_charge_current_limit_dA[SOP_LIMIT_HORIZON], distance, &taper_A, &taper_distance);
+        } else {
+            taper_A = CHARGE_CELL_VOLTAGE_DERATE_dA_PER_SoC * 10.0f;
+            taper_distance = 1.0f - ocv_mV_to_soc(CHARGE_CELL_VOLTAGE_DERATE_START_mV, temperature_dC) / 10000.0f;
+        }
+        model->time_to_full_s = runtime_to_limit_s(distance, 1.0f - scaling.soc_max / 10000.0f,
+            current_mA / 1000.0f, capacity_Ah, taper_A, taper_distance);
+    } else {
+        float distance = soc;
+        float taper_A, taper_distance;
+        if(sop_fresh) {
+            runtime_sop_taper(model->sop_discharge_current_limit_dA[SOP_LIMIT_HORIZON], distance, &taper_A, &taper_distance);
+        } else {
+            taper_A = DISCHARGE_CELL_VOLTAGE_DERATE_dA_PER_SoC * 10.0f;
+            taper_distance = ocv_mV_to_soc(DISCHARGE_CELL_VOLTAGE_DERATE_START_mV, temperature_dC) / 10000.0f;
+        }
+        model->time_to_empty_s = runtime_to_limit_s(distance, scaling.soc_min / 10000.0f,
+            -current_mA / 1000.0f, capacity_Ah, taper_A, taper_distance);
+    }
+}
+
+void runtime_tick(bms_model_t *model) {
+    if(model->current_millis != last_current_millis && model->battery_voltage_mV > 0) {
+        int64_t power_fixed = ((int64_t)model->battery_voltage_mV * model->current_mA / 1000) * 65536;
+        if(last_current_millis == 0) {
+            // Start the trend from the first reading
+            power_trend_fixed = power_fixed;
+        } else {
+            // Weighted by the time since the last reading, since readings come
+            // every conversion (~544ms) normally, but every tick while the
+            // INA228 is following a transient
+            uint32_t elapsed_ms = model->current_millis - last_current_millis;
+            if(elapsed_ms > RUNTIME_TREND_MS) {
+                elapsed_ms = RUNTIME_TREND_MS;
+            }
+            power_trend_fixed += (power_fixed - power_trend_fixed) * elapsed_ms / RUNTIME_TREND_MS;
+        }
+        model->power_trend_mW = (int32_t)(power_trend_fixed / 65536);
+        last_current_millis = model->current_millis;
+    }
+
+    if(model->soc_millis == 0) {
+        // (the model starts zeroed, which would read as empty and full)
+        model->time_to_empty_s = RUNTIME_UNKNOWN;
+        model->time_to_full_s = RUNTIME_UNKNOWN;
+    } else if(model->soc_millis != last_soc_millis) {
+        last_soc_millis = model->soc_millis;
+        update_predictions(model);
+    }
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+
+typedef struct bms_model bms_model_t;
+
+// Time to empty and time to full, at the present load.
+//
+// The pack power is averaged (exponentially, in integer maths, weighted by
+// the time between INA228 conversions), so a brief spike doesn't swing the
+// prediction. Once a second, when the SoC updates, that power is turned into
+// a current at the present pack voltage and run against the working capacity
+// left. Near the ends of the SoC range, the current limit (the state of power
+// while it's fresh, otherwise the cell voltage derate in current_limits.c)
+// falls in proportion to the capacity left (or room left), so the last
+// stretch is an exponential tail rather than a straight line.
+
+// Reported when not charging (for time to full) or discharging (for time to
+// empty), or nothing is known yet
+#define RUNTIME_UNKNOWN 0xFFFFFFFF
+
+// Pack currents below this (mA) count as idle
+#define RUNTIME_IDLE_mA 1000
+
+// Time constant of the power trend (ms), about 128 low noise conversions
+#define RUNTIME_TREND_MS 64000
+
+void runtime_tick(bms_model_t *model);
+
+// The seconds to take a charge or discharge from the given distance to the
+// end of the range (as a fraction of the capacity) down to end_distance, at
+// current_A, where the derate limits the current to taper_A times the
+// distance once it falls below taper_distance.
+uint32_t runtime_to_limit_s(float distance, float end_distance, float current_A, float capacity_Ah, float taper_A, float taper_distance);
@@ -0,0 +1,257 @@
+#include "soh.h"
+
+#include "current_history.h"
+#include "ocv.h"
+#include "../model.h"
+#include "../../config/limits.h"
+#include "../../drivers/chip/nvm.h"
+
+#include <stdlib.h>
+
+soh_state_t soh_state;
+
+// The current has to stay below this for SOH_REST_TIME_MS before the cell
+// voltages are taken as the OCV
+#define SOH_REST_CURRENT_mA 2000
+#define SOH_REST_TIME_MS (30 * 60 * 1000)
+// Rests where the OCV curve is flatter than this (uV per 1%) can't pin down
+// the SoC well enough, so are ignored (which rules out the LFP plateau)
+#define SOH_REST_MIN_SLOPE_uV 2000
+// Coulomb counting drifts, so don't pair rests further apart than this
+#define SOH_REST_MAX_AGE_MS (3 * 24 * 60 * 60 * 1000)
+// Capacity estimates outside this range of nameplate (in %) are discarded
+#define SOH_CAPACITY_MIN_PERCENT 50
+#define SOH_CAPACITY_MAX_PERCENT 120
+// About three full cycles' worth
+#define SOH_CAPACITY_WEIGHT_MAX 30000
+
+// Voltage/current pairs further apart than this aren't a step
+#define SOH_RESISTANCE_MAX_GAP_MS 2000
+#define SOH_RESISTANCE_MAX_uOhm 1000000
+// Resistance depends strongly on temperature, so only measure it near 25C
+#define SOH_RESISTANCE_MIN_TEMPERATURE_dC 150
+#define SOH_RESISTANCE_MAX_TEMPERATURE_dC 350
+// A couple of hundred modest steps' worth
+#define SOH_RESISTANCE_WEIGHT_MAX 20000
+// The average after this many steps is taken as the as-new resistance
+#define SOH_RESISTANCE_BASELINE_COUNT 20
+
+// Flash writes are slow, so resistance updates are only saved this often
+// (capacity updates are rare enough to save straight away)
+#define SOH_SAVE_INTERVAL_MS (60 * 60 * 1000)
+
+// The previous rest, waiting for a later one to pair with
+static bool have_rest = false;
+static uint16_t rest_soc;
+static int64_t rest_charge_mC;
+static millis_t rest_millis;
+
+// The previous voltage/current pair
+static bool have_sample = false;
+static int32_t sample_voltage_mV;
+static int32_t sample_current_mA;
+static millis_t sample_millis;
+
+// The rest in progress
+static bool resting = false;
+static millis_t resting_since;
+static bool rest_pending = false;
+static uint16_t pending_soc;
+static int32_t pending_slope_uV;
+static int64_t pending_charge_mC;
+
+static millis_t last_voltage_millis = 0;
+static millis_t last_save_millis = 0;
+static bool unsaved = false;
+
+static uint32_t blend(uint32_t value, uint32_t *weight, uint32_t estimate, uint32_t estimate_weight, uint32_t max_weight) {
+    uint64_t total = (uint64_t)*weight + estimate_weight;
+    if(total == 0) {
+        return value;
+    }
+    value = ((uint64_t)value * *weight + (uint64_t)estimate * estimate_weight) / total;
+    *weight = total > max_weight ? max_weight : (uint32_t)total;
+    return value;
+}
+
+bool soh_add_rest(uint16_t soc, int32_t slope_uV, int64_t charge_mC, millis_t now) {
+    if(abs(slope_uV) < SOH_REST_MIN_SLOPE_uV) {
+        return false;
+    }
+
+    bool estimated = false;
+    if(have_rest && now - rest_millis <= SOH_REST_MAX_AGE_MS) {
+        int32_t swing = (int32_t)soc - rest_soc;
+        int64_t charge_delta_mC = charge_mC - rest_charge_mC;
+        if(abs(swing) < SOH_CAPACITY_MIN_SWING) {
+            // Keep the earlier rest, so that a later one further away can
+            // still pair with it
+            return false;
+        }
+
+        int64_t capacity_mC = charge_delta_mC * 10000 / swing;
+        int64_t nameplate_mC = model.nameplate_capacity_mC;
+        if(capacity_mC * 100 >= nameplate_mC * SOH_CAPACITY_MIN_PERCENT
+            && capacity_mC * 100 <= nameplate_mC * SOH_CAPACITY_MAX_PERCENT) {
+            uint32_t swing_percent = abs(swing) / 100;
+            soh_state.capacity_mC = blend(
+                soh_state.capacity_mC, &soh_state.capacity_weight,
+                (uint32_t)capacity_mC, swing_percent * swing_percent,
+                SOH_CAPACITY_WEIGHT_MAX
+            );
+            soh_state.capacity_count++;
+            estimated = true;
+        }
+    }
+
+    // This rest becomes the one to pair the next with
+    have_rest = true;
+    rest_soc = soc;
+    rest_charge_mC = charge_mC;
+    rest_millis = now;
+    return estimated;
+}
+
+bool soh_add_sample(int32_t voltage_mV, int32_t current_mA, millis_t now) {
+    bool estimated = false;
+    if(have_sample && now - sample_millis <= SOH_RESISTANCE_MAX_GAP_MS) {
+        int32_t step_mA = current_mA - sample_current_mA;
+        if(abs(step_mA) >= SOH_RESISTANCE_MIN_STEP_mA) {
+            // Charging current is positive, and raises the voltage
+            int64_t resistance_uOhm = (int64_t)(voltage_mV - sample_voltage_mV) * 1000000 / step_mA;
+            if(resistance_uOhm > 0 && resistance_uOhm < SOH_RESISTANCE_MAX_uOhm) {
+                uint32_t step_A = abs(step_mA) / 1000;
+                soh_state.resistance_uOhm = blend(
+                    soh_state.resistance_uOhm, &soh_state.resistance_weight,
+                    (uint32_t)resistance_uOhm, step_A * step_A,
+                    SOH_RESISTANCE_WEIGHT_MAX
+                );
+                soh_state.resistance_count++;
+                if(soh_state.resistance_new_uOhm == 0
+                    && soh_state.resistance_count >= SOH_RESISTANCE_BASELINE_COUNT) {
+                    soh_state.resistance_new_uOhm = soh_state.resistance_uOhm;
+                }
+                estimated = true;
+            }
+        }
+    }
+
+    have_sample = true;
+    sample_voltage_mV = voltage_mV;
+    sample_current_mA = current_mA;
+    sample_millis = now;
+    return estimated;
+}
+
+uint16_t soh_capacity_health(uint32_t nameplate_capacity_mC) {
+    if(soh_state.capacity_mC == 0 || nameplate_capacity_mC == 0) {
+        return 10000;
+    }
+    uint64_t health = (uint64_t)soh_state.capacity_mC * 10000 / nameplate_capacity_mC;
+    return health > 10000 ? 10000 : (uint16_t)health;
+}
+
+uint16_t soh_resistance_growth() {
+    if(soh_state.resistance_new_uOhm == 0) {
+        return 10000;
+    }
+    uint64_t growth = (uint64_t)soh_state.resistance_uOhm * 10000 / soh_state.resistance_new_uOhm;
+    return growth > 0xFFFF ? 0xFFFF : (uint16_t)growth;
+}
+
+static void update_model(bms_model_t *model) {
+    model->capacity_mC = soh_state.capacity_mC ? soh_state.capacity_mC : model->nameplate_capacity_mC;
+    model->soh = soh_capacity_health(model->nameplate_capacity_mC);
+}
+
+void soh_init(bms_model_t *model) {
+    if(nvm_load_soh(&soh_state)) {
+        printf("SoH loaded from NVM: capacity %lu mC, resistance %lu uOhm\n",
+            (unsigned long)soh_state.capacity_mC, (unsigned long)soh_state.resistance_uOhm);
+    } else {
+        printf("No SoH in NVM\n");
+    }
+    update_model(model);
+}
+
+static void track_rest(bms_model_t *model, int64_t charge_mC, millis_t now) {
+    if(abs(model->current_mA) >= SOH_REST_CURRENT_mA) {
+        if(rest_pending) {
+            // The rest is over, and the last reading is the most relaxed
+            if(soh_add_rest(pending_soc, pending_slope_uV, pending_charge_mC, now)) {
+                printf("SoH capacity estimate: %lu mC\n", (unsigned long)soh_state.capacity_mC);
+                // Rare and valuable, so save it now
+                unsaved = true;
+                last_save_millis = now - SOH_SAVE_INTERVAL_MS;
+            }
+            rest_pending = false;
+        }
+        resting = false;
+        return;
+    }
+
+    if(!resting) {
+        resting = true;
+        resting_since = now;
+    }
+
+    // Balancing loads some cells, so don't trust the voltages while it's on
+    if(now - resting_since < SOH_REST_TIME_MS || model->balancing_active
+        || model->cell_voltage_millis == 0) {
+        return;
+    }
+
+    int16_t temperature_dC = ocv_model_temperature_dC(model);
+    pending_soc = ocv_mV_to_soc(model->cell_voltage_total_mV / NUM_CELLS, temperature_dC);
+    pending_slope_uV = ocv_slope(pending_soc, temperature_dC);
+    pending_charge_mC = charge_mC;
+    rest_pending = true;
+}
+
+static void track_steps(bms_model_t *model, millis_t now) {
+    if(model->battery_voltage_millis == last_voltage_millis) {
+        return;
+    }
+    last_voltage_millis = model->battery_voltage_millis;
+
+    int16_t temperature_dC = ocv_model_temperature_dC(model);
+    if(temperature_dC < SOH_RESISTANCE_MIN_TEMPERATURE_dC || temperature_dC > SOH_RESISTANCE_MAX_TEMPERATURE_dC) {
+        return;
+    }
+
+    int32_t current_mA;
+    if(!current_history_at(model->battery_voltage_us, &current_mA)) {
+        return;
+    }
+    if(soh_add_sample(model->battery_voltage_mV, current_mA, now)) {
+        unsaved = true;
+    }
+}
+
+void soh_tick(bms_model_t *model, int64_t charge_mC) {
+    millis_t now = millis();
+
+    track_rest(model, charge_mC, now);
+    track_steps(model, now);
+    update_model(model);
+
+    if(unsaved && now - last_save_millis >= SOH_SAVE_INTERVAL_MS) {
+        if(nvm_save_soh(&soh_state)) {
+            unsaved = false;
+        }
+        last_save_millis = now;
+        // NVM operations can be slow, so allow a missed deadline
+        model->ignore_missed_deadline = true;
+    }
+}
+
+void soh_reset() {
+    soh_state = (soh_state_t){0};
+    have_rest = false;
+    have_sample = false;
+    resting = false;
+    rest_pending = false;
+    last_voltage_millis = 0;
+    last_save_millis = 0;
+    unsaved = false;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "../../sys/time/time.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct bms_model bms_model_t;
+
+// State of health: how much capacity the pack has lost, and how much its
+// resistance has grown, since it was new.
+//
+// Capacity is measured as the charge counted between two rests, divided by
+// the change in SoC read off the OCV curve at each. Only rests on the steeper
+// parts of the curve count, and the two must be at least
+// SOH_CAPACITY_MIN_SWING apart, so partial cycles are fine as long as they're
+// big enough.
+//
+// Resistance is measured as dV/dI across a current step, pairing the pack
+// voltage with the current at the moment it was sampled.
+//
+// Each estimate is blended into a running average weighted by how much we
+// trust it (the square of the SoC swing or current step), with the total
+// weight capped so that the average keeps following the pack as it ages.
+
+// Smallest SoC swing (0.01%) worth estimating the capacity from
+#define SOH_CAPACITY_MIN_SWING 2000
+
+// Smallest current step (mA) worth estimating the resistance from
+#define SOH_RESISTANCE_MIN_STEP_mA 10000
+
+// What gets persisted. The weights are in the units of the confidence of a
+// single estimate (SoC swing in % squared, or current step in A squared).
+typedef struct soh_state {
+    uint32_t capacity_mC; // zero until measured
+    uint32_t capacity_weight;
+    uint32_t resistance_uOhm; // whole pack, zero until measured
+    uint32_t resistance_weight;
+    uint32_t resistance_new_uOhm; // the first settled resistance, as a baseline
+    uint16_t capacity_count; // number of estimates taken
+    uint16_t resistance_count;
+} soh_state_t;
+
+extern soh_state_t soh_state;
+
+// Restores the persisted state (if any) and sets up the model
+void soh_init(bms_model_t *model);
+
+// Call every tick, with the charge counter in mC
+void soh_tick(bms_model_t *model, int64_t charge_mC);
+
+// Feeds in a rest: the OCV-based SoC (0.01%), the OCV slope there (uV per 1%),
+// and the charge counter (mC). Pairs it with the previous rest, and returns
+// true if that produced a capacity estimate.
+bool soh_add_rest(uint16_t soc, int32_t slope_uV, int64_t charge_mC, millis_t now);
+
+// Feeds in a pack voltage and the current flowing when it was taken. Returns
+// true if it made a step with the previous pair, and so a resistance estimate.
+bool soh_add_sample(int32_t voltage_mV, int32_t current_mA, millis_t now);
+
+// Capacity and resistance health, in 0.01% units
+uint16_t soh_capacity_health(uint32_t nameplate_capacity_mC);
+uint16_t soh_resistance_growth();
+
+void soh_reset();
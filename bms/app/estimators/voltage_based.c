@@ -1,4 +1,5 @@
 #include "estimators.h"
+#include "ocv.h"
 #include "../model.h"
 #include "../../config/limits.h"
 
@@ -11,15 +12,15 @@ uint16_t voltage_based_soc_estimate(bms_model_t *model) {
 
     // calculate representative cell voltage
     uint16_t mean_voltage = (model->cell_voltage_total_mV / NUM_CELLS);
-    float soc_estimate = nmc_ocv_to_soc((float)mean_voltage / 1000.0f);
+    int16_t temperature_dC = ocv_model_temperature_dC(model);
+    uint16_t soc_estimate = ocv_mV_to_soc(mean_voltage, temperature_dC);
     // Use min voltage for low SoC, max voltage for high SoC
     uint16_t representative_voltage_mV = (
-        model->cell_voltage_min_mV + (model->cell_voltage_max_mV - model->cell_voltage_min_mV) * soc_estimate
+        model->cell_voltage_min_mV + (model->cell_voltage_max_mV - model->cell_voltage_min_mV) * soc_estimate / 10000
     );
 
     //float cell_voltage_mV
 
-    float ocv = (representative_voltage_mV + model->current_mA * internal_resistance) / 1000.0f;
-    float soc = nmc_ocv_to_soc(ocv);
-    return (uint16_t)(soc * 10000.0f); // in 0.01% units
+    int32_t ocv_mV = representative_voltage_mV + (int32_t)(model->current_mA * internal_resistance);
+    return ocv_mV_to_soc(ocv_mV, temperature_dC); // in 0.01% units
 }
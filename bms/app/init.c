@@ -1,4 +1,5 @@
 #include "../drivers/comms/duart.h"
+#include "../drivers/contactors/contactors.h"
 #include "../protocols/internal_serial/internal_serial.h"
 #include "../drivers/sensors/ads1115.h"
 #include "../drivers/sensors/ina228.h"
@@ -10,6 +11,9 @@
 #include "../protocols/inverter/inverter.h"
 #include "../drivers/isospi/isosnoop.h"
 #include "../drivers/isospi/isospi_master.h"
+#include "estimators/soh.h"
+#include "monitoring/cycles.h"
+#include "monitoring/energy.h"
 #include "state_machines/contactors.h"
 #include "model.h"
 
@@ -46,6 +50,10 @@ static void init_hw() {
     if(!ina228_init(&ina228_dev, 0x40, 0.001, 100.0f)) {
         printf("INA228 init failed!\n");
     }
+    if(PIN_INA228_ALERT >= 0) {
+        // The INA228 pulls ALERT low on overcurrent
+        ina228_enable_alert(PIN_INA228_ALERT, contactors_trip);
+    }
 
     if(!ads1115_init(&ads1115_dev, 0x48)) {
         printf("ADS1115 init failed!\n");
@@ -84,6 +92,10 @@ static void init_model() {
     }
 
     model.nameplate_capacity_mC = NAMEPLATE_CAPACITY_AH * 3600 * 1000; // in mC
+    // restore the capacity and resistance history (needs the nameplate)
+    soh_init(&model);
+    cycles_init();
+    energy_init(&model);
 
     // Pretend balancing is active at startup to avoid trusting
     // cell voltages until we've definitely turned balancing off.
@@ -1,6 +1,7 @@
 #include "model.h"
 
 #include "battery/current_limits.h"
+#include "estimators/ocv.h"
 #include "../config/limits.h"
 #include "../lib/math.h"
 
@@ -50,13 +51,32 @@ static void model_process_cell_voltages(bms_model_t *model) {
 }
 
 static void model_calculate_cell_current_limits(bms_model_t *model) {
+    if(millis_recent_enough(model->sop_millis, SOP_STALE_MS)) {
+        // The state of power knows how close the extreme cells are to their
+        // limits, so use it instead of the cell voltage derates
+        model->cell_voltage_charge_current_limit_dA = calculate_sop_charge_current_limit(
+            model->cell_voltage_min_mV,
+            model->cell_voltage_max_mV,
+            model->sop_charge_current_limit_dA[SOP_LIMIT_HORIZON]
+        );
+        model->cell_voltage_discharge_current_limit_dA = calculate_sop_discharge_current_limit(
+            model->cell_voltage_min_mV,
+            model->cell_voltage_max_mV,
+            model->sop_discharge_current_limit_dA[SOP_LIMIT_HORIZON]
+        );
+        return;
+    }
+
+    int16_t temperature_dC = ocv_model_temperature_dC(model);
     model->cell_voltage_charge_current_limit_dA =calculate_cell_voltage_charge_current_limit(
         model->cell_voltage_min_mV,
-        model->cell_voltage_max_mV
+        model->cell_voltage_max_mV,
+        temperature_dC
     );
     model->cell_voltage_discharge_current_limit_dA = calculate_cell_voltage_discharge_current_limit(
         model->cell_voltage_min_mV,
-        model->cell_voltage_max_mV
+        model->cell_voltage_max_mV,
+        temperature_dC
     );
 }
 
@@ -3,6 +3,8 @@
 #include "../sys/time/time.h"
 #include "../app/calibration/offline.h"
 #include "../app/battery/balancing.h"
+#include "../app/battery/state_of_power.h"
+#include "../app/monitoring/energy.h"
 #include "../app/state_machines/contactors.h"
 #include "../app/state_machines/system.h"
 
@@ -14,8 +16,16 @@ typedef struct bms_model {
     // Positive current means battery is charging
     int32_t current_mA;
     millis_t current_millis;
+    micros_t current_us; // middle of the conversion the reading came from
     int64_t charge_raw;
     millis_t charge_millis;
+    // Energy counted by the INA228 since startup, split by the direction of
+    // the current, and the (divided up) bus voltage it was measured at
+    int64_t energy_in_mJ;
+    int64_t energy_out_mJ;
+    millis_t energy_millis;
+    int32_t bus_voltage_mV;
+    millis_t bus_voltage_millis;
 
     int16_t temperature_min_dC;
     int16_t temperature_max_dC;
@@ -23,6 +33,7 @@ typedef struct bms_model {
 
     int32_t battery_voltage_mV;
     millis_t battery_voltage_millis;
+    micros_t battery_voltage_us; // middle of the samples the reading came from
     int32_t battery_voltage_range_mV;
     int32_t output_voltage_mV;
     millis_t output_voltage_millis;
@@ -45,7 +56,19 @@ typedef struct bms_model {
 
 
     uint32_t nameplate_capacity_mC; // nameplate battery capacity in mC
-    uint32_t working_capacity_mC; // nameplate capacity within working voltage range in mC
+    uint32_t capacity_mC; // measured battery capacity in mC (nameplate until measured)
+    uint32_t working_capacity_mC; // measured capacity within working voltage range in mC
+
+    // Pack power, averaged over recent conversions (positive charging), and
+    // what it means for how long the pack will last (or RUNTIME_UNKNOWN)
+    int32_t power_trend_mW;
+    uint32_t time_to_empty_s;
+    uint32_t time_to_full_s;
+
+    // Lifetime energy into and out of the pack, and whether it's being counted
+    uint32_t energy_in_Wh;
+    uint32_t energy_out_Wh;
+    energy_status_t energy_status;
 
     system_sm_t system_sm;
     system_requests_t system_req;
@@ -72,6 +95,7 @@ typedef struct bms_model {
     // Individual cell voltages, which will remain static during balancing
     int16_t cell_voltages_mV[120];
     millis_t cell_voltages_millis; // individial cell voltages
+    micros_t cell_voltages_us; // when the BMBs took the snapshot
     // Individual raw cell voltages, which will bounce around during balancing
     int16_t raw_cell_voltages_mV[120]; // are unstable during balancing
     millis_t raw_cell_voltages_millis;
@@ -80,6 +104,19 @@ typedef struct bms_model {
 
     bool cell_voltage_slow_mode; // only request BMB data infrequently
 
+    // INVERTER DATA (as reported by the inverter over CAN)
+
+    int32_t inverter_voltage_mV;
+    int32_t inverter_current_mA;
+    int16_t inverter_temperature_dC;
+    millis_t inverter_measurements_millis;
+    uint16_t inverter_soc; // in 0.01% units
+    millis_t inverter_soc_millis;
+    uint32_t inverter_time; // unix timestamp
+    millis_t inverter_time_millis;
+    // Last time any frame was received from the inverter
+    millis_t inverter_millis;
+
     // The calculated pack voltage limits (??)
     // uint16_t max_voltage_limit_dV;
     // uint16_t min_voltage_limit_dV;
@@ -105,6 +142,11 @@ typedef struct bms_model {
     uint16_t cell_voltage_discharge_current_limit_dA; // in 0.1A units
     uint16_t user_charge_current_limit_dA; // in 0.1A units
     uint16_t user_discharge_current_limit_dA; // in 0.1A units
+    // Predicted from the RC model, for each of SOP_HORIZONS (when fresh, the
+    // SOP_LIMIT_HORIZON ones replace the cell voltage derates)
+    uint16_t sop_charge_current_limit_dA[SOP_HORIZONS]; // in 0.1A units
+    uint16_t sop_discharge_current_limit_dA[SOP_HORIZONS]; // in 0.1A units
+    millis_t sop_millis;
     // The calculated final current limits
     uint16_t charge_current_limit_dA; // in 0.1A units
     uint16_t discharge_current_limit_dA; // in 0.1A units
@@ -145,6 +187,10 @@ typedef struct bms_model {
     bool estop_pressed;
     // Detected via the aux contacts (note that this is actually the precharge bypass contactor)
     bool precharge_closed; 
+    // Last status received from the supervisor MCU
+    uint8_t supervisor_flags;
+    millis_t supervisor_millis;
+
     // Whether we should ignore a potential loop overrun at the end of this tick
     // (eg, due to a slow flash write). This is reset each tick.
     bool ignore_missed_deadline;
@@ -6,15 +6,44 @@ typedef struct {
     uint32_t uart0_packets_received;
     uint32_t uart0_packets_sent;
     uint32_t uart0_crc_errors;
+    uint32_t uart0_collisions;
+    // Time from the last byte being handed to the UART to releasing the line
+    uint32_t uart0_turnaround_us;
+    uint32_t uart0_turnaround_max_us;
 
     // uint32_t uart1_bytes_received;
     // uint32_t uart1_bytes_sent;
     uint32_t uart1_packets_received;
     uint32_t uart1_packets_sent;
     uint32_t uart1_crc_errors;
+    uint32_t uart1_collisions;
+    uint32_t uart1_turnaround_us;
+    uint32_t uart1_turnaround_max_us;
 
+    // Frames actually sent/received on the bus (counted in the CAN IRQ)
     uint32_t can_frames_sent;
     uint32_t can_frames_received;
+    // Scheduled frames which missed their slot entirely (eg, TX queue full)
+    uint32_t can_frames_dropped;
+    // Frames dropped because the main loop didn't empty the RX mailbox in time
+    uint32_t can_rx_overflows;
+    // Frames discarded by the acceptance filter (not for us)
+    uint32_t can_rx_filtered;
+    // The CAN IRQ wasn't serviced in time and the PIO RX FIFO overflowed
+    uint32_t can_rx_stalls;
+    // Malformed frames seen on the bus
+    uint32_t can_parse_errors;
+    // Transmissions that had to be retried (lost arbitration, or no ACK)
+    uint32_t can_tx_retries;
+    // can2040_transmit() calls rejected because the TX queue was full
+    uint32_t can_tx_queue_full;
+    // Over the last second, in 0.01% units
+    uint16_t can_bus_load;
+    uint16_t can_isr_load; // share of CPU time spent in the CAN IRQ
+    uint32_t can_isr_max_us;
+
+    // Times the internal ADC ring had to be restarted as we fell too far behind
+    uint32_t internal_adc_resyncs;
 } debug_counters_t;
 
 extern debug_counters_t debug_counters;
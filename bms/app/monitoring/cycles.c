@@ -0,0 +1,46 @@
+#include "cycles.h"
+
+#include "../model.h"
+#include "../estimators/ocv.h"
+#include "../../drivers/chip/nvm.h"
+
+rainflow_histogram_t cycle_histogram;
+static rainflow_t rainflow;
+
+// Cycles take hours, so there's no hurry to save them. Anything not yet saved
+// is lost on a reset, along with the residue.
+#define CYCLES_SAVE_INTERVAL_MS (60 * 60 * 1000)
+
+static millis_t last_soc_millis = 0;
+static millis_t last_save_millis = 0;
+static bool unsaved = false;
+
+void cycles_init() {
+    rainflow_init(&rainflow, CYCLES_HYSTERESIS, 10000);
+    if(nvm_load_cycles(&cycle_histogram)) {
+        printf("Cycle histogram loaded from NVM\n");
+    } else {
+        printf("No cycle histogram in NVM\n");
+    }
+}
+
+void cycles_tick(bms_model_t *model) {
+    if(model->soc_millis == 0 || model->soc_millis == last_soc_millis) {
+        return;
+    }
+    last_soc_millis = model->soc_millis;
+
+    if(rainflow_add(&rainflow, &cycle_histogram, model->soc, ocv_model_temperature_dC(model))) {
+        unsaved = true;
+    }
+
+    millis_t now = millis();
+    if(unsaved && now - last_save_millis >= CYCLES_SAVE_INTERVAL_MS) {
+        if(nvm_save_cycles(&cycle_histogram)) {
+            unsaved = false;
+        }
+        last_save_millis = now;
+        // NVM operations can be slow, so allow a missed deadline
+        model->ignore_missed_deadline = true;
+    }
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "../../lib/rainflow.h"
+
+typedef struct bms_model bms_model_t;
+
+// Depth-of-discharge accounting: the SoC is fed through a rainflow counter
+// once a second, and the cycles found are binned by depth (10% steps), mean
+// SoC (20% steps) and temperature. The histogram is persisted to NVM.
+
+// SoC reversals smaller than this (0.01%) are ignored as noise
+#define CYCLES_HYSTERESIS 100
+
+extern rainflow_histogram_t cycle_histogram;
+
+// Restores the persisted histogram (if any)
+void cycles_init();
+
+void cycles_tick(bms_model_t *model);
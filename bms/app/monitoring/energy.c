@@ -0,0 +1,92 @@
+#include "energy.h"
+
+#include "../model.h"
+#include "../../config/settings.h"
+#include "../../drivers/chip/nvm.h"
+
+#include <stdlib.h>
+
+#define mJ_PER_Wh (3600 * 1000)
+
+// The totals grow slowly, so there's no hurry to save them. Anything not yet
+// saved is lost on a reset.
+#define ENERGY_SAVE_INTERVAL_MS (60 * 60 * 1000)
+
+static millis_t last_energy_millis = 0;
+static int64_t last_in_mJ = 0;
+static int64_t last_out_mJ = 0;
+// Counted, but not yet a whole Wh
+static int64_t partial_in_mJ = 0;
+static int64_t partial_out_mJ = 0;
+
+static millis_t last_save_millis = 0;
+static bool unsaved = false;
+static bool implausible_reported = false;
+
+void energy_init(bms_model_t *model) {
+    model->energy_status = INA228_ENERGY_ACCOUNTING ? ENERGY_STATUS_WAITING : ENERGY_STATUS_DISABLED;
+
+    energy_totals_t totals;
+    if(nvm_load_energy(&totals)) {
+        model->energy_in_Wh = totals.in_Wh;
+        model->energy_out_Wh = totals.out_Wh;
+        printf("Energy totals loaded from NVM\n");
+    } else {
+        printf("No energy totals in NVM\n");
+    }
+}
+
+bool energy_vbus_plausible(const bms_model_t *model) {
+    if(model->bus_voltage_millis == 0 || model->battery_voltage_millis == 0) {
+        return false;
+    }
+    int64_t difference_mV = llabs((int64_t)model->bus_voltage_mV - model->battery_voltage_mV);
+    return difference_mV * 1000 <= (int64_t)model->battery_voltage_mV * ENERGY_VBUS_TOLERANCE;
+}
+
+void energy_tick(bms_model_t *model) {
+    if(model->energy_millis == 0 || model->energy_millis == last_energy_millis) {
+        return;
+    }
+    last_energy_millis = model->energy_millis;
+
+    int64_t in_mJ = model->energy_in_mJ - last_in_mJ;
+    int64_t out_mJ = model->energy_out_mJ - last_out_mJ;
+    last_in_mJ = model->energy_in_mJ;
+    last_out_mJ = model->energy_out_mJ;
+
+    if(!energy_vbus_plausible(model)) {
+        model->energy_status = ENERGY_STATUS_VBUS_MISMATCH;
+        if(!implausible_reported) {
+            printf("Bus voltage %ld mV doesn't match the pack, not counting energy\n",
+                (long)model->bus_voltage_mV);
+            implausible_reported = true;
+        }
+        return;
+    }
+    model->energy_status = ENERGY_STATUS_COUNTING;
+
+    partial_in_mJ += in_mJ;
+    partial_out_mJ += out_mJ;
+    if(partial_in_mJ >= mJ_PER_Wh || partial_out_mJ >= mJ_PER_Wh) {
+        model->energy_in_Wh += (uint32_t)(partial_in_mJ / mJ_PER_Wh);
+        model->energy_out_Wh += (uint32_t)(partial_out_mJ / mJ_PER_Wh);
+        partial_in_mJ %= mJ_PER_Wh;
+        partial_out_mJ %= mJ_PER_Wh;
+        unsaved = true;
+    }
+
+    millis_t now = millis();
+    if(unsaved && now - last_save_millis >= ENERGY_SAVE_INTERVAL_MS) {
+        energy_totals_t totals = {
+            .in_Wh = model->energy_in_Wh,
+            .out_Wh = model->energy_out_Wh,
+        };
+        if(nvm_save_energy(&totals)) {
+            unsaved = false;
+        }
+        last_save_millis = now;
+        // NVM operations can be slow, so allow a missed deadline
+        model->ignore_missed_deadline = true;
+    }
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct bms_model bms_model_t;
+
+// Lifetime energy accounting: the energy counted by the INA228 (split by the
+// direction of the current) is accumulated into whole Wh into and out of the
+// pack, which are persisted to NVM.
+
+// The INA228's bus voltage must agree with the pack voltage to within this
+// (in 0.1% units) for its energy to be counted, so that a missing or
+// misconfigured VBUS divider doesn't pollute the totals
+#define ENERGY_VBUS_TOLERANCE 50
+
+typedef enum {
+    // The INA228 isn't measuring energy (see INA228_ENERGY_ACCOUNTING)
+    ENERGY_STATUS_DISABLED = 0,
+    // Nothing measured yet
+    ENERGY_STATUS_WAITING = 1,
+    // Measured, but not counted, as the bus voltage doesn't match the pack
+    ENERGY_STATUS_VBUS_MISMATCH = 2,
+    ENERGY_STATUS_COUNTING = 3,
+} energy_status_t;
+
+typedef struct energy_totals {
+    uint32_t in_Wh;
+    uint32_t out_Wh;
+} energy_totals_t;
+
+// Restores the persisted totals (if any) into the model
+void energy_init(bms_model_t *model);
+
+bool energy_vbus_plausible(const bms_model_t *model);
+
+void energy_tick(bms_model_t *model);
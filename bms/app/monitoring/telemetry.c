@@ -0,0 +1,144 @@
+#include "telemetry.h"
+
+#include "../model.h"
+#include "../../config/limits.h"
+#include "../../drivers/comms/duart.h"
+#include "../../drivers/sensors/ina228.h"
+#include "../../drivers/sensors/internal_adc.h"
+#include "../../protocols/hmi_serial/hmi_serial.h"
+#include "../../sys/events/events.h"
+#include "../../sys/time/time.h"
+
+#include "pico/stdlib.h"
+
+#include <stdio.h>
+
+// Registers sent in the status packet every tick
+static const uint16_t status_registers[] = {
+    HMI_REG_MILLIS,
+    HMI_REG_SOC,
+    HMI_REG_SOC_VOLTAGE_BASED,
+    HMI_REG_SOC_BASIC_COUNT,
+    HMI_REG_CURRENT,
+    HMI_REG_CHARGE,
+    HMI_REG_BATTERY_VOLTAGE,
+    HMI_REG_OUTPUT_VOLTAGE,
+    HMI_REG_POS_CONTACTOR_VOLTAGE,
+    HMI_REG_NEG_CONTACTOR_VOLTAGE,
+    HMI_REG_TEMPERATURE_MIN,
+    HMI_REG_TEMPERATURE_MAX,
+    HMI_REG_CELL_VOLTAGE_MIN,
+    HMI_REG_CELL_VOLTAGE_MAX,
+    HMI_REG_SUPPLY_VOLTAGE_3V3,
+    HMI_REG_SUPPLY_VOLTAGE_5V,
+    HMI_REG_SUPPLY_VOLTAGE_12V,
+    HMI_REG_SUPPLY_VOLTAGE_CTR,
+    HMI_REG_SYSTEM_STATE,
+    HMI_REG_CONTACTORS_STATE,
+};
+
+static bool text_mode = false;
+
+void telemetry_set_text_mode(bool enabled) {
+    text_mode = enabled;
+}
+
+bool telemetry_text_mode() {
+    return text_mode;
+}
+
+static void telemetry_send(const uint8_t *payload, size_t len) {
+    uint8_t buf[256 + 4];
+    size_t packet_len = duart_encode_packet(buf, payload, len);
+
+    // Bypass printf, and its CR/LF translation
+    stdio_put_string((const char *)buf, (int)packet_len, false, false);
+}
+
+static void telemetry_send_binary(bms_model_t *model) {
+    uint8_t tx_buf[256];
+
+    // Status registers, every tick
+    size_t idx = 0;
+    tx_buf[idx++] = HMI_MSG_READ_REGISTERS_RESPONSE;
+    tx_buf[idx++] = 0; // no device address on USB
+    for(size_t i = 0; i < sizeof(status_registers) / sizeof(status_registers[0]); i++) {
+        idx += hmi_append_register_value(&tx_buf[idx], status_registers[i], model);
+    }
+    telemetry_send(tx_buf, idx);
+
+    // Raw cell voltages, every tick
+    idx = hmi_build_cell_voltages_response(tx_buf, model->raw_cell_voltages_mV, NUM_CELLS);
+    telemetry_send(tx_buf, idx);
+
+    // Events, every 64 ticks
+    if((timestep() & 0x3f) == 32) {
+        uint16_t start_index = 0;
+        do {
+            idx = hmi_build_events_response(tx_buf, start_index);
+            telemetry_send(tx_buf, idx);
+            start_index = (uint16_t)tx_buf[2] | ((uint16_t)tx_buf[3] << 8);
+        } while(start_index < ERR_HIGHEST);
+    }
+}
+
+static void telemetry_print_text(bms_model_t *model) {
+    if((timestep() & 0x3f) != 32) {
+        return;
+    }
+
+    //isosnoop_print_buffer();
+    uint32_t total = 0;
+    for(int i=0; i<NUM_CELLS; i++) {
+        printf("[c%3d]: %4d mV | ", i, model->raw_cell_voltages_mV[i]);
+        total += model->raw_cell_voltages_mV[i];
+        if((i % 5) == 4) {
+            printf("\n");
+        }
+    }
+    printf("Total: %lu mV | Temps: %ddC - %ddC | Delta: %d mV\n\n",
+        total,
+        model->temperature_min_dC, model->temperature_max_dC,
+        model->cell_voltage_max_mV - model->cell_voltage_min_mV
+    );
+
+    //printf("Bal mask: %02X %02X\n", bitmap_set[14], bitmap_set[15]);
+
+    print_bms_events();
+
+    printf("Temp: %3ld dC | 3V3: %4ld mV | 5V: %4ld mV | 12V: %5ld mV | CtrV: %5ld mV\n",
+        get_temperature_c_times10(),
+        model->supply_voltage_3V3_mV,
+        model->supply_voltage_5V_mV,
+        model->supply_voltage_12V_mV,
+        model->supply_voltage_contactor_mV
+    );
+
+    printf("Batt: %6ldmV (%3ldmV) | Out: %6ldmV (%3ldmV) | NegCtr: %6ldmV (%3ldmV) | PosCtr: %6ldmV (%3ldmV)\n",
+        model->battery_voltage_mV,
+        model->battery_voltage_range_mV,
+        model->output_voltage_mV,
+        model->output_voltage_range_mV,
+        model->neg_contactor_voltage_mV,
+        model->neg_contactor_voltage_range_mV,
+        model->pos_contactor_voltage_mV,
+        model->pos_contactor_voltage_range_mV
+    );
+    int64_t charge_mC = raw_charge_to_mC(model->charge_raw);
+    printf("Current: %6ld mA | Charge: %lld mC | SoC: %2.2f %% | SoC(VB): %2.2f %% | SoC(BC): %2.2f %% | SoC(FC): %2.2f %%\n\n",
+        model->current_mA,
+        charge_mC,
+        model->soc / 100.0f,
+        model->soc_voltage_based / 100.0f,
+        model->soc_basic_count / 100.0f,
+        model->soc_fancy_count / 100.0f
+    );
+}
+
+void telemetry_tick(bms_model_t *model) {
+    if(text_mode) {
+        telemetry_print_text(model);
+    } else {
+        telemetry_send_binary(model);
+    }
+}
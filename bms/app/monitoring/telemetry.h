@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdbool.h>
+
+// USB telemetry. By default, a binary stream of packets framed like the duart
+// packets (0xff, length-1, payload, crc16), whose payloads are HMI response
+// messages (READ_REGISTERS_RESPONSE with a fixed set of status registers,
+// READ_CELL_VOLTAGES_RESPONSE and READ_EVENTS_RESPONSE). See
+// tools/telemetry_decode.c for a decoder.
+//
+// The old human readable dump can be switched on instead, by sending 'T' over
+// USB stdio.
+
+typedef struct bms_model bms_model_t;
+
+void telemetry_tick(bms_model_t *model);
+void telemetry_set_text_mode(bool enabled);
+bool telemetry_text_mode();
@@ -48,6 +48,10 @@
 // How long we wait when force-opening contactors
 #define CONTACTORS_FORCE_OPEN_TIMEOUT_MS 2000
 
+// How long after closing the current is expected to be settling (as the
+// inverter starts up)
+#define CONTACTORS_CLOSING_TRANSIENT_MS 3000
+
 static inline int32_t abs_int32(int32_t v) {
     return (v < 0) ? -v : v;
 }
@@ -588,3 +592,19 @@ void contactor_sm_tick(bms_model_t *model) {
             break;
     }
 }
+
+bool contactors_transient_expected(bms_model_t *model) {
+    contactors_sm_t *contactor_sm = &model->contactor_sm;
+    switch(contactor_sm->state) {
+        case CONTACTORS_STATE_PRECHARGING_NEG:
+        case CONTACTORS_STATE_PRECHARGING:
+        case CONTACTORS_STATE_CALIBRATING_PRECHARGE:
+            return true;
+        case CONTACTORS_STATE_CLOSED:
+            return !state_timeout((sm_t*)contactor_sm, CONTACTORS_CLOSING_TRANSIENT_MS)
+                || model->contactor_req == CONTACTORS_REQUEST_OPEN
+                || model->contactor_req == CONTACTORS_REQUEST_FORCE_OPEN;
+        default:
+            return false;
+    }
+}
@@ -43,3 +43,7 @@ typedef enum contactors_requests {
 } contactors_requests_t;
 
 void contactor_sm_tick(bms_model_t *model);
+
+// Whether the current is likely to change quickly, as the contactors are
+// precharging, have just closed or are waiting to open
+bool contactors_transient_expected(bms_model_t *model);
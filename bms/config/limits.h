@@ -1,6 +1,9 @@
 #define LFP 1
 #define NMC 2
+// Can be overridden by the build (eg, to test both chemistries)
+#ifndef CHEMISTRY
 #define CHEMISTRY NMC
+#endif
 
 #define BMS_DESK 1
 #define BMS_BLUETESLA 2
@@ -19,6 +22,20 @@
     // restoration charge/discharge
     #define CELL_VOLTAGE_SOFT_MIN_mV 2800
     #define CELL_VOLTAGE_SOFT_MAX_mV 3350
+    // Working voltage range, which defines 0% and 100% SoC. This may be
+    // overridden by user settings.
+    #define CELL_VOLTAGE_WORKING_MIN_mV 3000
+    #define CELL_VOLTAGE_WORKING_MAX_mV 3400
+
+    // Absolute maximum current limits
+    #define CHARGE_MAX_CURRENT_dA 500 // 50A
+    #define DISCHARGE_MAX_CURRENT_dA 500 // 50A
+
+    // Cell voltages beyond which current is derated by the OCV-derived SoC
+    #define CHARGE_CELL_VOLTAGE_DERATE_START_mV 3400
+    #define DISCHARGE_CELL_VOLTAGE_DERATE_START_mV 3150
+    #define CHARGE_CELL_VOLTAGE_DERATE_dA_PER_SoC 40 // in 0.1A per percent SoC
+    #define DISCHARGE_CELL_VOLTAGE_DERATE_dA_PER_SoC 20 // in 0.1A per percent SoC
 
     // TEMPERATURE
 
@@ -60,6 +77,9 @@
     #define CHARGE_MAX_CURRENT_dA 500 // 50A
     #define DISCHARGE_MAX_CURRENT_dA 500 // 50A
 
+    // Cell voltages beyond which current is derated by the OCV-derived SoC
+    #define CHARGE_CELL_VOLTAGE_DERATE_START_mV 4000
+    #define DISCHARGE_CELL_VOLTAGE_DERATE_START_mV 3500
     #define CHARGE_CELL_VOLTAGE_DERATE_dA_PER_SoC 40 // in 0.1A per percent SoC
     #define DISCHARGE_CELL_VOLTAGE_DERATE_dA_PER_SoC 20 // in 0.1A per percent SoC
 
@@ -133,6 +153,9 @@
 // Max discrepancy between BMB cell voltages and measured terminal voltage
 // (which should be calibrated away at zero current).
 #define VOLTAGE_MISMATCH_THRESHOLD_mV 5000
+// Skip the mismatch check if the current changed by more than this between the
+// two voltage readings, as the IR drop will differ
+#define VOLTAGE_MISMATCH_MAX_CURRENT_CHANGE_mA 5000
 
 #define MINIMUM_BALANCE_VOLTAGE_mV 3840
 
@@ -160,6 +183,19 @@
 // cutting off the battery to protect it.
 #define OVERCURRENT_BUFFER_LIMIT_dC 1000 // in 0.1Coulomb units
 
+// The current at which the INA228 trips the contactors open in hardware (via
+// its ALERT pin), which is the larger of a proportion of the live current
+// limit and a margin above it. This opens the contactors under load, so should
+// only catch currents the inverter could never have been asked for. ALERT
+// compares each sample rather than the average, so this has to clear the
+// peaks of any ripple too (eg, at 100Hz from an inverter, which peak at around
+// twice the average).
+#define OVERCURRENT_TRIP_PERCENT 200
+#define OVERCURRENT_TRIP_MARGIN_dA 200 // in 0.1A units
+// How quickly the trip current follows the limits down, to give the inverter
+// time to respond to them (it follows them up immediately)
+#define OVERCURRENT_TRIP_FALL_dA_PER_S 100 // in 0.1A units
+
 // How much excess charge/discharge we allow in the soft-limit region before
 // cutting off the battery to protect it.
 #define OVERCHARGE_BUFFER_LIMIT_dC 500 // in 0.1Coulomb units
@@ -198,6 +234,10 @@
 #define CELL_TEMPERATURE_STALE_THRESHOLD_MS 5000
 #define CELL_TEMPERATURE_STALE_THRESHOLD_SLOW_MS 270000
 
+// The inverter sends its status frames every few seconds, allow a couple to be
+// missed before we consider it gone
+#define INVERTER_STALE_THRESHOLD_MS 10000
+
 
 // The 3V3 measurement is really just measuring the divider resistor tolerances...
 #define SUPPLY_VOLTAGE_3V3_MIN_MV 3200
@@ -12,6 +12,11 @@
 
 #define PIN_INA228_I2C_SDA 24
 #define PIN_INA228_I2C_SCL 21
+// The INA228's ALERT output, which trips the contactors from an interrupt. This
+// is thought to be GPIO 10, but until that's confirmed against the schematic
+// it's left unassigned (-1), and the trip waits for polling to see the shunt
+// limit flags instead.
+#define PIN_INA228_ALERT -1
 
 #define PIN_ADS1115_I2C_SDA 22
 #define PIN_ADS1115_I2C_SCL 23
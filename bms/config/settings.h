@@ -8,3 +8,27 @@
 #define CONTACTOR_PWM_MIN       0.125f // out of 1.0
 // How much the level is decremented each timestep
 #define CONTACTOR_PWM_DECREMENT 1.0f //((CONTACTOR_PWM_INITIAL - CONTACTOR_PWM_MIN) / 1.0f) //ramp down over 160 timesteps
+
+// Whether the HMI serial bus echoes our own transmissions back to the RX pin
+// (single wire bus), allowing collisions with other nodes to be detected.
+#define HMI_SERIAL_LOOPBACK_CHECK 1
+
+// Whether HMI requests are handled from a low priority IRQ as soon as the bus
+// goes idle, rather than polled once per tick. The IRQ only runs while the main
+// loop is sleeping between ticks, so requests arriving during a tick wait for
+// it to finish.
+#define HMI_SERIAL_RX_IRQ 1
+
+// Whether the INA228 also converts the bus voltage, so that its ENERGY
+// accumulator can be used to count the energy into and out of the pack. This
+// lengthens each conversion slightly (see INA228_CONVERSION_PERIOD_US), and
+// adds two reads per conversion. Off until INA228_VBUS_DIVIDER is known, since
+// without the right divider the bus voltage never matches the pack and nothing
+// is counted anyway.
+#define INA228_ENERGY_ACCOUNTING 0
+// The pack voltage divided by the voltage at the INA228's VBUS pin (which
+// can't exceed 85V, so a pack of up to ~400V needs at least 5)
+#define INA228_VBUS_DIVIDER 1
+// The INA228's SHUNT_CAL, which makes the CURRENT register read in 0.25mA
+// units for our shunt
+#define INA228_SHUNT_CAL 332
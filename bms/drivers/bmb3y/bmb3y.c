@@ -582,6 +582,10 @@ bool bmb3y_read_temperatures_blocking(bms_model_t *model) {
     return crc_ok;
 }
 
+// When the last snapshot was taken (the cell voltages are all latched then,
+// even though we read them out a tick later)
+static micros_t snapshot_us = 0;
+
 static void bmb3y_read_cell_voltages_blocking(bms_model_t *model) {
     // Read all cell voltage banks in one go
 
@@ -591,6 +595,7 @@ static void bmb3y_read_cell_voltages_blocking(bms_model_t *model) {
     }
     if(all_crc_ok && !model->balancing_active) {
         model->cell_voltages_millis = millis();
+        model->cell_voltages_us = snapshot_us;
     }
 }
 
@@ -656,6 +661,7 @@ void bmb3y_tick(bms_model_t *model) {
         // Takes about 90us
         bmb3y_send_wakeup_cs_blocking();
         bmb3y_send_command_blocking(BMB3Y_CMD_SNAPSHOT);
+        snapshot_us = time_us_32();
     } else if(step == 1) {
         // Wake up BMBs, read voltages and temperatures, setup balancing
         // Takes about 6ms (so we can get away with doing it all at once rather
@@ -1,6 +1,8 @@
 #include "nvm.h"
 
 #include "../../app/model.h"
+#include "../../app/estimators/soh.h"
+#include "../../app/monitoring/energy.h"
 
 #include "hardware/flash.h"
 #include "pico/flash.h"
@@ -178,6 +180,183 @@ bool nvm_load_calibration(bms_model_t *model) {
     return true;
 }
 
+typedef struct __attribute__((packed)) {
+    uint32_t version;
+
+    uint32_t capacity_mC;
+    uint32_t capacity_weight;
+    uint16_t capacity_count;
+
+    uint32_t resistance_uOhm;
+    uint32_t resistance_weight;
+    uint32_t resistance_new_uOhm;
+    uint16_t resistance_count;
+} soh_data_t;
+
+bool nvm_save_soh(const soh_state_t *state) {
+    int err = lfs_mount(&lfs, &cfg);
+    if (err) return false;
+
+    lfs_file_t file;
+    err = lfs_file_open(&lfs, &file, "soh", LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+    if (err) {
+        lfs_unmount(&lfs);
+        return false;
+    }
+
+    soh_data_t data = {
+        .version = 1,
+        .capacity_mC = state->capacity_mC,
+        .capacity_weight = state->capacity_weight,
+        .capacity_count = state->capacity_count,
+        .resistance_uOhm = state->resistance_uOhm,
+        .resistance_weight = state->resistance_weight,
+        .resistance_new_uOhm = state->resistance_new_uOhm,
+        .resistance_count = state->resistance_count,
+    };
+    lfs_ssize_t written = lfs_file_write(&lfs, &file, &data, sizeof(data));
+    lfs_file_close(&lfs, &file);
+
+    lfs_unmount(&lfs);
+    return written == sizeof(data);
+}
+
+bool nvm_load_soh(soh_state_t *state) {
+    int err = lfs_mount(&lfs, &cfg);
+    if (err) return false;
+
+    lfs_file_t file;
+    err = lfs_file_open(&lfs, &file, "soh", LFS_O_RDONLY);
+    if (err) {
+        lfs_unmount(&lfs);
+        return false;
+    }
+
+    soh_data_t data = {0};
+    lfs_file_read(&lfs, &file, &data, sizeof(data));
+    lfs_file_close(&lfs, &file);
+
+    lfs_unmount(&lfs);
+
+    if (data.version != 1) {
+        return false;
+    }
+
+    state->capacity_mC = data.capacity_mC;
+    state->capacity_weight = data.capacity_weight;
+    state->capacity_count = data.capacity_count;
+    state->resistance_uOhm = data.resistance_uOhm;
+    state->resistance_weight = data.resistance_weight;
+    state->resistance_new_uOhm = data.resistance_new_uOhm;
+    state->resistance_count = data.resistance_count;
+
+    return true;
+}
+
+// The histogram layout is fixed by the version, so bump it if the bins change
+#define CYCLES_VERSION 1
+
+bool nvm_save_cycles(const rainflow_histogram_t *hist) {
+    int err = lfs_mount(&lfs, &cfg);
+    if (err) return false;
+
+    lfs_file_t file;
+    err = lfs_file_open(&lfs, &file, "cycles", LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+    if (err) {
+        lfs_unmount(&lfs);
+        return false;
+    }
+
+    uint32_t version = CYCLES_VERSION;
+    lfs_ssize_t written = lfs_file_write(&lfs, &file, &version, sizeof(version));
+    written += lfs_file_write(&lfs, &file, hist->bins, sizeof(hist->bins));
+    lfs_file_close(&lfs, &file);
+
+    lfs_unmount(&lfs);
+    return written == sizeof(version) + sizeof(hist->bins);
+}
+
+bool nvm_load_cycles(rainflow_histogram_t *hist) {
+    int err = lfs_mount(&lfs, &cfg);
+    if (err) return false;
+
+    lfs_file_t file;
+    err = lfs_file_open(&lfs, &file, "cycles", LFS_O_RDONLY);
+    if (err) {
+        lfs_unmount(&lfs);
+        return false;
+    }
+
+    uint32_t version = 0;
+    lfs_file_read(&lfs, &file, &version, sizeof(version));
+    bool ok = version == CYCLES_VERSION
+        && lfs_file_read(&lfs, &file, hist->bins, sizeof(hist->bins)) == sizeof(hist->bins);
+    lfs_file_close(&lfs, &file);
+
+    lfs_unmount(&lfs);
+
+    if (!ok) {
+        memset(hist, 0, sizeof(*hist));
+    }
+    return ok;
+}
+
+typedef struct __attribute__((packed)) {
+    uint32_t version;
+
+    uint32_t in_Wh;
+    uint32_t out_Wh;
+} energy_data_t;
+
+bool nvm_save_energy(const energy_totals_t *totals) {
+    int err = lfs_mount(&lfs, &cfg);
+    if (err) return false;
+
+    lfs_file_t file;
+    err = lfs_file_open(&lfs, &file, "energy", LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+    if (err) {
+        lfs_unmount(&lfs);
+        return false;
+    }
+
+    energy_data_t data = {
+        .version = 1,
+        .in_Wh = totals->in_Wh,
+        .out_Wh = totals->out_Wh,
+    };
+    lfs_ssize_t written = lfs_file_write(&lfs, &file, &data, sizeof(data));
+    lfs_file_close(&lfs, &file);
+
+    lfs_unmount(&lfs);
+    return written == sizeof(data);
+}
+
+bool nvm_load_energy(energy_totals_t *totals) {
+    int err = lfs_mount(&lfs, &cfg);
+    if (err) return false;
+
+    lfs_file_t file;
+    err = lfs_file_open(&lfs, &file, "energy", LFS_O_RDONLY);
+    if (err) {
+        lfs_unmount(&lfs);
+        return false;
+    }
+
+    energy_data_t data = {0};
+    lfs_file_read(&lfs, &file, &data, sizeof(data));
+    lfs_file_close(&lfs, &file);
+
+    lfs_unmount(&lfs);
+
+    if (data.version != 1) {
+        return false;
+    }
+
+    totals->in_Wh = data.in_Wh;
+    totals->out_Wh = data.out_Wh;
+    return true;
+}
+
 struct __attribute__((packed)) {
     uint32_t version;
 
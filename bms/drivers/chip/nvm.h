@@ -5,12 +5,22 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+#include "../../lib/rainflow.h"
+
 #define NVM_SIZE (64 * 1024)
 
 typedef struct bms_model bms_model_t;
+typedef struct soh_state soh_state_t;
+typedef struct energy_totals energy_totals_t;
 
 int update_boot_count(void);
 bool nvm_save_calibration(bms_model_t *model);
 bool nvm_load_calibration(bms_model_t *model);
+bool nvm_save_soh(const soh_state_t *state);
+bool nvm_load_soh(soh_state_t *state);
+bool nvm_save_cycles(const rainflow_histogram_t *hist);
+bool nvm_load_cycles(rainflow_histogram_t *hist);
+bool nvm_save_energy(const energy_totals_t *totals);
+bool nvm_load_energy(energy_totals_t *totals);
 
 #endif // HW_NVM_H
@@ -2,6 +2,8 @@
 #include "app/monitoring/counters.h"
 
 #include "hardware/gpio.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
 #include "pico/time.h"
 
 #include <stdatomic.h>
@@ -74,20 +76,45 @@ static void _duart_send(duart *u, const uint8_t *data, size_t len) {
 //     }
 // }
 
+static void duart_record_turnaround(duart *u, uint32_t turnaround_us) {
+    if(u==&duart0) {
+        debug_counters.uart0_turnaround_us = turnaround_us;
+        if(turnaround_us > debug_counters.uart0_turnaround_max_us) {
+            debug_counters.uart0_turnaround_max_us = turnaround_us;
+        }
+    } else {
+        debug_counters.uart1_turnaround_us = turnaround_us;
+        if(turnaround_us > debug_counters.uart1_turnaround_max_us) {
+            debug_counters.uart1_turnaround_max_us = turnaround_us;
+        }
+    }
+}
+
 int64_t disable_tx_callback(alarm_id_t id, void *user_data) {
     duart *u = (duart *)user_data;
 
     (void)id;
 
-    if(!atomic_flag_test_and_set(&u->tx_active)) {
-        // No longer active, safe to disable TX pin
-
-        disable_tx_pin(u);
+    if(atomic_flag_test_and_set(&u->tx_active)) {
+        // Another transmission has started, which will schedule its own
+        // callback once it finishes.
+        return 0;
+    }
 
-        // Release the active flag we just grabbed
+    if(uart_get_hw(u->uart)->fr & UART_UARTFR_BUSY_BITS) {
+        // Last byte still being shifted out, check again shortly
         atomic_flag_clear(&u->tx_active);
+        return (u->char_time_us / 8) + 1;
     }
 
+    // UART is idle, safe to disable TX pin
+    disable_tx_pin(u);
+
+    // Release the active flag we just grabbed
+    atomic_flag_clear(&u->tx_active);
+
+    duart_record_turnaround(u, (uint32_t)(time_us_64() - u->tx_dma_done_us));
+
     return 0;
 }
 
@@ -115,21 +142,14 @@ static void __not_in_flash_func(on_uart_tx_complete)(duart *u, uint irq_index) {
         // Nothing else to send, finish up.
 
         if(u->deassert_tx_when_idle) {
-            // FIXME: Wait for UART to finish transmitting last byte(s) before
-            // doing this (there's at least one still in the tx buffer, and
-            // probably another in the shift register?)
-
-            // Maybe enable the TX interrupt and disable the tx pin there?
-            // although then need to make sure the DMA hasn't started another
-            // transfer in the meantime... (atomic flag?)
-
-            // Hmm no, this won't work since there's no interrupt when the
-            // transmit actually completes. We will need to set a timer or
-            // something to check when the UART is idle.
-
-            // Note - the delay has to be long enough for at least one byte to
-            // finish sending, maybe two?
-            add_alarm_in_us(150, disable_tx_callback, u, false);
+            // The DMA has only handed the last byte to the UART. With the FIFO
+            // disabled, that byte is waiting behind the one in the shift
+            // register, so the line is busy for between one and two more
+            // character times. There's no interrupt for the transmit actually
+            // completing, so check after one character time and then poll the
+            // BUSY flag until the stop bit is out.
+            u->tx_dma_done_us = time_us_64();
+            add_alarm_in_us(u->char_time_us, disable_tx_callback, u, true);
         }
 
         atomic_flag_clear(&u->tx_active);
@@ -321,6 +341,26 @@ void memcpy_with_crc16(uint8_t *dest, const uint8_t *src, size_t len, uint16_t *
 }
 
 
+static void duart_count_collision(duart *u) {
+    if(u==&duart0) {
+        debug_counters.uart0_collisions++;
+    } else {
+        debug_counters.uart1_collisions++;
+    }
+}
+
+static void duart_corrupt_packet(duart *u, size_t payload_len) {
+    if(u==&duart0) {
+        debug_counters.uart0_crc_errors++;
+    } else {
+        debug_counters.uart1_crc_errors++;
+    }
+
+    if(u->check_loopback && duart_echo_corrupt(&u->echo, (uint8_t)(payload_len - 1))) {
+        // We were expecting our own packet back, and this looks like it.
+        duart_count_collision(u);
+    }
+}
 
 size_t duart_read_packet(duart *u, uint8_t *buf, size_t buf_size) {
     // Reads a full packet from the receive buffer. Returns the number of bytes
@@ -339,6 +379,12 @@ size_t duart_read_packet(duart *u, uint8_t *buf, size_t buf_size) {
     // receiver can re-lock its bit timing on the next start bit).
 
 
+    if(u->check_loopback) {
+        for(uint8_t lost = duart_echo_expire(&u->echo, millis()); lost > 0; lost--) {
+            duart_count_collision(u);
+        }
+    }
+
     while(true) {
         size_t available;
         uint8_t *data;
@@ -402,12 +448,7 @@ size_t duart_read_packet(duart *u, uint8_t *buf, size_t buf_size) {
             duart_flush(u, payload_len + 4);
             if(crc16 != msg_crc16) {
                 // CRC mismatch
-                printf("DUART crc err1: %d calc %04x msg %04x\n", payload_len, crc16, msg_crc16);
-                if(u==&duart0) {
-                    debug_counters.uart0_crc_errors++;
-                } else {
-                    debug_counters.uart1_crc_errors++;
-                }
+                duart_corrupt_packet(u, payload_len);
                 continue;
                 //return 0;
             }
@@ -455,16 +496,15 @@ size_t duart_read_packet(duart *u, uint8_t *buf, size_t buf_size) {
 
             if(crc16 != msg_crc16) {
                 // CRC mismatch
-                printf("DUART crc err2: %d calc %04x msg %04x sp %d\n", payload_len, crc16, msg_crc16, second_part);
-                if(u==&duart0) {
-                    debug_counters.uart0_crc_errors++;
-                } else {
-                    debug_counters.uart1_crc_errors++;
-                }
+                duart_corrupt_packet(u, payload_len);
                 continue;
                 //return 0;
             }
         }
+        if(u->check_loopback && duart_echo_match(&u->echo, (uint8_t)(payload_len - 1), crc16)) {
+            // Our own packet made it onto the bus intact
+            continue;
+        }
         if(u==&duart0) {
             debug_counters.uart0_packets_received++;
         } else {
@@ -474,19 +514,13 @@ size_t duart_read_packet(duart *u, uint8_t *buf, size_t buf_size) {
     }
 }
 
-bool duart_send_packet(duart *u, const uint8_t *payload, size_t payload_len) {
-    // Sends a full packet with the given payload. Returns true on success.
-
-    if(payload_len > 256) {
-        // Too big
-        return false;
-    }
+size_t duart_encode_packet(uint8_t *buf, const uint8_t *payload, size_t payload_len) {
+    // Frames the payload into buf (which needs room for payload_len + 4
+    // bytes). Returns the packet length.
 
-    uint8_t buf[DUART_TX_BUFFER_LEN];
     buf[0] = 0xff; // sync byte
     buf[1] = payload_len - 1; // length byte
 
-
     // TODO: adapt the ringbuf to perform the CRC16 calculation, avoiding the
     // extra copy
 
@@ -496,7 +530,26 @@ bool duart_send_packet(duart *u, const uint8_t *payload, size_t payload_len) {
     buf[2 + payload_len] = crc16 & 0xff;
     buf[2 + payload_len + 1] = (crc16 >> 8);
 
+    return payload_len + 4;
+}
+
+bool duart_send_packet(duart *u, const uint8_t *payload, size_t payload_len) {
+    // Sends a full packet with the given payload. Returns true on success.
+
+    if(payload_len > 256) {
+        // Too big
+        return false;
+    }
+
+    uint8_t buf[256 + 4];
+    duart_encode_packet(buf, payload, payload_len);
+    uint16_t crc16 = buf[2 + payload_len] | (buf[2 + payload_len + 1] << 8);
+
     bool ret = duart_send(u, buf, payload_len + 4);
+    if(ret && u->check_loopback) {
+        // Remember the packet so we can check it comes back intact
+        duart_echo_push(&u->echo, payload_len - 1, crc16, millis());
+    }
     if(ret) {
         if(u==&duart0) {
             debug_counters.uart0_packets_sent++;
@@ -507,6 +560,86 @@ bool duart_send_packet(duart *u, const uint8_t *payload, size_t payload_len) {
     return ret;
 }
 
+static uint32_t rx_dma_write_addr(duart *u) {
+    return (uint32_t)dma_channel_hw_addr(u->rx_dma_channel)->write_addr;
+}
+
+static int64_t rx_idle_poll_callback(alarm_id_t id, void *user_data) {
+    duart *u = (duart *)user_data;
+
+    (void)id;
+
+    uint32_t write_addr = rx_dma_write_addr(u);
+    if(write_addr != u->rx_idle_last_addr) {
+        // Still receiving
+        u->rx_idle_last_addr = write_addr;
+        return u->char_time_us * DUART_RX_IDLE_CHARS;
+    }
+
+    // Line has gone quiet after receiving something, so there is probably a
+    // complete packet waiting.
+    u->rx_idle_callback();
+
+    // Stop polling until the next character arrives. A character may have
+    // come in since we looked, before the RX interrupt was unmasked, in which
+    // case carry on polling instead.
+    uint32_t save = save_and_disable_interrupts();
+    uart_get_hw(u->uart)->icr = UART_UARTICR_RXIC_BITS;
+    hw_set_bits(&uart_get_hw(u->uart)->imsc, UART_UARTIMSC_RXIM_BITS);
+    bool missed = rx_dma_write_addr(u) != write_addr;
+    if(missed) {
+        hw_clear_bits(&uart_get_hw(u->uart)->imsc, UART_UARTIMSC_RXIM_BITS);
+        u->rx_idle_last_addr = rx_dma_write_addr(u);
+    } else {
+        u->rx_idle_polling = false;
+    }
+    restore_interrupts(save);
+
+    return missed ? u->char_time_us * DUART_RX_IDLE_CHARS : 0;
+}
+
+static void __not_in_flash_func(on_uart_rx_activity)(duart *u) {
+    // First character after the line was idle. Mask the interrupt again (the
+    // DMA takes care of the data) and poll until the line goes quiet.
+    hw_clear_bits(&uart_get_hw(u->uart)->imsc, UART_UARTIMSC_RXIM_BITS);
+    uart_get_hw(u->uart)->icr = UART_UARTICR_RXIC_BITS;
+
+    if(!u->rx_idle_polling) {
+        u->rx_idle_polling = true;
+        u->rx_idle_last_addr = rx_dma_write_addr(u);
+        add_alarm_in_us(u->char_time_us * DUART_RX_IDLE_CHARS, rx_idle_poll_callback, u, true);
+    }
+}
+
+static void __isr __not_in_flash_func(on_uart0_rx_activity)() {
+    on_uart_rx_activity(&duart0);
+}
+
+static void __isr __not_in_flash_func(on_uart1_rx_activity)() {
+    on_uart_rx_activity(&duart1);
+}
+
+void duart_set_rx_idle_callback(duart *u, void (*callback)(void)) {
+    // The callback is called from the alarm IRQ, so should only do enough to
+    // trigger processing elsewhere.
+    u->rx_idle_callback = callback;
+    u->rx_idle_polling = false;
+
+    uint irq = u->uart==uart0 ? UART0_IRQ : UART1_IRQ;
+    irq_set_exclusive_handler(irq, u->uart==uart0 ? on_uart0_rx_activity : on_uart1_rx_activity);
+    irq_set_enabled(irq, true);
+
+    uart_get_hw(u->uart)->icr = UART_UARTICR_RXIC_BITS;
+    hw_set_bits(&uart_get_hw(u->uart)->imsc, UART_UARTIMSC_RXIM_BITS);
+}
+
+void duart_enable_loopback_check(duart *u) {
+    // Only useful where the RX pin sees our own transmissions, ie. a single
+    // wire bus with the TX pin deasserted when idle.
+    duart_echo_init(&u->echo);
+    u->check_loopback = true;
+}
+
 bool init_duart(duart *u, uint baud_rate, uint tx_pin, uint rx_pin, bool deassert_tx_when_idle) {
     if(u==&duart0) {
         u->uart = uart0;
@@ -519,7 +652,9 @@ bool init_duart(duart *u, uint baud_rate, uint tx_pin, uint rx_pin, bool deasser
 
     ringbuf_init(&u->tx_ringbuf, u->tx_buffer, DUART_TX_BUFFER_LEN);
 
-    uart_init(u->uart, baud_rate);
+    uint actual_baud_rate = uart_init(u->uart, baud_rate);
+    // 10 bits per character, rounded up
+    u->char_time_us = (10 * 1000000 + actual_baud_rate - 1) / actual_baud_rate;
     gpio_set_function(u->rx_pin, UART_FUNCSEL_NUM(u->uart, u->rx_pin));
     if(u->deassert_tx_when_idle) {
         gpio_pull_up(u->tx_pin);
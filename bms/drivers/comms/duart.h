@@ -1,4 +1,6 @@
+#include "duart_echo.h"
 #include "lib/ringbuf.h"
+#include "sys/time/time.h"
 
 #include "hardware/dma.h"
 #include "hardware/uart.h"
@@ -10,6 +12,9 @@
 #define DUART_TX_BUFFER_LEN 256
 #define DUART_RX_BUFFER_BITS 9
 
+// How many character times the RX line must be quiet to count as idle
+#define DUART_RX_IDLE_CHARS 4
+
 typedef struct {
     uart_inst_t *uart;
     uint tx_dma_channel;
@@ -31,6 +36,26 @@ typedef struct {
     uint rx_pin;
     bool deassert_tx_when_idle;
 
+    // Time to shift out one character (start + 8 data + stop bits) at the
+    // actual baud rate, used to work out when the line can be released.
+    uint32_t char_time_us;
+    // When the TX DMA finished feeding the UART, for measuring turnaround
+    uint64_t tx_dma_done_us;
+
+    // Optional RX idle line detection. The RX DMA drains the UART as soon as
+    // each byte arrives, so the UART's own receive timeout interrupt never
+    // fires. Instead the RX interrupt wakes us on the first character, then
+    // we watch the DMA write pointer from an alarm and call back once it
+    // stops moving. Nothing runs while the line is idle.
+    void (*rx_idle_callback)(void);
+    uint32_t rx_idle_last_addr;
+    volatile bool rx_idle_polling;
+
+    // Loopback collision detection, for shared buses where we receive our own
+    // transmissions (see duart_echo.h).
+    bool check_loopback;
+    duart_echo_queue_t echo;
+
 } duart;
 
 extern duart duart0;
@@ -42,3 +67,6 @@ size_t duart_read_packet(duart *u, uint8_t *buf, size_t buf_size);
 bool duart_send(duart *u, const uint8_t *data, size_t len);
 bool duart_send_blocking(duart *u, const uint8_t *data, size_t len);
 bool duart_send_packet(duart *u, const uint8_t *payload, size_t payload_len);
+size_t duart_encode_packet(uint8_t *buf, const uint8_t *payload, size_t payload_len);
+void duart_enable_loopback_check(duart *u);
+void duart_set_rx_idle_callback(duart *u, void (*callback)(void));
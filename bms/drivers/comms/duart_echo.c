@@ -0,0 +1,65 @@
+#include "duart_echo.h"
+
+static void duart_echo_pop(duart_echo_queue_t *q) {
+    q->head = (q->head + 1) % DUART_ECHO_QUEUE_LEN;
+    q->count--;
+}
+
+void duart_echo_init(duart_echo_queue_t *q) {
+    q->head = 0;
+    q->count = 0;
+}
+
+void duart_echo_push(duart_echo_queue_t *q, uint8_t len, uint16_t crc16, millis_t now) {
+    // Remember a packet we just sent, so we can check it comes back intact.
+    if(q->count == DUART_ECHO_QUEUE_LEN) {
+        // No echoes are coming back, drop the oldest
+        duart_echo_pop(q);
+    }
+    uint8_t tail = (q->head + q->count) % DUART_ECHO_QUEUE_LEN;
+    q->entries[tail].len = len;
+    q->entries[tail].crc16 = crc16;
+    q->entries[tail].sent_millis = now;
+    q->count++;
+}
+
+uint8_t duart_echo_expire(duart_echo_queue_t *q, millis_t now) {
+    // Any sent packet which hasn't been read back in time was lost on the bus.
+    // Returns the number of such packets.
+    uint8_t lost = 0;
+    while(q->count > 0 && (now - q->entries[q->head].sent_millis) > DUART_ECHO_TIMEOUT_MS) {
+        duart_echo_pop(q);
+        lost++;
+    }
+    return lost;
+}
+
+bool duart_echo_match(duart_echo_queue_t *q, uint8_t len, uint16_t crc16) {
+    // Returns true if the packet just received is the echo of the oldest packet
+    // we sent, in which case it should not be passed on to the caller.
+    if(q->count == 0) {
+        return false;
+    }
+    if(q->entries[q->head].len != len || q->entries[q->head].crc16 != crc16) {
+        // Probably a packet which was already in flight before we sent ours.
+        return false;
+    }
+    duart_echo_pop(q);
+    return true;
+}
+
+bool duart_echo_corrupt(duart_echo_queue_t *q, uint8_t len) {
+    // Called when a packet fails its CRC. Returns true if it was (probably) our
+    // own packet getting mangled, ie. a collision we were part of.
+    if(q->count == 0) {
+        return false;
+    }
+    if(q->entries[q->head].len != len) {
+        // Not ours, so two other nodes collided (or the line is just noisy).
+        // Our own echo may still be on its way, and if it was mangled too it
+        // will be counted when it times out.
+        return false;
+    }
+    duart_echo_pop(q);
+    return true;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "sys/time/time.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Loopback echo tracking, for shared buses where we receive our own
+// transmissions. Sent packets are remembered by length and CRC, and swallowed
+// when they are read back. An echo that arrives corrupted, or not at all,
+// means another node was transmitting at the same time.
+
+// Number of sent packets we can be awaiting the loopback echo of
+#define DUART_ECHO_QUEUE_LEN 4
+
+// How long to wait for an echo before assuming the packet was lost (the reader
+// may only be polled once per timestep, and other packets may be queued ahead)
+#define DUART_ECHO_TIMEOUT_MS 100
+
+typedef struct {
+    struct {
+        // Length byte of the packet (payload length - 1)
+        uint8_t len;
+        uint16_t crc16;
+        millis_t sent_millis;
+    } entries[DUART_ECHO_QUEUE_LEN];
+    uint8_t head;
+    uint8_t count;
+} duart_echo_queue_t;
+
+void duart_echo_init(duart_echo_queue_t *q);
+void duart_echo_push(duart_echo_queue_t *q, uint8_t len, uint16_t crc16, millis_t now);
+uint8_t duart_echo_expire(duart_echo_queue_t *q, millis_t now);
+bool duart_echo_match(duart_echo_queue_t *q, uint8_t len, uint16_t crc16);
+bool duart_echo_corrupt(duart_echo_queue_t *q, uint8_t len);
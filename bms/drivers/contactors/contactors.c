@@ -1,3 +1,5 @@
+#include "contactors.h"
+
 #include "../../config/pins.h"
 #include "../../config/settings.h"
 #include "../chip/pwm.h"
@@ -12,6 +14,9 @@ uint32_t pos_level = 0;
 uint32_t pre_level = 0;
 uint32_t neg_level = 0;
 
+// Latched by contactors_trip()
+static volatile bool tripped = false;
+
 void contactors_init() {
     init_pwm_pin(PIN_CONTACTOR_POS);
     init_pwm_pin(PIN_CONTACTOR_PRE);
@@ -82,16 +87,38 @@ void contactors_set_pos_pre_neg(bool pos, bool pre, bool neg) {
     // Negative is as requested
     bool actual_neg = neg;
 
-    set_with_pwm(PIN_CONTACTOR_PRE, actual_pre, &pre_level);
-    set_with_pwm(PIN_CONTACTOR_POS, actual_pos, &pos_level);
-    set_with_pwm(PIN_CONTACTOR_NEG, actual_neg, &neg_level);
+    set_with_pwm(PIN_CONTACTOR_PRE, actual_pre && !tripped, &pre_level);
+    set_with_pwm(PIN_CONTACTOR_POS, actual_pos && !tripped, &pos_level);
+    set_with_pwm(PIN_CONTACTOR_NEG, actual_neg && !tripped, &neg_level);
+    if(tripped) {
+        // In case the trip interrupted us part way through
+        contactors_trip();
+    }
 }
 
 void contactors_test_pre(bool closed) {
     // Independently close the precharge contactor for testing, which you can't
     // normally do without also closing the positive contactor, but we do here.
 
-    set_with_pwm(PIN_CONTACTOR_PRE, closed, &pre_level);
+    set_with_pwm(PIN_CONTACTOR_PRE, closed && !tripped, &pre_level);
     set_with_pwm(PIN_CONTACTOR_POS, false, &pos_level);
     set_with_pwm(PIN_CONTACTOR_NEG, false, &neg_level);
-}
\ No newline at end of file
+    if(tripped) {
+        contactors_trip();
+    }
+}
+
+void contactors_trip() {
+    tripped = true;
+    // Takes effect at the end of the current PWM cycle (50µs)
+    pre_level = 0;
+    pos_level = 0;
+    neg_level = 0;
+    pwm_set(PIN_CONTACTOR_PRE, 0);
+    pwm_set(PIN_CONTACTOR_POS, 0);
+    pwm_set(PIN_CONTACTOR_NEG, 0);
+}
+
+bool contactors_tripped() {
+    return tripped;
+}
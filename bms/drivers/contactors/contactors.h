@@ -2,3 +2,8 @@
 
 void contactors_set_pos_pre_neg(bool pos, bool pre, bool neg);
 void contactors_test_pre(bool closed);
+
+// Opens all the contactors, and keeps them open until restart (safe to call
+// from an interrupt)
+void contactors_trip();
+bool contactors_tripped();
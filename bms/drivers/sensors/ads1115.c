@@ -225,7 +225,12 @@ void ads1115_irq_handler(ads1115_t *dev) {
                 if(sample==0) {
                     //printf("ADS1115 %d read zero sample!\n", dev->current_channel);
                 }
-                sampler_add(&samples[dev->current_channel], (int32_t)sample, ADS1115_OVERSAMPLING, 0);
+                // The conversion happened a few ms ago (it takes
+                // ADS1115_CONVERSION_TIME_MS, and we then waited a bit
+                // longer), so stamp it with roughly its midpoint
+                const micros_t sample_us = time_us_32()
+                    - (ADS1115_CONVERSION_TIME_EXTRA_MS * 1000 + ADS1115_CONVERSION_TIME_MS * 1000 / 2);
+                sampler_add_timed(&samples[dev->current_channel], (int32_t)sample, ADS1115_OVERSAMPLING, 0, sample_us);
 
                 if (dev->cal_samples_left[dev->current_channel] > 0) {
                     dev->cal_accumulator[dev->current_channel] += sample;
@@ -300,3 +305,7 @@ millis_t ads1115_get_sample_millis(int channel) {
     return samples[channel].timestamp;
     //return ads1115_sample_millis[channel];
 }
+
+micros_t ads1115_get_sample_us(int channel) {
+    return samples[channel].timestamp_us;
+}
@@ -64,6 +64,8 @@ void ads1115_start_sampling(ads1115_t *dev);
 void ads1115_irq_handler(ads1115_t *dev);
 int16_t ads1115_get_sample_range(int channel);
 millis_t ads1115_get_sample_millis(int channel);
+// The instant in the middle of the batch of conversions behind the latest value
+micros_t ads1115_get_sample_us(int channel);
 void ads1115_start_calibration(ads1115_t *dev, uint16_t num_samples);
 bool ads1115_calibration_finished(ads1115_t *dev);
 int32_t ads1115_get_calibration(ads1115_t *dev, int channel);
@@ -3,7 +3,9 @@
 #include "config/allocations.h"
 #include "config/pins.h"
 #include "app/model.h"
+#include "app/estimators/current_history.h"
 
+#include "hardware/gpio.h"
 #include "hardware/irq.h"
 #include "hardware/i2c.h"
 
@@ -19,6 +21,7 @@
 
 // ADC_CONFIG register bits
 #define INA228_ADC_MODE_CONT_SHUNT  0xa
+#define INA228_ADC_MODE_CONT_BUS_SHUNT 0xb
 #define INA228_ADC_MODE_CONT_ALL   0xf
 
 
@@ -53,6 +56,10 @@ static millis_t ina228_current_millis = 0;
 static int64_t ina228_charge_raw = 0;
 static millis_t ina228_charge_millis = 0;
 
+// The ALERT interrupt's pin, and what it calls
+static unsigned int alert_pin;
+static void (*alert_on_limit)(void) = NULL;
+
 // Helper function to write a 16-bit register
 static bool ina228_write_reg16(ina228_t *dev, uint8_t reg, uint16_t value) {
     uint8_t buf[3];
@@ -136,6 +143,30 @@ static bool ina228_read_reg16(ina228_t *dev, uint8_t reg, uint16_t *value) {
     return true;
 }
 
+// The ADC_CONFIG for each profile (see INA228_CONVERSION_PERIOD_US and
+// INA228_FAST_CONVERSION_PERIOD_US)
+static uint16_t ina228_adc_config(ina228_profile_t profile) {
+    uint16_t shunt_ct = INA228_CT_2074US;
+    uint16_t avg = INA228_AVG_256;
+    if (profile == INA228_PROFILE_FAST) {
+        shunt_ct = INA228_CT_150US;
+        avg = INA228_AVG_16;
+    }
+
+#if INA228_ENERGY_ACCOUNTING
+    // VBUS is only needed for power and energy, so convert it quickly to keep
+    // the shunt's share of each conversion high
+    return (INA228_ADC_MODE_CONT_BUS_SHUNT << 12) |
+           INA228_ADC_VBUSCT(INA228_CT_50US) |
+#else
+    return (INA228_ADC_MODE_CONT_SHUNT << 12) |
+           INA228_ADC_VBUSCT(INA228_CT_2074US) |
+#endif
+           INA228_ADC_VSHCT(shunt_ct) |
+           INA228_ADC_VTCT(INA228_CT_2074US) |
+           INA228_ADC_AVG(avg);
+}
+
 bool ina228_init(ina228_t *dev, uint8_t i2c_addr, float shunt_resistor_ohms, float max_current_a) {
     dev->i2c = INA228_I2C;
     dev->addr = i2c_addr;
@@ -209,7 +240,7 @@ void ina228_configure(ina228_t *dev) {
     float shunt_cal_float = 13107.2e6f * dev->current_lsb * dev->shunt_resistor_ohms;
     uint16_t shunt_cal = (uint16_t)shunt_cal_float;
     // 332 to read mA, *4 due to adcrange, /4 because we want in 0.25mA units instead
-    shunt_cal = 332*4/4;
+    shunt_cal = INA228_SHUNT_CAL;
     
     printf("INA228: Current LSB = %.6f A/LSB\n", dev->current_lsb);
     printf("INA228: SHUNT_CAL = %u (0x%04X)\n", shunt_cal, shunt_cal);
@@ -220,14 +251,9 @@ void ina228_configure(ina228_t *dev) {
         return;
     }
     
-    // Configure ADC: continuous mode, all measurements
-    // Use 540µs conversion time for balance between speed and noise
-    // Use 4x averaging for good noise rejection
-    uint16_t adc_config = (INA228_ADC_MODE_CONT_SHUNT << 12) |
-                          INA228_ADC_VBUSCT(INA228_CT_2074US) |
-                          INA228_ADC_VSHCT(INA228_CT_2074US) |
-                          INA228_ADC_VTCT(INA228_CT_2074US) |
-                          INA228_ADC_AVG(INA228_AVG_256);
+    // Configure ADC: continuous mode, low noise to start with
+    dev->profile = INA228_PROFILE_LOW_NOISE;
+    uint16_t adc_config = ina228_adc_config(dev->profile);
     
     if (!ina228_write_reg16(dev, INA228_REG_ADC_CONFIG, adc_config)) {
         printf("INA228: Failed to write ADC_CONFIG\n");
@@ -242,12 +268,18 @@ void ina228_configure(ina228_t *dev) {
         return;
     }
 
-    // Configure Diagnostic flags
-    // uint16_t diag_alrt = 0x0001; // No alerts for now
-    // if (!ina228_write_reg16(dev, INA228_REG_DIAG_ALRT, diag_alrt)) {
-    //     printf("INA228: Failed to write DIAG_ALRT\n");
-    //     return;
-    // }
+    // Configure Diagnostic flags. ALERT is only used for the shunt limits
+    // (not conversions; the other limits stay at their power-on extremes),
+    // and compares every sample rather than waiting for the average, so it
+    // falls within a sample of an overcurrent (the trip current is set above
+    // ripple peaks to allow for this, see OVERCURRENT_TRIP_PERCENT). Latching
+    // it means a brief overcurrent can't be missed between polls. The limits
+    // start at their widest until ina228_set_shunt_limits().
+    uint16_t diag_alrt = INA228_DIAG_ALATCH;
+    if (!ina228_write_reg16(dev, INA228_REG_DIAG_ALRT, diag_alrt)) {
+        printf("INA228: Failed to write DIAG_ALRT\n");
+        return;
+    }
     
     printf("INA228: Configuration complete\n");
 }
@@ -260,7 +292,107 @@ static int32_t div_round_closest(const int32_t n, const int32_t d)
 //#define SAMPLING_PERIOD_SMOOTHING 2048
 uint32_t last_sample_us = 0;
 //uint32_t average_sampling_period_us = 530000; //530944; // Initial estimate based on INA228 datasheet
-float average_sampling_period_us = 530307.0f; // Initial estimate based on INA228 datasheet
+// Initial estimate based on INA228 datasheet (the chip's clock was measured
+// running ~0.1% fast)
+float average_sampling_period_us = INA228_CONVERSION_PERIOD_US * (530307.0f / 530944.0f);
+// When we last polled, so we can bound when a new conversion finished
+static micros_t last_poll_us = 0;
+
+bool ina228_set_profile(ina228_t *dev, ina228_profile_t profile) {
+    if (profile == dev->profile) {
+        return true;
+    }
+    if (!ina228_write_reg16(dev, INA228_REG_ADC_CONFIG, ina228_adc_config(profile))) {
+        printf("INA228: Failed to write ADC_CONFIG\n");
+        return false;
+    }
+    dev->profile = profile;
+
+    // The CHARGE accumulator carries on through the switch, but the period
+    // estimate only applies to unbroken runs of low noise conversions.
+    last_sample_us = 0;
+    return true;
+}
+
+#if INA228_ENERGY_ACCOUNTING
+// The ENERGY register as of the last conversion, and its increments so far
+// split by the direction of the current
+static int64_t last_energy_raw = -1;
+static int64_t energy_in_raw = 0;
+static int64_t energy_out_raw = 0;
+
+// Reads the bus voltage and energy accumulator that came with a new conversion
+static bool ina228_read_energy(ina228_t *dev, int32_t current) {
+    int32_t vbus_raw;
+    int64_t energy_raw;
+    if (!ina228_read_reg20(dev, INA228_REG_VBUS, &vbus_raw)) {
+        printf("INA228: Failed to read VBUS\n");
+        return false;
+    }
+    if (!ina228_read_reg40(dev, INA228_REG_ENERGY, &energy_raw)) {
+        printf("INA228: Failed to read ENERGY\n");
+        return false;
+    }
+
+    // VBUS LSB = 195.3125 µV
+    model.bus_voltage_mV = (int32_t)(((int64_t)vbus_raw * 1953125 * INA228_VBUS_DIVIDER) / 10000000);
+    model.bus_voltage_millis = model.current_millis;
+
+    // The accumulator counts power regardless of its direction, so attribute
+    // each conversion's worth by the sign of its current. It's 40 bits wide,
+    // which at 12.8mJ per LSB would take MWh to wrap, but allow for it anyway.
+    if (last_energy_raw >= 0) {
+        int64_t delta = (energy_raw - last_energy_raw) & 0xFFFFFFFFFFll;
+        if (current >= 0) {
+            energy_in_raw += delta;
+        } else {
+            energy_out_raw += delta;
+        }
+    }
+    last_energy_raw = energy_raw;
+
+    // Energy LSB = 16 × POWER_LSB = 16 × 3.2 × CURRENT_LSB (0.25mA) = 12.8mJ
+    // at the VBUS pin
+    model.energy_in_mJ = (energy_in_raw * 128 * INA228_VBUS_DIVIDER) / 10;
+    model.energy_out_mJ = (energy_out_raw * 128 * INA228_VBUS_DIVIDER) / 10;
+    model.energy_millis = model.current_millis;
+    return true;
+}
+#endif
+
+static void ina228_alert_irq_handler() {
+    if (gpio_get_irq_event_mask(alert_pin) & GPIO_IRQ_EDGE_FALL) {
+        gpio_acknowledge_irq(alert_pin, GPIO_IRQ_EDGE_FALL);
+        // Only the shunt limits pull ALERT low, so act on it straight away.
+        // The next poll reads DIAG_ALRT, to record which limit it was (and
+        // release ALERT).
+        alert_on_limit();
+    }
+}
+
+void ina228_enable_alert(unsigned int pin, void (*on_limit)(void)) {
+    alert_pin = pin;
+    alert_on_limit = on_limit;
+
+    gpio_init(pin);
+    gpio_set_dir(pin, GPIO_IN);
+    // ALERT is open drain
+    gpio_pull_up(pin);
+
+    gpio_add_raw_irq_handler(pin, ina228_alert_irq_handler);
+    gpio_set_irq_enabled(pin, GPIO_IRQ_EDGE_FALL, true);
+    irq_set_priority(IO_IRQ_BANK0, PICO_HIGHEST_IRQ_PRIORITY);
+    irq_set_enabled(IO_IRQ_BANK0, true);
+}
+
+bool ina228_set_shunt_limits(ina228_t *dev, int16_t sovl, int16_t suvl) {
+    if (!ina228_write_reg16(dev, INA228_REG_SOVL, (uint16_t)sovl) ||
+        !ina228_write_reg16(dev, INA228_REG_SUVL, (uint16_t)suvl)) {
+        printf("INA228: Failed to write shunt limits\n");
+        return false;
+    }
+    return true;
+}
 
 // Read current from the INA228 (blocking)
 bool ina228_read_current_blocking(ina228_t *dev) {
@@ -272,6 +404,8 @@ bool ina228_read_current_blocking(ina228_t *dev) {
         printf("INA228: Failed to read DIAG_ALRT\n");
         return false;
     }
+    // Reading clears these (and releases ALERT), so keep them for the caller
+    dev->limit_flags |= diag_alert & (INA228_DIAG_SHNTOL | INA228_DIAG_SHNTUL);
 
     if (!ina228_read_reg20(dev, INA228_REG_CURRENT, &current_raw)) {
         printf("INA228: Failed to read CURRENT\n");
@@ -282,17 +416,32 @@ bool ina228_read_current_blocking(ina228_t *dev) {
     // Positive current means charging.
     model.current_mA = div_round_closest(current_corrected, 4);
 
+    uint32_t now_us = time_us_32();
+    micros_t poll_us = last_poll_us;
+    last_poll_us = now_us;
+
     // Was a new conversion
-    if(diag_alert & 0x0002) {
+    if(diag_alert & INA228_DIAG_CNVRF) {
         model.current_millis = millis();
 
         //printf("raw current: %d\n", current_raw);
 
-        uint32_t now_us = time_us_32();
+        // The conversion finished at some point since the last poll, and
+        // averaged the current over the conversion period before that, so its
+        // midpoint is about half a period before the midpoint of the polls.
+        float period_us = dev->profile == INA228_PROFILE_FAST ?
+            (float)INA228_FAST_CONVERSION_PERIOD_US : average_sampling_period_us;
+        micros_t completed_us = now_us;
+        if(poll_us != 0 && (int32_t)(now_us - poll_us) < (int32_t)period_us) {
+            completed_us = poll_us + (now_us - poll_us) / 2;
+        }
+        model.current_us = completed_us - (micros_t)(period_us / 2);
+        current_history_add(model.current_mA, model.current_us);
+
         uint32_t elapsed_us = now_us - last_sample_us;
 
         // TODO: do we care about this?
-        if(last_sample_us != 0) {
+        if(last_sample_us != 0 && dev->profile == INA228_PROFILE_LOW_NOISE) {
             average_sampling_period_us = (average_sampling_period_us * 0.99999f) + ((float)elapsed_us * 0.00001f);
         }
 
@@ -300,23 +449,37 @@ bool ina228_read_current_blocking(ina228_t *dev) {
         last_sample_us = now_us;
         //printf("avg: %.2f us\n", average_sampling_period_us);
 
-        // Is a new conversion, update charge
-        model.charge_raw += (int64_t)current_corrected;
-        model.charge_millis = model.current_millis;
-
-        // charge_raw is in units equivalent to 0.132736mC (0.25mA LSB, 530.944ms per sample)
+        // Is a new conversion, update charge. This comes from the INA228's
+        // own accumulator, which integrates every conversion over its actual
+        // length whichever profile is in use, so the fast conversions which
+        // finish between polls are counted as well as the one we see.
+        if (!ina228_read_charge(dev)) {
+            printf("INA228: Failed to read CHARGE\n");
+            return false;
+        }
 
-        // We sample at the same rate as the INA228 conversions, which has a
-        // clock accurate to 1% - we would do better to use the crystal instead,
-        // but the jitter would probably outweigh the accuracy improvement.
+        // The accumulator runs from the INA228's clock, which is accurate to
+        // 1% - we would do better to use the crystal instead, but the jitter
+        // would probably outweigh the accuracy improvement.
 
         dev->null_accumulator += current_raw;
         dev->null_counter++;
+
+#if INA228_ENERGY_ACCOUNTING
+        if (!ina228_read_energy(dev, current_corrected)) {
+            return false;
+        }
+#endif
     }
     
     return true;
 }
 
+// When the CHARGE accumulator was last read, and the offset correction not yet
+// a whole LSB (in LSB·µs)
+static micros_t last_charge_us = 0;
+static int64_t offset_remainder = 0;
+
 // Read charge accumulator from the INA228 (blocking)
 bool ina228_read_charge(ina228_t *dev) {
     int64_t charge_raw;
@@ -324,14 +487,34 @@ bool ina228_read_charge(ina228_t *dev) {
     if (!ina228_read_reg40(dev, INA228_REG_CHARGE, &charge_raw)) {
         return false;
     }
-    
+    // 40 bit two's complement
+    if (charge_raw & (1ll << 39)) {
+        charge_raw -= 1ll << 40;
+    }
+    micros_t now_us = time_us_32();
+
+    if (ina228_charge_millis != 0) {
+        // Only the change is counted, so the accumulator restarting (eg, on
+        // a reset of the INA228) or wrapping doesn't matter
+        int64_t delta = (charge_raw - ina228_charge_raw) & 0xFFFFFFFFFFll;
+        if (delta & (1ll << 39)) {
+            delta -= 1ll << 40;
+        }
+
+        // The accumulator doesn't know about the shunt's offset, so take out
+        // what it would have added over the time since the last read
+        offset_remainder += (int64_t)model.current_offset * (micros_t)(now_us - last_charge_us);
+        int64_t offset = offset_remainder / 1000000;
+        offset_remainder -= offset * 1000000;
+
+        model.charge_raw += delta - offset;
+        model.charge_millis = millis();
+    }
+
     // Store in global variables
     ina228_charge_raw = charge_raw;
     ina228_charge_millis = millis();
-    
-    // Update model
-    model.charge_raw = charge_raw;
-    model.charge_millis = ina228_charge_millis;
+    last_charge_us = now_us;
     
     return true;
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "../../config/settings.h"
 #include "../../sys/time/time.h"
 
 #include "pico/stdlib.h"
@@ -29,11 +30,43 @@
 
 #define INA228_I2C_TIMEOUT_US     10000
 
+// DIAG_ALRT register bits
+#define INA228_DIAG_ALATCH         (1 << 15) // ALERT stays asserted until DIAG_ALRT is read
+#define INA228_DIAG_SHNTOL         (1 << 6)  // shunt voltage over SOVL
+#define INA228_DIAG_SHNTUL         (1 << 5)  // shunt voltage under SUVL
+#define INA228_DIAG_CNVRF          (1 << 1)  // conversion completed
+
+// Each of the 256 averaged samples converts the shunt for 2074µs, after VBUS
+// for 50µs if it's being measured
+#if INA228_ENERGY_ACCOUNTING
+#define INA228_CONVERSION_PERIOD_US ((50 + 2074) * 256)
+#else
+#define INA228_CONVERSION_PERIOD_US (2074 * 256)
+#endif
+// The fast profile only averages 16 samples, of 150µs
+#if INA228_ENERGY_ACCOUNTING
+#define INA228_FAST_CONVERSION_PERIOD_US ((50 + 150) * 16)
+#else
+#define INA228_FAST_CONVERSION_PERIOD_US (150 * 16)
+#endif
+
+typedef enum {
+    // Long conversions, for low noise coulomb counting
+    INA228_PROFILE_LOW_NOISE = 0,
+    // Short conversions, to follow transients (eg, while the contactors
+    // switch), to be polled every tick
+    INA228_PROFILE_FAST = 1,
+} ina228_profile_t;
+
 typedef struct {
     i2c_inst_t *i2c;
     uint8_t addr;
     float current_lsb;
     float shunt_resistor_ohms;
+    ina228_profile_t profile;
+    // Shunt limit flags seen while polling (INA228_DIAG_SHNTOL/SHNTUL), until
+    // cleared by the caller
+    uint16_t limit_flags;
 
     int32_t null_accumulator;
     uint32_t null_counter;
@@ -49,9 +82,23 @@ typedef struct {
 
 bool ina228_init(ina228_t *dev, uint8_t i2c_addr, float shunt_resistor_ohms, float max_current_a);
 void ina228_configure(ina228_t *dev);
+// Switches the conversion profile (if it isn't already in use)
+bool ina228_set_profile(ina228_t *dev, ina228_profile_t profile);
+// Programs the shunt over/under-voltage limits, in 1.25µV LSBs (see
+// overcurrent_trip_shunt_limit), beyond which ALERT is pulled low
+bool ina228_set_shunt_limits(ina228_t *dev, int16_t sovl, int16_t suvl);
+// Watches the (active low) ALERT pin from a high priority interrupt, which
+// calls on_limit as soon as a shunt limit is crossed. The interrupt doesn't
+// touch the bus: the limit flags turn up in limit_flags at the next poll.
+// GPIO interrupts are masked while flash_safe_execute() writes to flash (eg,
+// saving the SoH, cycle or energy counters), which can delay it by up to the
+// length of an erase.
+void ina228_enable_alert(unsigned int pin, void (*on_limit)(void));
 
 // Blocking read functions
 bool ina228_read_current_blocking(ina228_t *dev);
+// Adds the change in the CHARGE accumulator since the last read (less the
+// shunt's offset) to the model's charge_raw
 bool ina228_read_charge(ina228_t *dev);
 bool ina228_read_shunt_voltage(ina228_t *dev, float *voltage_mv);
 bool ina228_read_bus_voltage(ina228_t *dev, float *voltage_mv);
@@ -62,8 +109,9 @@ millis_t ina228_get_current_millis();
 int64_t ina228_get_charge_raw();
 millis_t ina228_get_charge_millis();
 
+// The CHARGE accumulator's LSB is the CURRENT LSB (0.25mA) for one second
+#define INA228_CHARGE_LSB_uC 250
+
 static inline int64_t raw_charge_to_mC(int64_t charge_raw) {
-    // Each LSB of charge_raw represents 0.132736 mC
-    // (0.25mA * 530.944ms)
-    return (charge_raw * 132736) / 1000000;
+    return (charge_raw * INA228_CHARGE_LSB_uC) / 1000;
 }
\ No newline at end of file
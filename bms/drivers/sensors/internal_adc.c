@@ -1,9 +1,12 @@
 #include "internal_adc.h"
+#include "app/monitoring/counters.h"
 #include "sys/time/time.h"
 #include "config/pins.h"
+#include "lib/filters.h"
 #include "lib/sampler.h"
 
 #include "hardware/adc.h"
+#include "hardware/dma.h"
 
 #if PICO_RP2350A == 1
 // A variant
@@ -18,18 +21,86 @@
 
 #define OVERSAMPLING 256
 
-static sampler_t samples[9] = {0};
-
-void __isr __not_in_flash_func(adc_irq_handler)() {
-    int i = 0;
-    for(int i=0; i < 8 && !adc_fifo_is_empty(); i++) {
-        uint32_t sample = adc_fifo_get();
-        // Feed to sampler
-        sampler_add(&samples[i], (int32_t)sample, OVERSAMPLING, 0);
+// The ADC round-robins over the first 4 channels and the temp sensor, and DMA
+// streams every result into the ring below. Since no samples are ever lost
+// (unless we fall a whole ring behind), sample N is always channel N % 5.
+#define INTERNAL_ADC_CHANNELS 5
+#define INTERNAL_ADC_RING_BITS 13 // 8KB, 4096 samples
+#define INTERNAL_ADC_RING_SAMPLES ((1 << INTERNAL_ADC_RING_BITS) / sizeof(uint16_t))
+// 48MHz / 4800 = 10k samples/s in total, 2k/s per channel. With 256x
+// oversampling each channel then updates every 128ms.
+#define INTERNAL_ADC_CLKDIV 4799
+#define INTERNAL_ADC_SAMPLE_PERIOD_US 100
+// If we haven't emptied the ring for this long, it might have lapped us
+#define INTERNAL_ADC_RING_TIMEOUT_US (INTERNAL_ADC_RING_SAMPLES * INTERNAL_ADC_SAMPLE_PERIOD_US * 3 / 4)
+
+static uint16_t ring[INTERNAL_ADC_RING_SAMPLES] __attribute__((aligned(1 << INTERNAL_ADC_RING_BITS)));
+static int dma_channel;
+static dma_channel_config dma_config;
+// Position of the next sample to process, and which channel it's from
+static uint32_t ring_read_idx = 0;
+static uint8_t ring_read_channel = 0;
+// When the ring was last emptied (zero if sampling isn't running yet)
+static uint32_t ring_read_us = 0;
+
+static sampler_t samples[INTERNAL_ADC_CHANNELS] = {0};
+// The contactor supply picks up spikes from the coil drivers, so take those out
+// before averaging
+static filter_median_t contactor_median;
+
+// (Re)start sampling from the first channel, with an empty ring.
+static void internal_adc_start() {
+    adc_run(false);
+    dma_channel_abort(dma_channel);
+    // Let any conversion in progress finish before discarding it
+    while(!(adc_hw->cs & ADC_CS_READY_BITS)) {
+        tight_loop_contents();
     }
-
-    // Always reset to first channel so we don't get out of sync
+    adc_fifo_drain();
     adc_select_input(0);
+
+    ring_read_idx = 0;
+    ring_read_channel = 0;
+    dma_channel_configure(
+        dma_channel,
+        &dma_config,
+        ring,
+        &adc_hw->fifo,
+        dma_encode_endless_transfer_count(),
+        true
+    );
+
+    adc_run(true);
+}
+
+void internal_adc_tick() {
+    uint32_t now_us = time_us_32();
+    if(ring_read_us == 0 || (now_us - ring_read_us) > INTERNAL_ADC_RING_TIMEOUT_US) {
+        if(ring_read_us != 0) {
+            // We were away long enough (eg, a slow flash write) that we can no
+            // longer be sure which sample is which channel.
+            debug_counters.internal_adc_resyncs++;
+        }
+        internal_adc_start();
+        ring_read_us = now_us;
+        return;
+    }
+    ring_read_us = now_us;
+
+    uint32_t write_idx = ((uint32_t)dma_channel_hw_addr(dma_channel)->write_addr - (uint32_t)ring) / sizeof(uint16_t);
+    write_idx &= INTERNAL_ADC_RING_SAMPLES - 1;
+
+    while(ring_read_idx != write_idx) {
+        int32_t sample = ring[ring_read_idx];
+        if(ring_read_channel == INTERNAL_ADC_CONTACTOR_INDEX) {
+            sample = filter_median_add(&contactor_median, sample);
+        }
+        sampler_add(&samples[ring_read_channel], sample, OVERSAMPLING, 0);
+        ring_read_idx = (ring_read_idx + 1) & (INTERNAL_ADC_RING_SAMPLES - 1);
+        if(++ring_read_channel == INTERNAL_ADC_CHANNELS) {
+            ring_read_channel = 0;
+        }
+    }
 }
 
 int32_t get_temperature_c_times10() {
@@ -51,34 +122,29 @@ void init_internal_adc() {
 
     adc_set_temp_sensor_enabled(true);
     
-    // adc_set_round_robin(
-    //     // (1<<(PIN_3V3_SENSE - ADC_CHANNEL_GPIO_OFFSET)) |
-    //     // (1<<(PIN_5V_SENSE - ADC_CHANNEL_GPIO_OFFSET)) |
-    //     // (1<<(PIN_12V_SENSE - ADC_CHANNEL_GPIO_OFFSET)) |
-    //     // (1<<(PIN_CONTACTOR_SENSE - ADC_CHANNEL_GPIO_OFFSET)) |
-    //     (1<<ADC_CHANNEL_TEMP_SENSOR)
-    // );
     adc_set_round_robin(0x10F); // First 4 channels + temp sensor
 
-    adc_set_clkdiv(150000.0f); // Cycles per sample (if too low (fast), the ISR can't keep up)
+    adc_set_clkdiv(INTERNAL_ADC_CLKDIV);
 
     adc_fifo_setup(
         true,    // Write each completed conversion to the sample FIFO
-        false,   // Disable DMA data request (DREQ)
-        5,       // IRQ threshold at 5 samples
-        false,    // Include error bit
+        true,    // Enable DMA data request (DREQ)
+        1,       // DREQ on every sample
+        false,   // Include error bit
         false    // No shift
     );
 
-    // setup irq
-    adc_irq_set_enabled(true);
+    dma_channel = dma_claim_unused_channel(true);
+    dma_config = dma_channel_get_default_config(dma_channel);
+    channel_config_set_transfer_data_size(&dma_config, DMA_SIZE_16);
+    channel_config_set_read_increment(&dma_config, false);
+    channel_config_set_write_increment(&dma_config, true);
+    channel_config_set_dreq(&dma_config, DREQ_ADC);
+    channel_config_set_ring(&dma_config, true, INTERNAL_ADC_RING_BITS);
 
-    irq_set_exclusive_handler(ADC_IRQ_FIFO, adc_irq_handler);
-    irq_set_enabled(ADC_IRQ_FIFO, true);
+    filter_median_init(&contactor_median, 3);
 
-    adc_select_input(0);//PIN_12V_SENSE - ADC_CHANNEL_GPIO_OFFSET);
-    adc_fifo_drain();
-    adc_run(true);
+    // Sampling starts on the first internal_adc_tick()
 }
 
 int32_t internal_adc_read(uint8_t channel) {
@@ -10,6 +10,9 @@
 // extern uint16_t adc_samples_smoothed[8];
 
 void init_internal_adc();
+// Processes the samples collected since the last call. Should be called every
+// tick.
+void internal_adc_tick();
 int32_t get_temperature_c_times10();
 int32_t internal_adc_read_3v3_mv();
 int32_t internal_adc_read_5v_mv();
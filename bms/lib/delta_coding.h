@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Delta coding for cell voltages (used by the HMI protocol and USB telemetry):
+//   Absolute values sent as two-byte big-endian signed 15-bit integers, with
+//   the MSB set
+//   Delta values sent as single-byte signed integers in the range -64 to +63,
+//   with the MSB clear
+//   Initial value is zero (if first byte is a delta).
+
+// Encode count values into buf (which needs room for 2*count bytes). Returns
+// the number of bytes written.
+static inline size_t delta_encode_i16(uint8_t *buf, const int16_t *values, size_t count) {
+    size_t idx = 0;
+    int16_t last_value = 0;
+    for(size_t i = 0; i < count; i++) {
+        const int16_t value = values[i];
+        const int16_t delta = value - last_value;
+        if(delta >= -64 && delta <= 63) {
+            // can encode as delta
+            buf[idx++] = (delta & 0x7F);
+        } else {
+            // encode as absolute
+            buf[idx++] = ((value >> 8) & 0xFF) | 0x80; // set high bit for absolute values
+            buf[idx++] = (value >> 0) & 0xFF;
+        }
+        last_value = value;
+    }
+    return idx;
+}
+
+// Decode count values from buf. Returns the number of bytes consumed, or 0 if
+// buf is too short.
+static inline size_t delta_decode_i16(int16_t *values, size_t count, const uint8_t *buf, size_t len) {
+    size_t idx = 0;
+    int16_t last_value = 0;
+    for(size_t i = 0; i < count; i++) {
+        if(idx >= len) {
+            return 0;
+        }
+        if(buf[idx] & 0x80) {
+            if(idx + 1 >= len) {
+                return 0;
+            }
+            // Sign extend from 15 bits
+            uint16_t raw = ((uint16_t)(buf[idx] & 0x7F) << 8) | buf[idx + 1];
+            if(raw & 0x4000) {
+                raw |= 0x8000;
+            }
+            last_value = (int16_t)raw;
+            idx += 2;
+        } else {
+            // Sign extend from 7 bits
+            int8_t delta = (int8_t)(buf[idx] << 1) >> 1;
+            last_value += delta;
+            idx += 1;
+        }
+        values[i] = last_value;
+    }
+    return idx;
+}
@@ -0,0 +1,165 @@
+#include "filters.h"
+
+#include <string.h>
+
+void filter_cic_init(filter_cic_t *f, uint8_t order, uint16_t decimation) {
+    memset(f, 0, sizeof(*f));
+    if(order < 1) order = 1;
+    if(order > FILTER_CIC_MAX_ORDER) order = FILTER_CIC_MAX_ORDER;
+    if(decimation < 1) decimation = 1;
+    f->order = order;
+    f->decimation = decimation;
+    f->gain = 1;
+    for(uint8_t i = 0; i < order; i++) {
+        f->gain *= decimation;
+    }
+}
+
+bool filter_cic_add(filter_cic_t *f, int32_t sample) {
+    // Unsigned so that the integrators wrap (rather than overflowing, which
+    // would be undefined)
+    uint32_t x = (uint32_t)sample;
+    for(uint8_t i = 0; i < f->order; i++) {
+        f->integrators[i] += x;
+        x = f->integrators[i];
+    }
+
+    if(++f->phase < f->decimation) {
+        return false;
+    }
+    f->phase = 0;
+
+    for(uint8_t i = 0; i < f->order; i++) {
+        uint32_t y = x - f->combs[i];
+        f->combs[i] = x;
+        x = y;
+    }
+    f->value = (int32_t)x / (int32_t)f->gain;
+    return true;
+}
+
+void filter_ema_init(filter_ema_t *f, uint8_t shift) {
+    memset(f, 0, sizeof(*f));
+    f->shift = shift;
+}
+
+int32_t filter_ema_add(filter_ema_t *f, int32_t sample) {
+    if(!f->primed) {
+        f->accumulator = sample * (1 << f->shift);
+        f->primed = true;
+    } else {
+        f->accumulator += sample - (f->accumulator >> f->shift);
+    }
+    f->value = f->accumulator >> f->shift;
+    return f->value;
+}
+
+void filter_median_init(filter_median_t *f, uint8_t size) {
+    memset(f, 0, sizeof(*f));
+    if(size < 1) size = 1;
+    if(size > FILTER_MEDIAN_MAX) size = FILTER_MEDIAN_MAX;
+    f->size = size | 1; // must be odd
+    if(f->size > FILTER_MEDIAN_MAX) f->size -= 2;
+}
+
+int32_t filter_median_add(filter_median_t *f, int32_t sample) {
+    f->window[f->next] = sample;
+    f->next = (f->next + 1) % f->size;
+    if(f->count < f->size) {
+        f->count++;
+    }
+
+    // Insertion sort of a copy, which is quicker than anything cleverer for
+    // windows this small
+    int32_t sorted[FILTER_MEDIAN_MAX];
+    for(uint8_t i = 0; i < f->count; i++) {
+        int32_t v = f->window[i];
+        uint8_t j = i;
+        while(j > 0 && sorted[j - 1] > v) {
+            sorted[j] = sorted[j - 1];
+            j--;
+        }
+        sorted[j] = v;
+    }
+
+    f->value = sorted[f->count / 2];
+    return f->value;
+}
+
+void filter_stats_init(filter_stats_t *f, uint16_t block_size) {
+    memset(f, 0, sizeof(*f));
+    f->block_size = block_size < 1 ? 1 : block_size;
+}
+
+bool filter_stats_add(filter_stats_t *f, int32_t sample) {
+    if(f->count == 0) {
+        f->offset = sample;
+        f->cur_min = sample;
+        f->cur_max = sample;
+    } else if(sample < f->cur_min) {
+        f->cur_min = sample;
+    } else if(sample > f->cur_max) {
+        f->cur_max = sample;
+    }
+    int64_t d = (int64_t)sample - f->offset;
+    f->sum += d;
+    f->sum_sq += d * d;
+    f->count++;
+
+    if(f->count < f->block_size) {
+        return false;
+    }
+
+    // var = (n*sum_sq - sum^2) / n^2, where both terms fit in 62 bits
+    int64_t n = f->count;
+    f->mean = f->offset + (int32_t)(f->sum / n);
+    f->variance = (uint32_t)((n * f->sum_sq - f->sum * f->sum) / (n * n));
+    f->min = f->cur_min;
+    f->max = f->cur_max;
+
+    f->sum = 0;
+    f->sum_sq = 0;
+    f->count = 0;
+    return true;
+}
+
+void filter_outlier_init(filter_outlier_t *f, uint8_t shift, uint8_t threshold_mul, int32_t threshold_min, uint8_t max_rejects) {
+    memset(f, 0, sizeof(*f));
+    filter_ema_init(&f->mean, shift);
+    filter_ema_init(&f->deviation, shift);
+    f->threshold_mul = threshold_mul;
+    f->threshold_min = threshold_min;
+    f->max_rejects = max_rejects;
+}
+
+bool filter_outlier_check(filter_outlier_t *f, int32_t sample) {
+    if(!f->mean.primed) {
+        filter_ema_add(&f->mean, sample);
+        filter_ema_add(&f->deviation, 0);
+        return true;
+    }
+
+    int32_t error = sample - f->mean.value;
+    if(error < 0) error = -error;
+
+    int32_t threshold = f->deviation.value * f->threshold_mul + f->threshold_min;
+    if(error > threshold) {
+        if(++f->rejects < f->max_rejects) {
+            f->rejected_total++;
+            return false;
+        }
+        // Too many in a row, so this is probably a real step. Start again from
+        // here.
+        f->mean.primed = false;
+        f->deviation.primed = false;
+        filter_ema_add(&f->mean, sample);
+        filter_ema_add(&f->deviation, 0);
+        f->rejects = 0;
+        return true;
+    }
+
+    f->rejects = 0;
+    filter_ema_add(&f->mean, sample);
+    filter_ema_add(&f->deviation, error);
+    return true;
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Integer filter stages, which can be chained (eg, median -> CIC -> EMA). Each
+// stage takes one sample at a time. The decimating stages return true when a
+// new output is ready.
+//
+// All arithmetic is fixed point, so input ranges are limited as noted on each
+// stage (raw ADC readings are always fine).
+
+// CIC decimator (order 1 is a plain boxcar average). The integrators wrap
+// around harmlessly, but the output must fit, so input_bits + order *
+// log2(decimation) must not exceed 32.
+#define FILTER_CIC_MAX_ORDER 3
+
+typedef struct {
+    uint32_t integrators[FILTER_CIC_MAX_ORDER];
+    uint32_t combs[FILTER_CIC_MAX_ORDER];
+    uint32_t gain; // decimation^order
+    uint16_t decimation;
+    uint16_t phase;
+    uint8_t order;
+    int32_t value;
+} filter_cic_t;
+
+void filter_cic_init(filter_cic_t *f, uint8_t order, uint16_t decimation);
+bool filter_cic_add(filter_cic_t *f, int32_t sample);
+
+// Exponential moving average with a time constant of 2^shift samples. The
+// state keeps shift extra bits of precision, so inputs must fit in
+// (31 - shift) bits. The first sample initialises the output directly.
+typedef struct {
+    int32_t accumulator;
+    uint8_t shift;
+    bool primed;
+    int32_t value;
+} filter_ema_t;
+
+void filter_ema_init(filter_ema_t *f, uint8_t shift);
+int32_t filter_ema_add(filter_ema_t *f, int32_t sample);
+
+// Sliding median over the last N samples (N odd, up to FILTER_MEDIAN_MAX),
+// for removing single-sample spikes without smearing steps. Until N samples
+// have been seen, the median of those so far is returned.
+#define FILTER_MEDIAN_MAX 9
+
+typedef struct {
+    int32_t window[FILTER_MEDIAN_MAX];
+    uint8_t size;
+    uint8_t count;
+    uint8_t next;
+    int32_t value;
+} filter_median_t;
+
+void filter_median_init(filter_median_t *f, uint8_t size);
+int32_t filter_median_add(filter_median_t *f, int32_t sample);
+
+// Block statistics: mean, min, max and variance over each block of
+// block_size samples (like sampler_t, but with the variance). The sums are
+// taken relative to the first sample of the block, and are exact as long as
+// every sample is within 32767 of it.
+typedef struct {
+    int32_t offset;
+    int64_t sum;
+    int64_t sum_sq;
+    int32_t cur_min;
+    int32_t cur_max;
+    uint16_t count;
+    uint16_t block_size;
+
+    int32_t mean;
+    int32_t min;
+    int32_t max;
+    uint32_t variance;
+} filter_stats_t;
+
+void filter_stats_init(filter_stats_t *f, uint16_t block_size);
+bool filter_stats_add(filter_stats_t *f, int32_t sample);
+
+// Outlier rejection: tracks a running mean and mean absolute deviation (as
+// EMAs with a time constant of 2^shift samples), and rejects samples further
+// from the mean than threshold_mul times the deviation plus threshold_min. If
+// max_rejects samples in a row are rejected, the signal is assumed to have
+// really stepped, and the filter restarts from the latest sample.
+typedef struct {
+    filter_ema_t mean;
+    filter_ema_t deviation;
+    int32_t threshold_min;
+    uint8_t threshold_mul;
+    uint8_t max_rejects;
+    uint8_t rejects;
+    uint32_t rejected_total;
+} filter_outlier_t;
+
+void filter_outlier_init(filter_outlier_t *f, uint8_t shift, uint8_t threshold_mul, int32_t threshold_min, uint8_t max_rejects);
+// Returns true if the sample should be kept.
+bool filter_outlier_check(filter_outlier_t *f, int32_t sample);
@@ -0,0 +1,127 @@
+#include "rainflow.h"
+
+#include <string.h>
+
+void rainflow_init(rainflow_t *rf, int32_t hysteresis, int32_t full_scale) {
+    memset(rf, 0, sizeof(*rf));
+    rf->hysteresis = hysteresis < 1 ? 1 : hysteresis;
+    rf->full_scale = full_scale < 1 ? 1 : full_scale;
+}
+
+static uint8_t bin_of(int32_t value, int32_t full_scale, uint8_t bins) {
+    if(value <= 0) return 0;
+    int32_t bin = (int64_t)value * bins / full_scale;
+    return bin >= bins ? bins - 1 : (uint8_t)bin;
+}
+
+static void count_cycle(const rainflow_t *rf, rainflow_histogram_t *hist, const rainflow_point_t *a, const rainflow_point_t *b, uint8_t halves) {
+    static const int16_t edges[] = RAINFLOW_TEMPERATURE_EDGES_dC;
+
+    int32_t depth = a->value > b->value ? a->value - b->value : b->value - a->value;
+    int32_t mean = (a->value + b->value) / 2;
+    int16_t temperature_dC = (a->temperature_dC + b->temperature_dC) / 2;
+
+    uint8_t t = 0;
+    while(t < RAINFLOW_TEMPERATURE_BINS - 1 && temperature_dC >= edges[t]) {
+        t++;
+    }
+
+    uint16_t *bin = &hist->bins[bin_of(depth, rf->full_scale, RAINFLOW_DEPTH_BINS)]
+                               [bin_of(mean, rf->full_scale, RAINFLOW_MEAN_BINS)][t];
+    *bin = *bin > 0xFFFF - halves ? 0xFFFF : *bin + halves;
+}
+
+static int32_t range_of(const rainflow_point_t *a, const rainflow_point_t *b) {
+    return a->value > b->value ? a->value - b->value : b->value - a->value;
+}
+
+static bool push_turning_point(rainflow_t *rf, rainflow_histogram_t *hist, const rainflow_point_t *p) {
+    bool counted = false;
+
+    if(rf->count == RAINFLOW_STACK_SIZE) {
+        count_cycle(rf, hist, &rf->stack[0], &rf->stack[1], 1);
+        memmove(&rf->stack[0], &rf->stack[1], (RAINFLOW_STACK_SIZE - 1) * sizeof(rainflow_point_t));
+        rf->count--;
+        counted = true;
+    }
+    rf->stack[rf->count++] = *p;
+
+    while(rf->count >= 3) {
+        rainflow_point_t *s = &rf->stack[rf->count - 3];
+        int32_t x = range_of(&s[1], &s[2]);
+        int32_t y = range_of(&s[0], &s[1]);
+        if(x < y) {
+            break;
+        }
+        if(rf->count == 3) {
+            // Y includes the starting point, so is only a half cycle
+            count_cycle(rf, hist, &s[0], &s[1], 1);
+            s[0] = s[1];
+            s[1] = s[2];
+            rf->count = 2;
+        } else {
+            count_cycle(rf, hist, &s[0], &s[1], 2);
+            s[0] = s[2];
+            rf->count -= 2;
+        }
+        counted = true;
+    }
+
+    return counted;
+}
+
+bool rainflow_add(rainflow_t *rf, rainflow_histogram_t *hist, int32_t value, int16_t temperature_dC) {
+    rainflow_point_t p = {value, temperature_dC};
+
+    if(rf->count == 0) {
+        // The first sample starts the history
+        rf->stack[rf->count++] = p;
+        rf->extreme = p;
+        rf->direction = 0;
+        return false;
+    }
+
+    if(rf->direction == 0) {
+        int32_t moved = value - rf->stack[rf->count - 1].value;
+        if(moved >= rf->hysteresis || -moved >= rf->hysteresis) {
+            rf->direction = moved > 0 ? 1 : -1;
+            rf->extreme = p;
+        }
+        return false;
+    }
+
+    if((rf->direction > 0 && value >= rf->extreme.value)
+        || (rf->direction < 0 && value <= rf->extreme.value)) {
+        rf->extreme = p;
+        return false;
+    }
+
+    int32_t back = rf->extreme.value - value;
+    if(back < 0) back = -back;
+    if(back < rf->hysteresis) {
+        return false;
+    }
+
+    // The extreme was a turning point
+    bool counted = push_turning_point(rf, hist, &rf->extreme);
+    rf->direction = -rf->direction;
+    rf->extreme = p;
+    return counted;
+}
+
+void rainflow_flush(rainflow_t *rf, rainflow_histogram_t *hist) {
+    if(rf->direction != 0) {
+        push_turning_point(rf, hist, &rf->extreme);
+    }
+    for(uint8_t i = 1; i < rf->count; i++) {
+        count_cycle(rf, hist, &rf->stack[i - 1], &rf->stack[i], 1);
+    }
+
+    // Carry on from the latest point
+    if(rf->count > 0) {
+        rf->stack[0] = rf->stack[rf->count - 1];
+        rf->count = 1;
+    }
+    rf->extreme = rf->stack[0];
+    rf->direction = 0;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Streaming rainflow cycle counter (the three-point method of ASTM E1049),
+// which bins the cycles found in a signal by depth, mean and temperature.
+//
+// Samples are reduced to turning points first, ignoring reversals smaller
+// than the hysteresis. The turning points go onto a residue stack, and each
+// one closes at most a few cycles, so the work is O(1) per sample amortised.
+//
+// The residue is normally short (it only grows while the swings keep getting
+// bigger, then smaller), but if it ever fills, the oldest point is counted as
+// a half cycle and dropped, so that nothing needs allocating.
+#define RAINFLOW_STACK_SIZE 32
+
+#define RAINFLOW_DEPTH_BINS 10
+#define RAINFLOW_MEAN_BINS 5
+#define RAINFLOW_TEMPERATURE_BINS 4
+// Upper edges of the temperature bins (0.1C), the last being open-ended
+#define RAINFLOW_TEMPERATURE_EDGES_dC {100, 250, 400}
+
+// Counts of half cycles (a full cycle counts twice), saturating
+typedef struct {
+    uint16_t bins[RAINFLOW_DEPTH_BINS][RAINFLOW_MEAN_BINS][RAINFLOW_TEMPERATURE_BINS];
+} rainflow_histogram_t;
+
+typedef struct {
+    int32_t value;
+    int16_t temperature_dC;
+} rainflow_point_t;
+
+typedef struct {
+    rainflow_point_t stack[RAINFLOW_STACK_SIZE];
+    uint8_t count;
+
+    // The extreme since the last turning point, which becomes the next
+    // turning point once the signal has moved back by the hysteresis
+    rainflow_point_t extreme;
+    int8_t direction; // +1 rising, -1 falling, 0 not yet moved
+
+    int32_t hysteresis;
+    int32_t full_scale; // the signal runs from 0 to this
+} rainflow_t;
+
+void rainflow_init(rainflow_t *rf, int32_t hysteresis, int32_t full_scale);
+
+// Adds a sample. Returns true if it closed any cycles.
+bool rainflow_add(rainflow_t *rf, rainflow_histogram_t *hist, int32_t value, int16_t temperature_dC);
+
+// Counts what's left (the residue, and the latest extreme) as half cycles,
+// as at the end of a recording. Leaves the counter ready to carry on.
+void rainflow_flush(rainflow_t *rf, rainflow_histogram_t *hist);
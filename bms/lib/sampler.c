@@ -2,9 +2,12 @@
 
 #include "../lib/math.h"
 
-void sampler_add(sampler_t* sampler, int32_t sample, uint16_t max_samples, uint16_t divide_shift) {
+void sampler_add_timed(sampler_t* sampler, int32_t sample, uint16_t max_samples, uint16_t divide_shift, micros_t sample_us) {
     sampler->accumulator = sadd_i32(sampler->accumulator, sample >> divide_shift);
     sampler->sample_count += 1;
+    if (sampler->sample_count == 1) {
+        sampler->cur_first_us = sample_us;
+    }
     if (sample < sampler->cur_min_value || sampler->sample_count == 1) {
         sampler->cur_min_value = sample;
     }
@@ -19,6 +22,7 @@ void sampler_add(sampler_t* sampler, int32_t sample, uint16_t max_samples, uint1
         sampler->max_value = sampler->cur_max_value;
         
         sampler->timestamp = millis();
+        sampler->timestamp_us = sampler->cur_first_us + (sample_us - sampler->cur_first_us) / 2;
         
         // reset for next
         sampler->cur_min_value = 0;
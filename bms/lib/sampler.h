@@ -12,13 +12,23 @@ typedef struct {
     int32_t cur_min_value;
     int32_t cur_max_value;
 
+    // When the first sample of the current batch was taken
+    micros_t cur_first_us;
+
     int32_t value;
     int32_t min_value;
     int32_t max_value;
     millis_t timestamp;
+    // The middle of the batch that value was averaged over (only if the
+    // samples were timed)
+    micros_t timestamp_us;
 } sampler_t;
 
-void sampler_add(sampler_t* sampler, int32_t sample, uint16_t max_samples, uint16_t divide_shift);
+// sample_us is the instant the sample was measured
+void sampler_add_timed(sampler_t* sampler, int32_t sample, uint16_t max_samples, uint16_t divide_shift, micros_t sample_us);
+static inline void sampler_add(sampler_t* sampler, int32_t sample, uint16_t max_samples, uint16_t divide_shift) {
+    sampler_add_timed(sampler, sample, max_samples, divide_shift, 0);
+}
 static inline int32_t sampler_get_value(sampler_t* sampler, int32_t divide) {
     return sampler->value / divide;
 }
@@ -1,23 +1,67 @@
 #include "hmi_serial.h"
+#include "hmi_slots.h"
 #include "../../drivers/comms/duart.h"
 #include "../../config/allocations.h"
 #include "../../config/pins.h"
+#include "../../config/settings.h"
+#include "../../app/monitoring/counters.h"
 #include "../../sys/time/time.h"
 #include "../../drivers/sensors/ina228.h"
 #include "../../app/model.h"
+#include "../../app/estimators/ekf.h"
+#include "../../app/estimators/soh.h"
+#include "../../app/monitoring/cycles.h"
 #include "../../sys/events/events.h"
+#include "../../lib/delta_coding.h"
+#include "../inverter/inverter.h"
 
+#include "hardware/irq.h"
 #include "pico/stdlib.h"
 #include "pico/unique_id.h"
 
+#include <string.h>
+
 // BMS defaults to address 1
 uint8_t device_address = 1;
 uint32_t next_announce_timestep = 0;
 uint32_t announce_period = 64;
 
+// Our transmit slot on the bus, if the HMI has assigned one
+static hmi_slots_t slots = {0};
+
+// A response waiting for our slot to come round
+static uint8_t pending_tx_buf[256+8];
+static size_t pending_tx_len = 0;
+
+// Received packet, shared by the tick and the RX IRQ (which never run at the
+// same time) to keep it off the IRQ stack
+static uint8_t rx_buf[256];
+
+#if HMI_SERIAL_RX_IRQ
+// Software IRQ which handles received packets, only enabled while the main
+// loop is idle
+static uint hmi_rx_irq;
+
+static void hmi_serial_rx_irq();
+static void hmi_serial_rx_idle();
+#endif
+
 void init_hmi_serial() {
     // 937500 baud (close to 1Mbit)
     init_duart(&HMI_SERIAL_DUART, 460800, PIN_HMI_SERIAL_TX, PIN_HMI_SERIAL_RX, true); //9375000 works!
+#if HMI_SERIAL_LOOPBACK_CHECK
+    duart_enable_loopback_check(&HMI_SERIAL_DUART);
+#endif
+
+#if HMI_SERIAL_RX_IRQ
+    hmi_rx_irq = user_irq_claim_unused(true);
+    irq_set_exclusive_handler(hmi_rx_irq, hmi_serial_rx_irq);
+    irq_set_priority(hmi_rx_irq, PICO_LOWEST_IRQ_PRIORITY);
+    // Enabled by hmi_serial_set_idle()
+    irq_set_enabled(hmi_rx_irq, false);
+
+    duart_set_rx_idle_callback(&HMI_SERIAL_DUART, hmi_serial_rx_idle);
+#endif
 
     // Stagger announcements to reduce collisions
     pico_unique_board_id_t id;
@@ -25,6 +69,21 @@ void init_hmi_serial() {
     announce_period = 56 + (id.id[7] % 16);
 }
 
+static void hmi_send_packet(const uint8_t *payload, size_t len) {
+    if(hmi_slots_can_transmit(&slots, timestep())) {
+        duart_send_packet(&HMI_SERIAL_DUART, payload, len);
+        return;
+    }
+
+    // Hold on to it until our slot. The HMI only has one request outstanding
+    // per device, so a newer response simply replaces an unsent older one.
+    if(len > sizeof(pending_tx_buf)) {
+        return;
+    }
+    memcpy(pending_tx_buf, payload, len);
+    pending_tx_len = len;
+}
+
 static inline uint8_t hmi_buf_append_uint64(uint8_t *buf, uint64_t value) {
     uint8_t idx = 0;
     buf[idx++] = (value >> 0) & 0xFF;
@@ -109,7 +168,7 @@ static bool hmi_register_is_available(uint16_t reg_id, bms_model_t *model) {
     return true;
 }
 
-static uint8_t hmi_append_register_value(uint8_t *buf, uint16_t reg_id, bms_model_t *model) {
+uint8_t hmi_append_register_value(uint8_t *buf, uint16_t reg_id, bms_model_t *model) {
     uint8_t idx = 0;
     idx += hmi_buf_append_uint16(&buf[idx], reg_id);
 
@@ -231,6 +290,147 @@ static uint8_t hmi_append_register_value(uint8_t *buf, uint16_t reg_id, bms_mode
             buf[idx++] = HMI_TYPE_INT16;
             idx += hmi_buf_append_uint16(&buf[idx], (uint16_t)model->pack_voltage_limit_upper_offset_dV);
             break;
+        case HMI_REG_BUS_COLLISIONS:
+            buf[idx++] = HMI_TYPE_UINT32;
+            idx += hmi_buf_append_uint32(&buf[idx], debug_counters.uart1_collisions);
+            break;
+        case HMI_REG_BUS_TURNAROUND:
+            buf[idx++] = HMI_TYPE_UINT32;
+            idx += hmi_buf_append_uint32(&buf[idx], debug_counters.uart1_turnaround_us);
+            break;
+        case HMI_REG_BUS_TURNAROUND_MAX:
+            buf[idx++] = HMI_TYPE_UINT32;
+            idx += hmi_buf_append_uint32(&buf[idx], debug_counters.uart1_turnaround_max_us);
+            break;
+        case HMI_REG_INVERTER_VOLTAGE:
+            buf[idx++] = HMI_TYPE_INT32;
+            idx += hmi_buf_append_uint32(&buf[idx], (uint32_t)model->inverter_voltage_mV);
+            break;
+        case HMI_REG_INVERTER_CURRENT:
+            buf[idx++] = HMI_TYPE_INT32;
+            idx += hmi_buf_append_uint32(&buf[idx], (uint32_t)model->inverter_current_mA);
+            break;
+        case HMI_REG_CAN_FRAMES_SENT:
+            buf[idx++] = HMI_TYPE_UINT32;
+            idx += hmi_buf_append_uint32(&buf[idx], debug_counters.can_frames_sent);
+            break;
+        case HMI_REG_CAN_FRAMES_RECEIVED:
+            buf[idx++] = HMI_TYPE_UINT32;
+            idx += hmi_buf_append_uint32(&buf[idx], debug_counters.can_frames_received);
+            break;
+        case HMI_REG_CAN_FRAMES_DROPPED:
+            buf[idx++] = HMI_TYPE_UINT32;
+            idx += hmi_buf_append_uint32(&buf[idx], debug_counters.can_frames_dropped);
+            break;
+        case HMI_REG_CAN_TX_QUEUE_FULL:
+            buf[idx++] = HMI_TYPE_UINT32;
+            idx += hmi_buf_append_uint32(&buf[idx], debug_counters.can_tx_queue_full);
+            break;
+        case HMI_REG_CAN_TX_RETRIES:
+            buf[idx++] = HMI_TYPE_UINT32;
+            idx += hmi_buf_append_uint32(&buf[idx], debug_counters.can_tx_retries);
+            break;
+        case HMI_REG_CAN_PARSE_ERRORS:
+            buf[idx++] = HMI_TYPE_UINT32;
+            idx += hmi_buf_append_uint32(&buf[idx], debug_counters.can_parse_errors);
+            break;
+        case HMI_REG_CAN_RX_STALLS:
+            buf[idx++] = HMI_TYPE_UINT32;
+            idx += hmi_buf_append_uint32(&buf[idx], debug_counters.can_rx_stalls);
+            break;
+        case HMI_REG_CAN_RX_OVERFLOWS:
+            buf[idx++] = HMI_TYPE_UINT32;
+            idx += hmi_buf_append_uint32(&buf[idx], debug_counters.can_rx_overflows);
+            break;
+        case HMI_REG_CAN_RX_FILTERED:
+            buf[idx++] = HMI_TYPE_UINT32;
+            idx += hmi_buf_append_uint32(&buf[idx], debug_counters.can_rx_filtered);
+            break;
+        case HMI_REG_CAN_BUS_LOAD:
+            buf[idx++] = HMI_TYPE_UINT16;
+            idx += hmi_buf_append_uint16(&buf[idx], debug_counters.can_bus_load);
+            break;
+        case HMI_REG_CAN_ISR_LOAD:
+            buf[idx++] = HMI_TYPE_UINT16;
+            idx += hmi_buf_append_uint16(&buf[idx], debug_counters.can_isr_load);
+            break;
+        case HMI_REG_CAN_ISR_MAX:
+            buf[idx++] = HMI_TYPE_UINT32;
+            idx += hmi_buf_append_uint32(&buf[idx], debug_counters.can_isr_max_us);
+            break;
+        case HMI_REG_SOH:
+            buf[idx++] = HMI_TYPE_UINT16;
+            idx += hmi_buf_append_uint16(&buf[idx], model->soh);
+            break;
+        case HMI_REG_CAPACITY_MEASURED:
+            buf[idx++] = HMI_TYPE_UINT32;
+            idx += hmi_buf_append_uint32(&buf[idx], model->capacity_mC);
+            break;
+        case HMI_REG_CAPACITY_WORKING:
+            buf[idx++] = HMI_TYPE_UINT32;
+            idx += hmi_buf_append_uint32(&buf[idx], model->working_capacity_mC);
+            break;
+        case HMI_REG_RESISTANCE:
+            buf[idx++] = HMI_TYPE_UINT32;
+            idx += hmi_buf_append_uint32(&buf[idx], soh_state.resistance_uOhm);
+            break;
+        case HMI_REG_RESISTANCE_GROWTH:
+            buf[idx++] = HMI_TYPE_UINT16;
+            idx += hmi_buf_append_uint16(&buf[idx], soh_resistance_growth());
+            break;
+        case HMI_REG_SOP_CHARGE_2S:
+        case HMI_REG_SOP_CHARGE_10S:
+        case HMI_REG_SOP_CHARGE_30S:
+            buf[idx++] = HMI_TYPE_UINT16;
+            idx += hmi_buf_append_uint16(&buf[idx], model->sop_charge_current_limit_dA[reg_id - HMI_REG_SOP_CHARGE_2S]);
+            break;
+        case HMI_REG_SOP_DISCHARGE_2S:
+        case HMI_REG_SOP_DISCHARGE_10S:
+        case HMI_REG_SOP_DISCHARGE_30S:
+            buf[idx++] = HMI_TYPE_UINT16;
+            idx += hmi_buf_append_uint16(&buf[idx], model->sop_discharge_current_limit_dA[reg_id - HMI_REG_SOP_DISCHARGE_2S]);
+            break;
+        case HMI_REG_EKF_NIS: {
+            const EKF *ekf = ekf_instance_get();
+            float nis = ekf ? ekf->nis * 100.0f : 0.0f;
+            buf[idx++] = HMI_TYPE_UINT16;
+            idx += hmi_buf_append_uint16(&buf[idx], nis > 65535.0f ? 65535 : (uint16_t)nis);
+            break;
+        }
+        case HMI_REG_EKF_VOLTAGE_NOISE: {
+            const EKF *ekf = ekf_instance_get();
+            buf[idx++] = HMI_TYPE_UINT16;
+            idx += hmi_buf_append_uint16(&buf[idx], ekf ? (uint16_t)(sqrtf(ekf->R) * 10000.0f) : 0);
+            break;
+        }
+        case HMI_REG_TIME_TO_EMPTY:
+            buf[idx++] = HMI_TYPE_UINT32;
+            idx += hmi_buf_append_uint32(&buf[idx], model->time_to_empty_s);
+            break;
+        case HMI_REG_TIME_TO_FULL:
+            buf[idx++] = HMI_TYPE_UINT32;
+            idx += hmi_buf_append_uint32(&buf[idx], model->time_to_full_s);
+            break;
+        case HMI_REG_POWER_TREND:
+            buf[idx++] = HMI_TYPE_INT32;
+            idx += hmi_buf_append_uint32(&buf[idx], (uint32_t)model->power_trend_mW);
+            break;
+        case HMI_REG_ENERGY_IN:
+            buf[idx++] = HMI_TYPE_UINT32;
+            idx += hmi_buf_append_uint32(&buf[idx], model->energy_in_Wh);
+            break;
+        case HMI_REG_ENERGY_OUT:
+            buf[idx++] = HMI_TYPE_UINT32;
+            idx += hmi_buf_append_uint32(&buf[idx], model->energy_out_Wh);
+            break;
+        case HMI_REG_BUS_VOLTAGE:
+            buf[idx++] = HMI_TYPE_INT32;
+            idx += hmi_buf_append_uint32(&buf[idx], (uint32_t)model->bus_voltage_mV);
+            break;
+        case HMI_REG_ENERGY_STATUS:
+            buf[idx++] = HMI_TYPE_UINT16;
+            idx += hmi_buf_append_uint16(&buf[idx], model->energy_status);
+            break;
         default:
             if (reg_id >= HMI_REG_CELL_VOLTAGES_START && reg_id <= HMI_REG_CELL_VOLTAGES_END) {
                 uint16_t cell_idx = reg_id - HMI_REG_CELL_VOLTAGES_START;
@@ -259,6 +459,32 @@ static uint8_t hmi_append_register_value(uint8_t *buf, uint16_t reg_id, bms_mode
                     // Unknown temp
                     idx -= 2; // rollback reg_id
                 }
+            } else if (reg_id >= HMI_REG_CAN_RX_IDS_START && reg_id <= HMI_REG_CAN_RX_IDS_END) {
+                uint32_t can_id = 0, count = 0;
+                inverter_get_rx_frame_stats(reg_id - HMI_REG_CAN_RX_IDS_START, &can_id, &count);
+                buf[idx++] = HMI_TYPE_UINT64;
+                idx += hmi_buf_append_uint64(&buf[idx], ((uint64_t)can_id << 48) | count);
+            } else if (reg_id >= HMI_REG_CAN_TX_IDS_START && reg_id <= HMI_REG_CAN_TX_IDS_END) {
+                uint32_t can_id = 0, sent = 0, dropped = 0, jitter = 0, jitter_max = 0;
+                inverter_get_tx_frame_stats(reg_id - HMI_REG_CAN_TX_IDS_START, &can_id, &sent, &dropped, &jitter, &jitter_max);
+                if(dropped > 0xFFFF) dropped = 0xFFFF;
+                buf[idx++] = HMI_TYPE_UINT64;
+                idx += hmi_buf_append_uint64(&buf[idx], ((uint64_t)can_id << 48) | ((uint64_t)dropped << 32) | sent);
+            } else if (reg_id >= HMI_REG_CAN_TX_JITTER_START && reg_id <= HMI_REG_CAN_TX_JITTER_END) {
+                uint32_t can_id = 0, sent = 0, dropped = 0, jitter = 0, jitter_max = 0;
+                inverter_get_tx_frame_stats(reg_id - HMI_REG_CAN_TX_JITTER_START, &can_id, &sent, &dropped, &jitter, &jitter_max);
+                if(jitter_max > 0xFFFF) jitter_max = 0xFFFF;
+                buf[idx++] = HMI_TYPE_UINT64;
+                idx += hmi_buf_append_uint64(&buf[idx], ((uint64_t)can_id << 48) | ((uint64_t)jitter_max << 32) | jitter);
+            } else if (reg_id >= HMI_REG_CYCLES_START && reg_id <= HMI_REG_CYCLES_END) {
+                uint16_t bin_idx = reg_id - HMI_REG_CYCLES_START;
+                if (bin_idx < sizeof(cycle_histogram.bins) / sizeof(uint16_t)) {
+                    buf[idx++] = HMI_TYPE_UINT16;
+                    idx += hmi_buf_append_uint16(&buf[idx], (&cycle_histogram.bins[0][0][0])[bin_idx]);
+                } else {
+                    // Unknown bin
+                    idx -= 2; // rollback reg_id
+                }
             } else {
                 // Unknown register
                 idx -= 2; // rollback reg_id
@@ -284,7 +510,7 @@ void hmi_send_announce_device() {
 
     // Should we include more info here (eg, uptime?, version?)
 
-    duart_send_packet(&HMI_SERIAL_DUART, tx_buf, idx);
+    hmi_send_packet(tx_buf, idx);
 }
 
 static void hmi_handle_set_device_address(const uint8_t *rx_buf, size_t len) {
@@ -301,6 +527,11 @@ static void hmi_handle_set_device_address(const uint8_t *rx_buf, size_t len) {
 
     if (serial == u.serial && (current_addr == device_address)) {
         device_address = new_addr;
+        if (len >= 13) {
+            // Optional transmit slot assignment
+            uint8_t slot_ticks = len >= 14 ? rx_buf[13] : HMI_SLOT_DEFAULT_TICKS;
+            hmi_slots_assign(&slots, rx_buf[11], rx_buf[12], slot_ticks);
+        }
         // Respond with announce to confirm
         hmi_send_announce_device();
     }
@@ -330,7 +561,7 @@ static void hmi_handle_read_registers(const uint8_t *rx_buf, size_t len, bms_mod
         tx_idx += len;
     }
 
-    duart_send_packet(&HMI_SERIAL_DUART, tx_buf, tx_idx);
+    hmi_send_packet(tx_buf, tx_idx);
 }
 
 static void hmi_handle_write_registers(const uint8_t *rx_buf, size_t len, bms_model_t *model) {
@@ -396,7 +627,19 @@ static void hmi_handle_write_registers(const uint8_t *rx_buf, size_t len, bms_mo
         tx_idx += hmi_append_register_value(&tx_buf[tx_idx], reg_id, model);
     }
 
-    duart_send_packet(&HMI_SERIAL_DUART, tx_buf, tx_idx);
+    hmi_send_packet(tx_buf, tx_idx);
+}
+
+size_t hmi_build_cell_voltages_response(uint8_t *tx_buf, const int16_t *cell_voltages_mV, uint8_t count) {
+    // tx_buf needs room for 3 + 2*count bytes
+    size_t tx_idx = 0;
+
+    tx_buf[tx_idx++] = HMI_MSG_READ_CELL_VOLTAGES_RESPONSE;
+    tx_buf[tx_idx++] = device_address;
+    tx_buf[tx_idx++] = count; // number of cell voltages
+
+    tx_idx += delta_encode_i16(&tx_buf[tx_idx], cell_voltages_mV, count);
+    return tx_idx;
 }
 
 static void hmi_handle_read_cell_voltages(const uint8_t *rx_buf, size_t len, bms_model_t *model) {
@@ -410,45 +653,16 @@ static void hmi_handle_read_cell_voltages(const uint8_t *rx_buf, size_t len, bms
     }
 
     uint8_t tx_buf[243];
-    uint16_t tx_idx = 0;
+    size_t tx_idx = hmi_build_cell_voltages_response(tx_buf, model->cell_voltages_mV, 120);
 
-    tx_buf[tx_idx++] = HMI_MSG_READ_CELL_VOLTAGES_RESPONSE;
-    tx_buf[tx_idx++] = device_address;
-    tx_buf[tx_idx++] = 120; // number of cell voltages
-
-    // Note: Delta coding for cell voltages
-    //   Absolute voltages sent as two-byte big-endian signed integers, with the MSB set
-    //   Delta voltages sent as single-byte signed integers in the range -64 to +63, with MSB clear
-    //   Initial voltage is zero (if first byte is a delta).
-
-    int16_t last_cell_voltage = 0;
-    for(int cell_idx = 0; cell_idx < 120; cell_idx++) {
-        const int16_t cell_voltage = model->cell_voltages_mV[cell_idx];
-        const int16_t delta = cell_voltage - last_cell_voltage;
-        if(delta >= -64 && delta <= 63) {
-            // can encode as delta
-            tx_buf[tx_idx++] = (delta & 0x7F);
-        } else {
-            // encode as absolute
-            tx_buf[tx_idx++] = ((cell_voltage >> 8) & 0xFF) | 0x80; // set high bit for absolute values
-            tx_buf[tx_idx++] = (cell_voltage >> 0) & 0xFF;
-        }
-        last_cell_voltage = cell_voltage;
-    }
-
-    duart_send_packet(&HMI_SERIAL_DUART, tx_buf, tx_idx);
+    hmi_send_packet(tx_buf, tx_idx);
 }
 
-static void hmi_handle_read_events(const uint8_t *rx_buf, size_t len, bms_model_t *model) {
-    if (len < 4) return;
-    uint8_t addr = rx_buf[1];
-    if (addr != device_address) return;
-
-    uint16_t start_index = hmi_buf_get_uint16(&rx_buf[2]);
+size_t hmi_build_events_response(uint8_t *tx_buf, uint16_t start_index) {
+    // tx_buf needs room for 256 bytes
     if (start_index > ERR_HIGHEST) start_index = ERR_HIGHEST;
 
-    uint8_t tx_buf[256];
-    uint16_t tx_idx = 0;
+    size_t tx_idx = 0;
 
     tx_buf[tx_idx++] = HMI_MSG_READ_EVENTS_RESPONSE;
     tx_buf[tx_idx++] = device_address;
@@ -481,46 +695,119 @@ static void hmi_handle_read_events(const uint8_t *rx_buf, size_t len, bms_model_
     hmi_buf_append_uint16(&tx_buf[next_index_ptr], i);
     hmi_buf_append_uint16(&tx_buf[count_ptr], count);
 
-    duart_send_packet(&HMI_SERIAL_DUART, tx_buf, tx_idx);
+    return tx_idx;
 }
 
-void hmi_serial_tick(bms_model_t *model) {
-    uint8_t rx_buf[256];
+static void hmi_handle_read_events(const uint8_t *rx_buf, size_t len, bms_model_t *model) {
+    if (len < 4) return;
+    uint8_t addr = rx_buf[1];
+    if (addr != device_address) return;
+
+    uint8_t tx_buf[256];
+    size_t tx_idx = hmi_build_events_response(tx_buf, hmi_buf_get_uint16(&rx_buf[2]));
+
+    hmi_send_packet(tx_buf, tx_idx);
+}
+
+static void hmi_handle_packet(const uint8_t *rx_buf, size_t len, bms_model_t *model) {
+    uint8_t msg_type = rx_buf[0];
+    switch (msg_type) {
+        case HMI_MSG_SET_DEVICE_ADDRESS:
+            hmi_handle_set_device_address(rx_buf, len);
+            break;
+        case HMI_MSG_READ_REGISTERS:
+            hmi_handle_read_registers(rx_buf, len, model);
+            // Postpone the next announce, so that if we are polled
+            // frequently enough we never risk causing a collision.
+            next_announce_timestep = timestep() + announce_period;
+            break;
+        case HMI_MSG_WRITE_REGISTERS:
+            hmi_handle_write_registers(rx_buf, len, model);
+            break;
+        case HMI_MSG_READ_CELL_VOLTAGES:
+            hmi_handle_read_cell_voltages(rx_buf, len, model);
+            break;
+        case HMI_MSG_READ_EVENTS:
+            hmi_handle_read_events(rx_buf, len, model);
+            break;
+        default:
+            // Ignore other messages (responses or unknown)
+            break;
+    }
+}
+
+static void hmi_received_packet(const uint8_t *rx_buf) {
+    if(rx_buf[0] < 0x80) {
+        // Anything sent by the HMI marks the start of a new slot frame,
+        // whoever it was addressed to.
+        hmi_slots_sync(&slots, timestep());
+    }
+}
+
+#if HMI_SERIAL_RX_IRQ
+static void __not_in_flash_func(hmi_serial_rx_irq)() {
+    // Runs at the lowest IRQ priority, shortly after the bus goes quiet, but
+    // only while the main loop is sleeping between ticks. Nothing else touches
+    // the model then, so requests can be handled here in full.
+    size_t len;
+
+    while((len = duart_read_packet(&HMI_SERIAL_DUART, rx_buf, sizeof(rx_buf))) > 0) {
+        hmi_received_packet(rx_buf);
+        hmi_handle_packet(rx_buf, len, &model);
+    }
+}
+
+static void hmi_serial_rx_idle() {
+    // Called from the alarm IRQ, so just kick the RX IRQ.
+    irq_set_pending(hmi_rx_irq);
+}
+#endif
+
+void hmi_serial_set_idle(bool idle) {
+    // Called by the main loop around its sleep between ticks. The model (and
+    // the event log, EKF etc.) is only ever part way through an update while
+    // the main loop is running, so the RX IRQ is held off until then.
+#if HMI_SERIAL_RX_IRQ
+    irq_set_enabled(hmi_rx_irq, idle);
+    if(idle) {
+        // Catch up with anything which arrived during the tick
+        irq_set_pending(hmi_rx_irq);
+    }
+#else
+    (void)idle;
+#endif
+}
 
-    // Periodically announce ourselves. 
-    if(timestep() >= next_announce_timestep) {
+void hmi_serial_tick(bms_model_t *model) {
+    bool can_transmit = hmi_slots_can_transmit(&slots, timestep());
+
+    if(can_transmit && pending_tx_len > 0) {
+        // Our slot has come round, send the deferred response
+        duart_send_packet(&HMI_SERIAL_DUART, pending_tx_buf, pending_tx_len);
+        pending_tx_len = 0;
+    } else if(can_transmit && timestep() >= next_announce_timestep) {
+        // Periodically announce ourselves (if slotted, this waits for our
+        // slot).
         next_announce_timestep = timestep() + announce_period;
         hmi_send_announce_device();
     }
 
+#if HMI_SERIAL_RX_IRQ
+    // Requests are normally handled by the RX IRQ while we are idle, this only
+    // picks up any left over if the loop overran and never went idle.
+    size_t len;
+    while((len = duart_read_packet(&HMI_SERIAL_DUART, rx_buf, sizeof(rx_buf))) > 0) {
+        hmi_received_packet(rx_buf);
+        hmi_handle_packet(rx_buf, len, model);
+    }
+#else
     // Handling a message seems to take 50-100us. We handle one message per tick
     // (giving a max effective throughput of ~100kbps with 256 byte messages).
 
     size_t len = duart_read_packet(&HMI_SERIAL_DUART, rx_buf, sizeof(rx_buf));
     if(len > 0) {
-        uint8_t msg_type = rx_buf[0];
-        switch (msg_type) {
-            case HMI_MSG_SET_DEVICE_ADDRESS:
-                hmi_handle_set_device_address(rx_buf, len);
-                break;
-            case HMI_MSG_READ_REGISTERS:
-                hmi_handle_read_registers(rx_buf, len, model);
-                // Postpone the next announce, so that if we are polled
-                // frequently enough we never risk causing a collision.
-                next_announce_timestep = timestep() + announce_period;
-                break;
-            case HMI_MSG_WRITE_REGISTERS:
-                hmi_handle_write_registers(rx_buf, len, model);
-                break;
-            case HMI_MSG_READ_CELL_VOLTAGES:
-                hmi_handle_read_cell_voltages(rx_buf, len, model);
-                break;
-            case HMI_MSG_READ_EVENTS:
-                hmi_handle_read_events(rx_buf, len, model);
-                break;
-            default:
-                // Ignore other messages (responses or unknown)
-                break;
-        }
+        hmi_received_packet(rx_buf);
+        hmi_handle_packet(rx_buf, len, model);
     }
+#endif
 }
@@ -56,6 +56,43 @@
 #define HMI_REG_SOC_SCALING_MAX        28 // int16 (0.01%)
 #define HMI_REG_VOLTAGE_LIMIT_OFFSET_LOWER 29 // int16 (0.1V)
 #define HMI_REG_VOLTAGE_LIMIT_OFFSET_UPPER 30 // int16 (0.1V)
+#define HMI_REG_BUS_COLLISIONS         31 // uint32
+#define HMI_REG_BUS_TURNAROUND         32 // uint32 (us)
+#define HMI_REG_BUS_TURNAROUND_MAX     33 // uint32 (us)
+#define HMI_REG_INVERTER_VOLTAGE       34 // int32 (mV), as measured by the inverter
+#define HMI_REG_INVERTER_CURRENT       35 // int32 (mA), as measured by the inverter
+#define HMI_REG_CAN_FRAMES_SENT        36 // uint32
+#define HMI_REG_CAN_FRAMES_RECEIVED    37 // uint32
+#define HMI_REG_CAN_FRAMES_DROPPED     38 // uint32 (scheduled frames that missed their slot)
+#define HMI_REG_CAN_TX_QUEUE_FULL      39 // uint32
+#define HMI_REG_CAN_TX_RETRIES         40 // uint32
+#define HMI_REG_CAN_PARSE_ERRORS       41 // uint32
+#define HMI_REG_CAN_RX_STALLS          42 // uint32
+#define HMI_REG_CAN_RX_OVERFLOWS       43 // uint32
+#define HMI_REG_CAN_BUS_LOAD           44 // uint16 (0.01%)
+#define HMI_REG_CAN_ISR_LOAD           45 // uint16 (0.01% of CPU time)
+#define HMI_REG_CAN_ISR_MAX            46 // uint32 (us)
+#define HMI_REG_CAN_RX_FILTERED        47 // uint32
+#define HMI_REG_SOH                    48 // uint16 (0.01%)
+#define HMI_REG_CAPACITY_MEASURED      49 // uint32 (mC)
+#define HMI_REG_CAPACITY_WORKING       50 // uint32 (mC)
+#define HMI_REG_RESISTANCE             51 // uint32 (uOhm, whole pack)
+#define HMI_REG_RESISTANCE_GROWTH      52 // uint16 (0.01% of as-new)
+#define HMI_REG_SOP_CHARGE_2S          53 // uint16 (0.1A)
+#define HMI_REG_SOP_CHARGE_10S         54 // uint16 (0.1A)
+#define HMI_REG_SOP_CHARGE_30S         55 // uint16 (0.1A)
+#define HMI_REG_SOP_DISCHARGE_2S       56 // uint16 (0.1A)
+#define HMI_REG_SOP_DISCHARGE_10S      57 // uint16 (0.1A)
+#define HMI_REG_SOP_DISCHARGE_30S      58 // uint16 (0.1A)
+#define HMI_REG_EKF_NIS                59 // uint16 (0.01), ~1 when consistent
+#define HMI_REG_EKF_VOLTAGE_NOISE      60 // uint16 (0.1mV), sd of the adapted R
+#define HMI_REG_TIME_TO_EMPTY          61 // uint32 (s), 0xFFFFFFFF if not discharging
+#define HMI_REG_TIME_TO_FULL           62 // uint32 (s), 0xFFFFFFFF if not charging
+#define HMI_REG_POWER_TREND            63 // int32 (mW)
+#define HMI_REG_ENERGY_IN              64 // uint32 (Wh), lifetime
+#define HMI_REG_ENERGY_OUT             65 // uint32 (Wh), lifetime
+#define HMI_REG_BUS_VOLTAGE            66 // int32 (mV), as measured by the INA228
+#define HMI_REG_ENERGY_STATUS          67 // uint16 (energy_status_t), whether 64-65 are counting
 
 #define HMI_REG_CELL_VOLTAGES_START 0x100
 #define HMI_REG_CELL_VOLTAGES_END   0x1FF
@@ -64,6 +101,23 @@
 #define HMI_REG_MODULE_TEMPS_END      0x207
 #define HMI_REG_RAW_TEMPS_START       0x208
 #define HMI_REG_RAW_TEMPS_END         0x238
+// Per-ID CAN frame counts, as uint64: bits 48-63 are the CAN ID, bits 32-47
+// the number of dropped frames (TX only) and bits 0-31 the frame count. IDs
+// past the end read as zero.
+#define HMI_REG_CAN_RX_IDS_START      0x240
+#define HMI_REG_CAN_RX_IDS_END        0x24F
+#define HMI_REG_CAN_TX_IDS_START      0x250
+#define HMI_REG_CAN_TX_IDS_END        0x25F
+// Per-ID CAN TX jitter, as uint64: bits 48-63 are the CAN ID, bits 32-47 how
+// late the worst frame went out and bits 0-31 how late the last frame went
+// out, both in ms relative to its slot. Indexed as HMI_REG_CAN_TX_IDS_START.
+#define HMI_REG_CAN_TX_JITTER_START   0x260
+#define HMI_REG_CAN_TX_JITTER_END     0x26F
+
+// Rainflow cycle histogram (uint16 half cycles per bin), indexed by
+// (depth_bin * RAINFLOW_MEAN_BINS + mean_bin) * RAINFLOW_TEMPERATURE_BINS + temperature_bin
+#define HMI_REG_CYCLES_START          0x300
+#define HMI_REG_CYCLES_END            0x3FF
 
 /* 
 
@@ -103,10 +157,25 @@ to each BMS on the network. The format is:
 <current device address (1 byte)>
 <new device address (1 byte)>
 <unique serial number (8 bytes)>
+<slot index (1 byte)> (optional)
+<slot count (1 byte)> (optional)
+<slot length in ticks (1 byte)> (optional, default 2)
 
 Following a successful address assignment, the device will respond with an
 ANNOUNCE_DEVICE.
 
+If a slot is given, the device will from then on only transmit (both responses
+and announces) in its own slot of a repeating frame of <slot count> slots, each
+<slot length> 20ms ticks long. The frame restarts whenever any message from the
+HMI is received, so the HMI should send its requests at the start of a frame
+and then wait for the frame to complete. The device transmits only in the first
+tick of its slot, the remainder being guard time to allow for the devices
+seeing the HMI message up to one tick apart. A slot count of 0 clears the
+assignment, and the device goes back to transmitting immediately.
+
+Devices also read back their own transmissions, and count any that come back
+corrupted or not at all as collisions (see HMI_REG_BUS_COLLISIONS).
+
 2.3. Write registers (from HMI to BMS)
 
 The write registers message is used by the HMI to write one or more registers
@@ -181,6 +250,16 @@ The format is:
 
 */
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 typedef struct bms_model bms_model_t;
 
 void hmi_serial_tick(bms_model_t *model);
+void hmi_serial_set_idle(bool idle);
+
+// Message builders, also used for the USB telemetry stream
+uint8_t hmi_append_register_value(uint8_t *buf, uint16_t reg_id, bms_model_t *model);
+size_t hmi_build_cell_voltages_response(uint8_t *tx_buf, const int16_t *cell_voltages_mV, uint8_t count);
+size_t hmi_build_events_response(uint8_t *tx_buf, uint16_t start_index);
@@ -0,0 +1,32 @@
+#include "hmi_slots.h"
+
+void hmi_slots_assign(hmi_slots_t *slots, uint8_t slot_index, uint8_t slot_count, uint8_t slot_ticks) {
+    if(slot_count == 0 || slot_index >= slot_count) {
+        // Invalid or cleared assignment, go back to transmitting freely
+        slots->slot_count = 0;
+        slots->slot_index = 0;
+        return;
+    }
+
+    slots->slot_count = slot_count;
+    slots->slot_index = slot_index;
+    slots->slot_ticks = slot_ticks > 0 ? slot_ticks : HMI_SLOT_DEFAULT_TICKS;
+}
+
+void hmi_slots_sync(hmi_slots_t *slots, uint32_t now) {
+    // Called when a packet from the HMI is received, which marks the start of
+    // a new frame for every node on the bus.
+    slots->frame_start = now;
+}
+
+bool hmi_slots_can_transmit(const hmi_slots_t *slots, uint32_t now) {
+    if(slots->slot_count == 0) {
+        return true;
+    }
+
+    uint32_t frame_ticks = (uint32_t)slots->slot_count * slots->slot_ticks;
+    uint32_t position = (now - slots->frame_start) % frame_ticks;
+
+    // Only transmit in the first timestep of our slot, the rest is guard time.
+    return position == (uint32_t)slots->slot_index * slots->slot_ticks;
+}
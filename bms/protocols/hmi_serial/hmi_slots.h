@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// TDMA slot scheduling for the shared HMI bus.
+//
+// The HMI can assign each BMS a slot index within a frame of slot_count slots,
+// each slot_ticks timesteps long. The frame is re-anchored whenever a packet
+// from the HMI is received, so every node on the bus shares (roughly) the same
+// frame start. Nodes only observe that packet at timestep granularity, so their
+// frame starts may disagree by up to one timestep. To absorb this, a node only
+// transmits in the first timestep of its slot, and the remaining slot_ticks-1
+// timesteps act as a guard interval.
+//
+// With no slot assigned (slot_count == 0), nodes transmit freely as before.
+
+// Default slot length in timesteps (one to transmit, one guard)
+#define HMI_SLOT_DEFAULT_TICKS 2
+
+typedef struct {
+    // Number of slots in the frame, or 0 if no slot has been assigned
+    uint8_t slot_count;
+    // Our slot within the frame
+    uint8_t slot_index;
+    // Length of each slot, in timesteps
+    uint8_t slot_ticks;
+
+    // Timestep at which the current frame started
+    uint32_t frame_start;
+} hmi_slots_t;
+
+void hmi_slots_assign(hmi_slots_t *slots, uint8_t slot_index, uint8_t slot_count, uint8_t slot_ticks);
+void hmi_slots_sync(hmi_slots_t *slots, uint32_t now);
+bool hmi_slots_can_transmit(const hmi_slots_t *slots, uint32_t now);
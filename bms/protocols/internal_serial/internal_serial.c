@@ -1,19 +1,104 @@
-#include "drivers/comms/duart.h"
+#include "internal_serial.h"
+
+#include "app/model.h"
 #include "config/allocations.h"
+#include "config/limits.h"
 #include "config/pins.h"
+#include "drivers/comms/duart.h"
+#include "sys/events/events.h"
 #include "sys/time/time.h"
 
-const uint8_t str[] = {
-    'K', 'e', 'e', 'p', 'A', 'l', 'i', 'v',
-};
+static uint8_t snapshot_sequence = 0;
 
 void init_internal_serial() {
     init_duart(&INTERNAL_SERIAL_DUART, 115200, PIN_INTERNAL_SERIAL_TX, PIN_INTERNAL_SERIAL_RX, false); //9375000 works!
 }
 
-void internal_serial_tick() {
-    if((timestep() & 63) == 0) {
-        // Send "KeepAliv" message periodically
-        duart_send_packet(&INTERNAL_SERIAL_DUART, (uint8_t *)str, 8);
+static inline uint8_t internal_buf_append_uint32(uint8_t *buf, uint32_t value) {
+    buf[0] = (value >> 0) & 0xFF;
+    buf[1] = (value >> 8) & 0xFF;
+    buf[2] = (value >> 16) & 0xFF;
+    buf[3] = (value >> 24) & 0xFF;
+    return 4;
+}
+
+static inline uint8_t internal_buf_append_uint16(uint8_t *buf, uint16_t value) {
+    buf[0] = (value >> 0) & 0xFF;
+    buf[1] = (value >> 8) & 0xFF;
+    return 2;
+}
+
+static void internal_send_safety_snapshot(bms_model_t *model) {
+    uint8_t tx_buf[32];
+    uint8_t idx = 0;
+
+    uint8_t fresh = 0;
+    if(millis_recent_enough(model->cell_voltage_millis, model->cell_voltage_slow_mode ? CELL_VOLTAGE_STALE_THRESHOLD_SLOW_MS : CELL_VOLTAGE_STALE_THRESHOLD_MS)) {
+        fresh |= INTERNAL_FRESH_CELL_VOLTAGES;
+    }
+    if(millis_recent_enough(model->battery_voltage_millis, BATTERY_VOLTAGE_STALE_THRESHOLD_MS)) {
+        fresh |= INTERNAL_FRESH_BATTERY_VOLTAGE;
+    }
+    if(millis_recent_enough(model->current_millis, CURRENT_STALE_THRESHOLD_MS)) {
+        fresh |= INTERNAL_FRESH_CURRENT;
+    }
+    if(millis_recent_enough(model->temperature_millis, TEMPERATURE_STALE_THRESHOLD_MS(model))) {
+        fresh |= INTERNAL_FRESH_TEMPERATURE;
+    }
+
+    tx_buf[idx++] = INTERNAL_MSG_SAFETY_SNAPSHOT;
+    tx_buf[idx++] = snapshot_sequence++;
+    idx += internal_buf_append_uint32(&tx_buf[idx], millis());
+    idx += internal_buf_append_uint16(&tx_buf[idx], (uint16_t)model->cell_voltage_min_mV);
+    idx += internal_buf_append_uint16(&tx_buf[idx], (uint16_t)model->cell_voltage_max_mV);
+    idx += internal_buf_append_uint32(&tx_buf[idx], (uint32_t)model->battery_voltage_mV);
+    idx += internal_buf_append_uint32(&tx_buf[idx], (uint32_t)model->current_mA);
+    idx += internal_buf_append_uint16(&tx_buf[idx], (uint16_t)model->temperature_min_dC);
+    idx += internal_buf_append_uint16(&tx_buf[idx], (uint16_t)model->temperature_max_dC);
+    tx_buf[idx++] = fresh;
+    tx_buf[idx++] = (uint8_t)model->contactor_sm.state;
+    tx_buf[idx++] = (uint8_t)model->system_sm.state;
+    tx_buf[idx++] = (uint8_t)get_highest_event_level();
+
+    duart_send_packet(&INTERNAL_SERIAL_DUART, tx_buf, idx);
+}
+
+static void internal_handle_supervisor_status(const uint8_t *rx_buf, size_t len, bms_model_t *model) {
+    if(len < 2) return;
+
+    model->supervisor_flags = rx_buf[1];
+    model->supervisor_millis = millis();
+
+    if(model->supervisor_flags & INTERNAL_SUPERVISOR_TRIP) {
+        raise_bms_event(ERR_SUPERVISOR_TRIP, model->supervisor_flags);
+    }
+}
+
+void internal_serial_tick(bms_model_t *model) {
+    // At 115200 baud the ~30 byte snapshot takes ~3ms, so we can afford one
+    // every tick.
+    internal_send_safety_snapshot(model);
+
+    uint8_t rx_buf[64];
+    size_t len;
+    while((len = duart_read_packet(&INTERNAL_SERIAL_DUART, rx_buf, sizeof(rx_buf))) > 0) {
+        switch(rx_buf[0]) {
+            case INTERNAL_MSG_SUPERVISOR_STATUS:
+                internal_handle_supervisor_status(rx_buf, len, model);
+                break;
+            default:
+                // Ignore unknown messages
+                break;
+        }
+    }
+
+    if(model->supervisor_millis != 0) {
+        // Only check once the supervisor has been heard from, as it may not be
+        // fitted (or running compatible firmware).
+        confirm(
+            millis_recent_enough(model->supervisor_millis, SUPERVISOR_STALE_THRESHOLD_MS),
+            ERR_SUPERVISOR_STALE,
+            millis() - model->supervisor_millis
+        );
     }
 }
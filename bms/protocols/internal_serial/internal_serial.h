@@ -1,2 +1,58 @@
+#pragma once
+
+#define INTERNAL_MSG_SAFETY_SNAPSHOT    0x10
+#define INTERNAL_MSG_SUPERVISOR_STATUS  0x20
+
+// Safety snapshot freshness flags
+#define INTERNAL_FRESH_CELL_VOLTAGES    0x01
+#define INTERNAL_FRESH_BATTERY_VOLTAGE  0x02
+#define INTERNAL_FRESH_CURRENT          0x04
+#define INTERNAL_FRESH_TEMPERATURE      0x08
+
+// Supervisor status flags
+#define INTERNAL_SUPERVISOR_TRIP        0x01
+
+// How long the supervisor can go quiet (once heard from) before we complain
+#define SUPERVISOR_STALE_THRESHOLD_MS   1000
+
+/*
+
+Internal serial format
+
+Link between the BMS and supervisor MCUs, using the same packet framing (and
+CRC16) as the HMI serial link. All values are little-endian.
+
+1. Safety snapshot (from BMS to supervisor, every tick)
+
+A copy of the safety-relevant parts of the model, so the supervisor can
+independently check the limits.
+
+<message type byte = INTERNAL_MSG_SAFETY_SNAPSHOT (0x10)>
+<sequence number (1 byte)> (increments each snapshot)
+<millis (4 bytes)>
+<cell voltage min (2 bytes)> (int16, mV)
+<cell voltage max (2 bytes)> (int16, mV)
+<battery voltage (4 bytes)> (int32, mV)
+<current (4 bytes)> (int32, mA, positive is charging)
+<temperature min (2 bytes)> (int16, 0.1C)
+<temperature max (2 bytes)> (int16, 0.1C)
+<freshness flags (1 byte)> (INTERNAL_FRESH_*, set if the value is not stale)
+<contactors state (1 byte)>
+<system state (1 byte)>
+<highest event level (1 byte)>
+
+2. Supervisor status (from supervisor to BMS)
+
+<message type byte = INTERNAL_MSG_SUPERVISOR_STATUS (0x20)>
+<status flags (1 byte)> (INTERNAL_SUPERVISOR_*)
+
+If the supervisor sets the TRIP flag, a SUPERVISOR_TRIP event is raised, which
+will open the contactors. Once a status has been received, the supervisor is
+expected to keep sending one at least every SUPERVISOR_STALE_THRESHOLD_MS.
+
+*/
+
+typedef struct bms_model bms_model_t;
+
 void init_internal_serial();
-void internal_serial_tick();
+void internal_serial_tick(bms_model_t *model);
@@ -3,6 +3,8 @@
 #include "config/pins.h"
 #include "sys/events/events.h"
 #include "app/model.h"
+#include "app/monitoring/counters.h"
+#include "lib/ringbuf.h"
 
 #include "can2040.h"
 
@@ -11,15 +13,12 @@
 static const int battery_capacity_Wh = 60000;
 static const int FW_MAJOR_VERSION = 0x03;
 static const int FW_MINOR_VERSION = 0x29;
+static const uint32_t can_bitrate = 500000; // 500 kbps
   
 static struct can2040 cbus;
 static bool inverter_present = false;
 static bool inverter_initialized = false;
 static int inverter_init_state = 0;
-// offsets to avoid sending all messages on the same timestep
-static uint32_t timestep_1 = 0;
-static uint32_t timestep_2 = 1;
-static uint32_t timestep_3 = 2;
 
 static const struct can2040_msg byd_250 = {
     .id = 0x250,
@@ -42,58 +41,223 @@ static const struct can2040_msg byd_2d0 = {
     .dlc = 8,
     .data = {0x00, 'B', 'Y', 'D', 0x00, 0x00, 0x00, 0x00}
 };
+static const struct can2040_msg byd_3d0_0 = {
+    .id = 0x3D0,
+    .dlc = 8,
+    .data = {0x00, 'B', 'a', 't', 't', 'e', 'r', 'y'}
+};
+static const struct can2040_msg byd_3d0_1 = {
+    .id = 0x3D0,
+    .dlc = 8,
+    .data = {0x01, '-', 'B', 'o', 'x', ' ', 'P', 'r'}
+};
+static const struct can2040_msg byd_3d0_2 = {
+    .id = 0x3D0,
+    .dlc = 8,
+    .data = {0x02, 'e', 'm', 'i', 'u', 'm', ' ', 'H'}
+};
+static const struct can2040_msg byd_3d0_3 = {
+    .id = 0x3D0,
+    .dlc = 8,
+    .data = {0x03, 'V', 'S', 0x00, 0x00, 0x00, 0x00, 0x00}
+};
+
+// Sent in order after the first contactor close. If the TX queue is full, we
+// carry on from the same message next tick.
+static const struct can2040_msg *const init_messages[] = {
+    &byd_250, &byd_290, &byd_2d0,
+    &byd_3d0_0, &byd_3d0_1, &byd_3d0_2, &byd_3d0_3,
+};
+
+// Frames received in the PIO IRQ are copied into this mailbox, and decoded in
+// the main loop by inverter_receive(). Each record is a whole struct
+// can2040_msg, written in one go so the main loop never sees a partial frame.
+static struct ringbuf rx_mailbox;
+static uint8_t rx_mailbox_buffer[32 * sizeof(struct can2040_msg)];
+
+typedef struct {
+    uint32_t id;
+    uint32_t count;
+    millis_t last_millis;
+    // Smoothed interval between frames
+    uint32_t period_ms;
+} inverter_rx_stats_t;
+
+// The frames we expect from the inverter (anything else is filtered out in the
+// IRQ)
+static inverter_rx_stats_t rx_stats[] = {
+    { .id = 0x091 }, // voltage/current/temperature
+    { .id = 0x0d1 }, // SoC
+    { .id = 0x111 }, // time
+    { .id = 0x151 }, // brand name
+};
+
+// Updated from the PIO IRQ, and turned into load figures once a second by
+// inverter_update_bus_stats()
+static volatile uint32_t isr_time_us = 0;
+static volatile uint32_t bus_bits = 0;
 
 static void PIOx_IRQHandler(void)
 {
+    uint32_t start = time_us_32();
     can2040_pio_irq_handler(&cbus);
+    uint32_t elapsed = time_us_32() - start;
+
+    isr_time_us += elapsed;
+    if(elapsed > debug_counters.can_isr_max_us) {
+        debug_counters.can_isr_max_us = elapsed;
+    }
+}
+
+// Approximate length of a frame on the wire, including the interframe space
+// and allowing for a typical amount of bit stuffing.
+static inline uint32_t frame_bits(const struct can2040_msg *msg) {
+    uint32_t dlc = msg->dlc > 8 ? 8 : msg->dlc;
+    uint32_t bits = 47 + 8 * dlc;
+    if(msg->id & CAN2040_ID_EFF) {
+        bits += 20;
+    }
+    return bits + bits / 10;
+}
+
+// Acceptance filter for standard (11-bit) IDs, one bit per ID, filled in from
+// rx_stats at init. Checked before anything else is done with a received
+// frame, so other chatty devices on the bus cost as little IRQ time as
+// possible.
+static uint32_t rx_filter[2048 / 32];
+
+static void rx_filter_add(uint32_t id) {
+    rx_filter[id >> 5] |= 1u << (id & 31);
+}
+
+static inline bool rx_filter_match(uint32_t id) {
+    // Extended and RTR frames have flags above bit 10 set, so never match
+    if(id >= 2048) return false;
+    return rx_filter[id >> 5] & (1u << (id & 31));
 }
 
 static void can2040_cb(struct can2040 *cd, uint32_t notify, struct can2040_msg *msg)
 {
-    if (notify != CAN2040_NOTIFY_RX) return;
     (void)cd;
-    
-    // Add message processing code here...
-    // rx 151 (contains brand name)
-    // rx 91 (contains voltage/current/temp)
-    // rx d1 (contains inverter SoC?)
-    // rx 111 (contains time)
 
-    switch(msg->id) {
-        case 0x151:
-            // process brand name
-            break;
-        case 0x91:
-            // process voltage/current/temp
-            printf("Got CAN 091: ");
-            for(int i=0; i<msg->dlc; i++) {
-                printf("%02X ", msg->data[i]);
+    if (notify == CAN2040_NOTIFY_RX) {
+        debug_counters.can_frames_received++;
+        bus_bits += frame_bits(msg);
+
+        if(!rx_filter_match(msg->id)) {
+            debug_counters.can_rx_filtered++;
+            return;
+        }
+
+        if(ringbuf_write(&rx_mailbox, (const uint8_t*)msg, sizeof(*msg)) == 0) {
+            // Mailbox full, the main loop has fallen behind
+            debug_counters.can_rx_overflows++;
+        }
+        return;
+    }
+    if (notify == CAN2040_NOTIFY_TX) {
+        debug_counters.can_frames_sent++;
+        bus_bits += frame_bits(msg);
+        return;
+    }
+    if (notify & CAN2040_NOTIFY_ERROR) {
+        // The PIO RX FIFO overflowed, as the CPU didn't service the IRQ in time
+        debug_counters.can_rx_stalls++;
+        return;
+    }
+}
+
+static inline int16_t get_be_int16(const uint8_t *data) {
+    return (int16_t)((data[0] << 8) | data[1]);
+}
+
+static void inverter_update_rx_stats(uint32_t id) {
+    for(size_t i = 0; i < sizeof(rx_stats) / sizeof(rx_stats[0]); i++) {
+        inverter_rx_stats_t *stats = &rx_stats[i];
+        if(stats->id != id) continue;
+
+        millis_t now = millis();
+        if(stats->count > 0) {
+            int32_t interval_ms = now - stats->last_millis;
+            if(stats->count == 1) {
+                stats->period_ms = interval_ms;
+            } else {
+                stats->period_ms += (interval_ms - (int32_t)stats->period_ms) / 8;
             }
-            printf("\n");
+        }
+        stats->last_millis = now;
+        stats->count++;
+        return;
+    }
+}
 
+static void inverter_decode_frame(bms_model_t *model, const struct can2040_msg *msg) {
+    switch(msg->id) {
+        case 0x091:
+            // Voltage (0.1V), current (0.1A) and temperature (0.1C)
+            if(msg->dlc < 6) return;
+            model->inverter_voltage_mV = (int32_t)(uint16_t)get_be_int16(&msg->data[0]) * 100;
+            model->inverter_current_mA = (int32_t)get_be_int16(&msg->data[2]) * 100;
+            model->inverter_temperature_dC = get_be_int16(&msg->data[4]);
+            model->inverter_measurements_millis = millis();
             break;
-        case 0xd1:
-            // process inverter SoC
+        case 0x0d1:
+            // SoC (0.1%)
+            if(msg->dlc < 2) return;
+            model->inverter_soc = (uint16_t)get_be_int16(&msg->data[0]) * 10;
+            model->inverter_soc_millis = millis();
             break;
         case 0x111:
-            // process time
+            // Time (unix timestamp)
+            if(msg->dlc < 4) return;
+            model->inverter_time = ((uint32_t)msg->data[0] << 24) | ((uint32_t)msg->data[1] << 16)
+                | ((uint32_t)msg->data[2] << 8) | msg->data[3];
+            model->inverter_time_millis = millis();
+            break;
+        case 0x151:
+            // Brand name, not used yet
             break;
         default:
-            // skip this message
             return;
     }
 
-    //printf("Got CAN message %03X DLC %d\n", msg->id, msg->dlc);
+    inverter_update_rx_stats(msg->id);
+    model->inverter_millis = millis();
 
-    raise_bms_event(ERR_INVERTER_DETECTED, msg->id);
+    if(!inverter_present) {
+        inverter_present = true;
+        raise_bms_event(ERR_INVERTER_DETECTED, msg->id);
+    }
+}
+
+// Decode any frames received since the last tick, and check the inverter is
+// still talking to us.
+static void inverter_receive(bms_model_t *model) {
+    struct can2040_msg msg;
+    while(ringbuf_read(&rx_mailbox, (uint8_t*)&msg, sizeof(msg)) == sizeof(msg)) {
+        inverter_decode_frame(model, &msg);
+    }
 
-    inverter_present = true;
+    if(model->inverter_millis == 0) {
+        // Never heard from the inverter, so nothing to time out
+        return;
+    }
 
-    // TODO: store last received time for timeout detection
+    bool recent = millis_recent_enough(model->inverter_millis, INVERTER_STALE_THRESHOLD_MS);
+    confirm(recent, ERR_INVERTER_STALE, millis() - model->inverter_millis);
+    if(!recent && inverter_present) {
+        // Redo the init sequence if it comes back
+        inverter_present = false;
+        inverter_initialized = false;
+        inverter_init_state = 0;
+    }
 }
 
 void init_inverter() {
-    const int can_bitrate = 500000; // 500 kbps
+    ringbuf_init(&rx_mailbox, rx_mailbox_buffer, sizeof(rx_mailbox_buffer));
+    for(size_t i = 0; i < sizeof(rx_stats) / sizeof(rx_stats[0]); i++) {
+        rx_filter_add(rx_stats[i].id);
+    }
 
     can2040_setup(&cbus, CAN2040_PIO_NUM);
     can2040_callback_config(&cbus, can2040_cb);
@@ -107,111 +271,9 @@ void init_inverter() {
     can2040_start(&cbus, SYS_CLK_HZ, can_bitrate, PIN_CAN_RX, PIN_CAN_TX);
 }
 
-static void send_inverter_init_messages() {
-    struct can2040_msg msg;
-
-    if(inverter_init_state == 0) {
-        if(can2040_transmit(&cbus, &byd_250)<0) {
-            // failed to send
-            return;
-        }
-        inverter_init_state++;
-    }
-
-    if(inverter_init_state == 1) {
-        if(can2040_transmit(&cbus, &byd_290)<0) {
-            // failed to send
-            return;
-        }
-        inverter_init_state++;
-    }
-
-    if(inverter_init_state == 2) {
-        if(can2040_transmit(&cbus, &byd_2d0)<0) {
-            // failed to send
-            return;
-        }
-        inverter_init_state++;
-    }
-
-    msg.id = 0x3D0;
-    msg.dlc = 8;
-
-    if(inverter_init_state == 3) {
-        msg.data[0] = 0x00;
-        msg.data[1] = 'B';
-        msg.data[2] = 'a';
-        msg.data[3] = 't';
-        msg.data[4] = 't';
-        msg.data[5] = 'e';
-        msg.data[6] = 'r';
-        msg.data[7] = 'y';
-        if(can2040_transmit(&cbus, &msg)<0) {
-            // failed to send
-            return;
-        }
-        inverter_init_state++;
-    }
-
-    if(inverter_init_state == 4) {
-        msg.data[0] = 0x01;
-        msg.data[1] = '-';
-        msg.data[2] = 'B';
-        msg.data[3] = 'o';
-        msg.data[4] = 'x';
-        msg.data[5] = ' ';
-        msg.data[6] = 'P';
-        msg.data[7] = 'r';
-        if(can2040_transmit(&cbus, &msg)<0) {
-            // failed to send
-            return;
-        }
-        inverter_init_state++;
-    }
-
-    if(inverter_init_state == 5) {
-        msg.data[0] = 0x02;
-        msg.data[1] = 'e';
-        msg.data[2] = 'm';
-        msg.data[3] = 'i';
-        msg.data[4] = 'u';
-        msg.data[5] = 'm';
-        msg.data[6] = ' ';
-        msg.data[7] = 'H';
-        if(can2040_transmit(&cbus, &msg)<0) {
-            // failed to send
-            return;
-        }
-        inverter_init_state++;
-    }
-
-    if(inverter_init_state == 6) {
-        msg.data[0] = 0x03;
-        msg.data[1] = 'V';
-        msg.data[2] = 'S';
-        msg.data[3] = 0x00;
-        msg.data[4] = 0x00;
-        msg.data[5] = 0x00;
-        msg.data[6] = 0x00;
-        msg.data[7] = 0x00;
-        if(can2040_transmit(&cbus, &msg)<0) {
-            // failed to send
-            return;
-        }
-        inverter_init_state++;
-    }
-
-    inverter_initialized = true;
-    inverter_init_state = 0;
-    timestep_1 = timestep();
-    timestep_2 = timestep_1 + 1;
-    timestep_3 = timestep_1 + 2;
-}
-
-static int send_110(bms_model_t *model) {
-    struct can2040_msg msg;
-    msg.id = 0x110;
-    msg.dlc = 8;
+static bool build_110(bms_model_t *model, struct can2040_msg *msg) {
+    msg->id = 0x110;
+    msg->dlc = 8;
 
     uint16_t cell_voltage_working_max_mV = model->cell_voltage_working_max_mV;
     if(cell_voltage_working_max_mV == 0) {
@@ -230,31 +292,30 @@ static int send_110(bms_model_t *model) {
 
     // TODO - nudge voltage limits to account for some cells nearing the top or bottom quicker, and also inverter voltage error?
 
-    msg.data[0] = (max_voltage_limit_dV >> 8) & 0xFF;
-    msg.data[1] = max_voltage_limit_dV & 0xFF;
-    msg.data[2] = (min_voltage_limit_dV >> 8) & 0xFF;
-    msg.data[3] = min_voltage_limit_dV & 0xFF;
-    msg.data[4] = (model->discharge_current_limit_dA >> 8) & 0xFF;
-    msg.data[5] = model->discharge_current_limit_dA & 0xFF;
-    msg.data[6] = (model->charge_current_limit_dA >> 8) & 0xFF;
-    msg.data[7] = model->charge_current_limit_dA & 0xFF;
+    msg->data[0] = (max_voltage_limit_dV >> 8) & 0xFF;
+    msg->data[1] = max_voltage_limit_dV & 0xFF;
+    msg->data[2] = (min_voltage_limit_dV >> 8) & 0xFF;
+    msg->data[3] = min_voltage_limit_dV & 0xFF;
+    msg->data[4] = (model->discharge_current_limit_dA >> 8) & 0xFF;
+    msg->data[5] = model->discharge_current_limit_dA & 0xFF;
+    msg->data[6] = (model->charge_current_limit_dA >> 8) & 0xFF;
+    msg->data[7] = model->charge_current_limit_dA & 0xFF;
 
     // printf("CAN 110 %02X %02X %02X %02X %02X %02X %02X %02X\n",
-    //     msg.data[0], msg.data[1], msg.data[2], msg.data[3],
-    //     msg.data[4], msg.data[5], msg.data[6], msg.data[7]);
+    //     msg->data[0], msg->data[1], msg->data[2], msg->data[3],
+    //     msg->data[4], msg->data[5], msg->data[6], msg->data[7]);
 
-    return can2040_transmit(&cbus, &msg);
+    return true;
 }
 
-static int send_150(bms_model_t *model) {
+static bool build_150(bms_model_t *model, struct can2040_msg *msg) {
     if(model->soc_millis==0) {
         // no valid data yet, don't send anything
-        return -1;
+        return false;
     }
 
-    struct can2040_msg msg;
-    msg.id = 0x150;
-    msg.dlc = 8;
+    msg->id = 0x150;
+    msg->dlc = 8;
 
     int16_t divisor = model->soc_scaling_max - model->soc_scaling_min;
     if(divisor == 0) {
@@ -265,13 +326,14 @@ static int send_150(bms_model_t *model) {
     if(scaled_soc > 10000) scaled_soc = 10000;
     if(scaled_soc < 0) scaled_soc = 0;
 
-    msg.data[0] = (scaled_soc >> 8) & 0xFF;
-    msg.data[1] = scaled_soc & 0xFF;
-    // TODO: workaround for Deye?
-    //const uint16_t soh = 10000; // 100.00%
-    const uint16_t soh = 9900; // 99.00%
-    msg.data[2] = (soh >> 8) & 0xFF;
-    msg.data[3] = soh & 0xFF;
+    msg->data[0] = (scaled_soc >> 8) & 0xFF;
+    msg->data[1] = scaled_soc & 0xFF;
+    // Deye seems unhappy with 100.00%, so report at most 99.00% (which is
+    // also what we report until the SoH is known)
+    uint16_t soh = model->soh;
+    if(soh == 0 || soh > 9900) soh = 9900;
+    msg->data[2] = (soh >> 8) & 0xFF;
+    msg->data[3] = soh & 0xFF;
 
     // so if scaling min/max is 50 to 75, we're only using 25% of the working capacity
 
@@ -281,92 +343,266 @@ static int send_150(bms_model_t *model) {
     }
 
     const uint16_t remaining_capacity_dAh = ((uint64_t)scaled_working_capacity_mC * scaled_soc) / ((uint64_t)10000 * 3600 * 100);
-    msg.data[4] = (remaining_capacity_dAh >> 8) & 0xFF;
-    msg.data[5] = remaining_capacity_dAh & 0xFF;
+    msg->data[4] = (remaining_capacity_dAh >> 8) & 0xFF;
+    msg->data[5] = remaining_capacity_dAh & 0xFF;
 
     const uint16_t full_capacity_dAh = (scaled_working_capacity_mC / (3600 * 100));
-    msg.data[6] = (full_capacity_dAh >> 8) & 0xFF;
-    msg.data[7] = full_capacity_dAh & 0xFF;
+    msg->data[6] = (full_capacity_dAh >> 8) & 0xFF;
+    msg->data[7] = full_capacity_dAh & 0xFF;
 
-    printf("CAN 150 sent SOC %d RemCap %d FullCap %d\n",
+    printf("CAN 150 SOC %d RemCap %d FullCap %d\n",
         scaled_soc, remaining_capacity_dAh, full_capacity_dAh);
 
-    return can2040_transmit(&cbus, &msg);
+    return true;
 }
 
-static int send_1d0(bms_model_t *model) {
+static bool build_1d0(bms_model_t *model, struct can2040_msg *msg) {
     if(model->battery_voltage_millis==0 || model->current_millis==0 || model->temperature_millis==0) {
         // no valid data yet, don't send anything
-        return -1;
+        return false;
     }
 
-    struct can2040_msg msg;
-    msg.id = 0x1D0;
-    msg.dlc = 8;
+    msg->id = 0x1D0;
+    msg->dlc = 8;
 
     // TODO: battery voltage or cell voltage total?
     const uint16_t pack_voltage_dV = model->battery_voltage_mV / 100; // in 0.1V units
-    msg.data[0] = (pack_voltage_dV >> 8) & 0xFF;
-    msg.data[1] = pack_voltage_dV & 0xFF;
+    msg->data[0] = (pack_voltage_dV >> 8) & 0xFF;
+    msg->data[1] = pack_voltage_dV & 0xFF;
     // TODO: check current direction
     const int16_t pack_current_dA = model->current_mA / 100; // in 0.1A units
-    msg.data[2] = (pack_current_dA >> 8) & 0xFF;
-    msg.data[3] = pack_current_dA & 0xFF;
+    msg->data[2] = (pack_current_dA >> 8) & 0xFF;
+    msg->data[3] = pack_current_dA & 0xFF;
     const int16_t temperature_midpoint_dC = (model->temperature_min_dC + model->temperature_max_dC) / 2; // in 0.1C units
-    msg.data[4] = (temperature_midpoint_dC >> 8) & 0xFF;
-    msg.data[5] = temperature_midpoint_dC & 0xFF;
-    msg.data[6] = 0x03;
-    msg.data[7] = 0x08;
-    return can2040_transmit(&cbus, &msg);
+    msg->data[4] = (temperature_midpoint_dC >> 8) & 0xFF;
+    msg->data[5] = temperature_midpoint_dC & 0xFF;
+    msg->data[6] = 0x03;
+    msg->data[7] = 0x08;
+    return true;
 }
 
-static int send_210(bms_model_t *model) {
+static bool build_210(bms_model_t *model, struct can2040_msg *msg) {
     if(model->temperature_millis==0) {
         // no valid temperature data, don't send anything
-        return -1;
+        return false;
     }
 
     // TODO: Do we need to check staleness? the events system should already deal with that
 
-    struct can2040_msg msg;
-    msg.id = 0x210;
-    msg.dlc = 8;
+    msg->id = 0x210;
+    msg->dlc = 8;
 
     const int16_t temperature_max_dC = model->temperature_max_dC; // in 0.1C units
-    msg.data[0] = (temperature_max_dC >> 8) & 0xFF;
-    msg.data[1] = temperature_max_dC & 0xFF;
+    msg->data[0] = (temperature_max_dC >> 8) & 0xFF;
+    msg->data[1] = temperature_max_dC & 0xFF;
     const int16_t temperature_min_dC = model->temperature_min_dC; // in 0.1C units
-    msg.data[2] = (temperature_min_dC >> 8) & 0xFF;
-    msg.data[3] = temperature_min_dC & 0xFF;
-    msg.data[4] = 0x00;
-    msg.data[5] = 0x00;
-    msg.data[6] = 0x00;
-    msg.data[7] = 0x00;
-    return can2040_transmit(&cbus, &msg);
+    msg->data[2] = (temperature_min_dC >> 8) & 0xFF;
+    msg->data[3] = temperature_min_dC & 0xFF;
+    msg->data[4] = 0x00;
+    msg->data[5] = 0x00;
+    msg->data[6] = 0x00;
+    msg->data[7] = 0x00;
+    return true;
 }
 
-static int send_190(bms_model_t *model) {
+static bool build_190(bms_model_t *model, struct can2040_msg *msg) {
     // Alarms
-    struct can2040_msg msg;
-    msg.id = 0x190;
-    msg.dlc = 8;
+    msg->id = 0x190;
+    msg->dlc = 8;
     (void)model;
 
-    msg.data[0] = 0x00;
-    msg.data[1] = 0x00;
-    msg.data[2] = 0x03;
-    msg.data[3] = 0x00;
-    msg.data[4] = 0x00;
-    msg.data[5] = 0x00;
-    msg.data[6] = 0x00;
-    msg.data[7] = 0x00;
-    return can2040_transmit(&cbus, &msg);
+    msg->data[0] = 0x00;
+    msg->data[1] = 0x00;
+    msg->data[2] = 0x03;
+    msg->data[3] = 0x00;
+    msg->data[4] = 0x00;
+    msg->data[5] = 0x00;
+    msg->data[6] = 0x00;
+    msg->data[7] = 0x00;
+    return true;
 }
 
-static uint8_t transmit_cycle = 0;
+static bool build_4d0(bms_model_t *model, struct can2040_msg *msg) {
+    // Lifetime energy in/out (Wh). This isn't part of the BYD protocol, so
+    // inverters ignore it, but it's handy for anything else logging the bus.
+    // Not sent unless the energy is actually being counted, rather than
+    // publishing totals that aren't moving.
+    if(model->energy_status != ENERGY_STATUS_COUNTING) {
+        return false;
+    }
+    msg->id = 0x4D0;
+    msg->dlc = 8;
+
+    msg->data[0] = (model->energy_in_Wh >> 24) & 0xFF;
+    msg->data[1] = (model->energy_in_Wh >> 16) & 0xFF;
+    msg->data[2] = (model->energy_in_Wh >> 8) & 0xFF;
+    msg->data[3] = model->energy_in_Wh & 0xFF;
+    msg->data[4] = (model->energy_out_Wh >> 24) & 0xFF;
+    msg->data[5] = (model->energy_out_Wh >> 16) & 0xFF;
+    msg->data[6] = (model->energy_out_Wh >> 8) & 0xFF;
+    msg->data[7] = model->energy_out_Wh & 0xFF;
+    return true;
+}
+
+typedef struct {
+    uint32_t id;
+    uint32_t period_ms;
+    // Offset (in ticks) from the start of the schedule, to spread frames out
+    uint32_t phase_ticks;
+    // Fills in the frame, or returns false if there's nothing to send yet
+    bool (*build)(bms_model_t *model, struct can2040_msg *msg);
+
+    uint32_t due_timestep;
+    // Due, but not yet accepted by the TX queue
+    bool pending;
+    uint32_t sent;
+    // Frames abandoned because the next one was due before they went out
+    uint32_t dropped;
+    // How late the last (and worst) frame was, relative to its slot
+    uint32_t jitter_ms;
+    uint32_t jitter_max_ms;
+} can_schedule_entry_t;
+
+// 0x110 goes out every 5 ticks on phase 0, so the slower frames use phases
+// that aren't a multiple of 5 to avoid sharing a tick with it.
+static can_schedule_entry_t schedule[] = {
+    { .id = 0x110, .period_ms = 100,   .phase_ticks = 0, .build = build_110 },
+    { .id = 0x150, .period_ms = 10000, .phase_ticks = 1, .build = build_150 },
+    { .id = 0x1D0, .period_ms = 10000, .phase_ticks = 2, .build = build_1d0 },
+    { .id = 0x210, .period_ms = 10000, .phase_ticks = 3, .build = build_210 },
+    { .id = 0x190, .period_ms = 60000, .phase_ticks = 4, .build = build_190 },
+    { .id = 0x4D0, .period_ms = 60000, .phase_ticks = 6, .build = build_4d0 },
+};
+
+// Starts the schedule from the next tick
+static void inverter_schedule_start() {
+    for(size_t i = 0; i < sizeof(schedule) / sizeof(schedule[0]); i++) {
+        schedule[i].due_timestep = timestep() + 1 + schedule[i].phase_ticks;
+        schedule[i].pending = false;
+    }
+}
+
+static void inverter_schedule_tick(bms_model_t *model) {
+    uint32_t now = timestep();
+
+    for(size_t i = 0; i < sizeof(schedule) / sizeof(schedule[0]); i++) {
+        can_schedule_entry_t *entry = &schedule[i];
+        uint32_t period_ticks = entry->period_ms / TIMESTEP_PERIOD_MS;
+
+        if(!entry->pending) {
+            if((int32_t)(now - entry->due_timestep) < 0) {
+                // Not due yet
+                continue;
+            }
+            entry->pending = true;
+        }
+
+        // Slots are anchored to the start of the schedule (rather than to when
+        // the last frame went out), so a late frame doesn't delay the next one.
+        uint32_t late_ticks = now - entry->due_timestep;
+        while(late_ticks >= period_ticks) {
+            entry->dropped++;
+            debug_counters.can_frames_dropped++;
+            entry->due_timestep += period_ticks;
+            late_ticks -= period_ticks;
+        }
+
+        struct can2040_msg msg;
+        if(!entry->build(model, &msg)) {
+            // No data yet, skip this slot
+            entry->pending = false;
+            entry->due_timestep += period_ticks;
+            continue;
+        }
+
+        if(can2040_transmit(&cbus, &msg) < 0) {
+            // TX queue full, try again next tick
+            debug_counters.can_tx_queue_full++;
+            continue;
+        }
+
+        entry->sent++;
+        entry->jitter_ms = late_ticks * TIMESTEP_PERIOD_MS;
+        if(entry->jitter_ms > entry->jitter_max_ms) {
+            entry->jitter_max_ms = entry->jitter_ms;
+        }
+        entry->pending = false;
+        entry->due_timestep += period_ticks;
+    }
+}
+
+static void send_inverter_init_messages() {
+    while(inverter_init_state < (int)(sizeof(init_messages) / sizeof(init_messages[0]))) {
+        if(can2040_transmit(&cbus, init_messages[inverter_init_state]) < 0) {
+            // TX queue full, try again next tick
+            debug_counters.can_tx_queue_full++;
+            return;
+        }
+        inverter_init_state++;
+    }
+
+    inverter_initialized = true;
+    inverter_init_state = 0;
+    inverter_schedule_start();
+}
+
+static uint32_t bus_stats_timestep = 0;
+static uint32_t bus_stats_last_us = 0;
+static uint32_t bus_stats_last_bits = 0;
+static uint32_t bus_stats_last_isr_time_us = 0;
+
+static void inverter_update_bus_stats() {
+    if(!timestep_every_ms(1000, &bus_stats_timestep)) {
+        return;
+    }
+
+    uint32_t now_us = time_us_32();
+    uint32_t elapsed_us = now_us - bus_stats_last_us;
+    uint32_t bits = bus_bits;
+    uint32_t isr_us = isr_time_us;
+
+    if(bus_stats_last_us != 0 && elapsed_us > 0) {
+        // Both in 0.01% units
+        debug_counters.can_bus_load = (uint64_t)(bits - bus_stats_last_bits) * 10000 * 1000000
+            / ((uint64_t)can_bitrate * elapsed_us);
+        debug_counters.can_isr_load = (uint64_t)(isr_us - bus_stats_last_isr_time_us) * 10000
+            / elapsed_us;
+    }
+    bus_stats_last_us = now_us;
+    bus_stats_last_bits = bits;
+    bus_stats_last_isr_time_us = isr_us;
+
+    struct can2040_stats stats;
+    can2040_get_statistics(&cbus, &stats);
+    debug_counters.can_parse_errors = stats.parse_error;
+    debug_counters.can_tx_retries = stats.tx_attempt - stats.tx_total;
+}
+
+bool inverter_get_rx_frame_stats(uint8_t index, uint32_t *id, uint32_t *count) {
+    if(index >= sizeof(rx_stats) / sizeof(rx_stats[0])) {
+        return false;
+    }
+    *id = rx_stats[index].id;
+    *count = rx_stats[index].count;
+    return true;
+}
+
+bool inverter_get_tx_frame_stats(uint8_t index, uint32_t *id, uint32_t *sent, uint32_t *dropped,
+                                 uint32_t *jitter_ms, uint32_t *jitter_max_ms) {
+    if(index >= sizeof(schedule) / sizeof(schedule[0])) {
+        return false;
+    }
+    *id = schedule[index].id;
+    *sent = schedule[index].sent;
+    *dropped = schedule[index].dropped;
+    *jitter_ms = schedule[index].jitter_ms;
+    *jitter_max_ms = schedule[index].jitter_max_ms;
+    return true;
+}
 
 void inverter_tick(bms_model_t *model) {
-    // This should get called every 100ms
+    inverter_receive(model);
+    inverter_update_bus_stats();
 
     if(!inverter_present) {
         // We haven't received any CAN messages from the inverter yet
@@ -384,32 +620,5 @@ void inverter_tick(bms_model_t *model) {
         return;
     }
 
-    if(timestep_every_ms(100, &timestep_1)) {
-        // send regular messages every 100ms
-        send_110(model);
-    }
-    if(timestep_every_ms(10000, &timestep_2)) {
-        // send regular messages every 10s
-        send_150(model);
-        send_1d0(model);
-        send_210(model);
-    }
-    if(timestep_every_ms(60000, &timestep_3)) {
-        // send regular messages every 60s
-        send_190(model);
-    }
-
-    // transmit_cycle++;
-    // if((transmit_cycle % 20) == 0) { // every 2s
-    //     send_110();
-    // }
-    // if((transmit_cycle % 100) == 0) { // every 10s
-    //     send_150();
-    //     send_1d0();
-    //     send_210();
-    // }
-    // if((transmit_cycle % 600) == 0) { // every 60s
-    //     send_190();
-    //     transmit_cycle = 0;
-    // }
+    inverter_schedule_tick(model);
 }
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+
 typedef struct bms_model bms_model_t;
 
 // API for inverters
@@ -10,3 +13,10 @@ void init_inverter();
 // handshakes and then send regular messages. Consider staggering messages to
 // avoid exceeding the CAN transmit buffer size.
 void inverter_tick(bms_model_t *model);
+
+// Per-ID frame counts, for diagnostics. Returns false once index runs past the
+// last ID. The TX jitter is how late (in ms) the last and the worst frame went
+// out, relative to its slot in the schedule.
+bool inverter_get_rx_frame_stats(uint8_t index, uint32_t *id, uint32_t *count);
+bool inverter_get_tx_frame_stats(uint8_t index, uint32_t *id, uint32_t *sent, uint32_t *dropped,
+                                 uint32_t *jitter_ms, uint32_t *jitter_max_ms);
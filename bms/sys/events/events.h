@@ -118,13 +118,20 @@ typedef enum {
     X(BMB_CRC_MISMATCH, LEVEL_WARNING, 0)                       \
                                                                 \
     X(INVERTER_DETECTED, LEVEL_INFO, 0)                         \
+    X(INVERTER_STALE, LEVEL_WARNING, 0)                         \
                                                                 \
     X(ESTOP_PRESSED, LEVEL_CRITICAL, 500)                       \
                                                                 \
     X(BOOT_NORMAL, LEVEL_INFO, 0)                               \
     X(BOOT_WATCHDOG, LEVEL_WARNING, 0)                          \
     X(LOOP_OVERRUN, LEVEL_WARNING, 0)                           \
-    X(RESTARTING, LEVEL_FATAL, 0)
+    X(RESTARTING, LEVEL_FATAL, 0)                               \
+                                                                \
+    X(SUPERVISOR_TRIP, LEVEL_CRITICAL, 0)                       \
+    X(SUPERVISOR_STALE, LEVEL_WARNING, 0)                       \
+                                                                \
+    /* The contactors stay open until restart after this */     \
+    X(OVERCURRENT_TRIP, LEVEL_FATAL, 0)
 
 typedef enum {
 #define X(name, _1, _2) ERR_##name,
@@ -7,6 +7,11 @@
 
 typedef uint64_t millis64_t;
 typedef uint32_t millis_t;
+// Microseconds since boot, from time_us_32(). Used to stamp measurements with
+// the instant they were taken, so that readings from different sensors can be
+// lined up. Wraps every ~71 minutes, so only compare nearby values (as a
+// signed difference).
+typedef uint32_t micros_t;
 // 64-bit version avoids rollovers
 extern millis64_t stored_millis64;
 // 32-bit version for efficiency
@@ -0,0 +1,3 @@
+#pragma once
+
+typedef struct i2c_inst i2c_inst_t;
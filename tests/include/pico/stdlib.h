@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #define PIO0_IRQ_0 0
 #define SYS_CLK_HZ 150000000
@@ -15,4 +16,7 @@ static inline void irq_set_priority(int irq, int priority) {
 
 static inline void irq_set_enabled(int irq, bool enabled) {
     // Mock implementation
-}
\ No newline at end of file
+}
+
+// Mocked by the test
+uint32_t time_us_32(void);
@@ -3,6 +3,7 @@
 #include "app/model.h"
 #include "config/limits.h"
 
+#include <math.h>
 #include <stdint.h>
 
 
@@ -31,19 +32,6 @@ static const float test_nmc_ocv_curve[] = {
     4.20008564
 };
 
-// Implement the extern function required by current_limits.c
-float nmc_ocv_to_soc(float ocv) {
-    if (ocv <= test_nmc_ocv_curve[0]) return 0.0f;
-    if (ocv >= test_nmc_ocv_curve[100]) return 1.0f;
-    for (int i = 0; i < 100; i++) {
-        if (ocv < test_nmc_ocv_curve[i + 1]) {
-            float frac = (ocv - test_nmc_ocv_curve[i]) / (test_nmc_ocv_curve[i + 1] - test_nmc_ocv_curve[i]);
-            return (i + frac) / 100.0f;
-        }
-    }
-    return 1.0f;
-}
-
 float soc_to_ocv(float soc) {
     if (soc <= 0.0f) return test_nmc_ocv_curve[0];
     if (soc >= 1.0f) return test_nmc_ocv_curve[100];
@@ -65,9 +53,16 @@ void battery_model_tick(battery_model_t *bat, bms_model_t *model, float current_
     if (bat->soc < 0) bat->soc = 0;
     if (bat->soc > 1.0) bat->soc = 1.0;
 
+    // The polarization voltage relaxes towards I*R1 with time constant R1*C1
+    float R1 = bat->polarization_resistance_Ohm;
+    if (R1 > 0.0f) {
+        float decay = expf(-dt_s / (R1 * bat->polarization_capacitance_F));
+        bat->polarization_V = bat->polarization_V * decay + current_A * R1 * (1.0f - decay);
+    }
+
     float ocv = soc_to_ocv(bat->soc);
-    // V = OCV + I*R
-    float v_cell = ocv + current_A * bat->internal_resistance_Ohm;
+    // V = OCV + I*R0 + V_polarization
+    float v_cell = ocv + current_A * bat->internal_resistance_Ohm + bat->polarization_V;
 
     model->current_mA = (int32_t)(current_A * 1000.0f);
     model->current_millis = stored_millis;
@@ -82,6 +77,8 @@ void battery_model_tick(battery_model_t *bat, bms_model_t *model, float current_
 
     model->module_temperatures_millis = stored_millis;
 
-    printf("Battery: SoC %.2f, Cell Voltage %.2f V, Current %.2f A\n",
-           bat->soc, v_cell, current_A);
+    if (!bat->quiet) {
+        printf("Battery: SoC %.2f, Cell Voltage %.2f V, Current %.2f A\n",
+               bat->soc, v_cell, current_A);
+    }
 }
@@ -1,9 +1,15 @@
+#include <stdbool.h>
 #include <stdint.h>
 
 typedef struct {
     float capacity_Ah;
     float soc;
     float internal_resistance_Ohm;
+    // Optional polarization (R1 || C1 in series), disabled if R1 is zero
+    float polarization_resistance_Ohm;
+    float polarization_capacitance_F;
+    float polarization_V;
+    bool quiet; // don't print every tick
 } battery_model_t;
 
 typedef struct bms_model bms_model_t;
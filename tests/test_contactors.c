@@ -251,6 +251,27 @@ static void test_force_open_request(void **state) {
     assert_int_equal(model.contactor_sm.state, CONTACTORS_STATE_OPEN);
 }
 
+static void test_transient_expected(void **state) {
+    (void) state;
+    bms_model_t model = {0};
+
+    assert_false(contactors_transient_expected(&model));
+
+    model.contactor_sm.state = CONTACTORS_STATE_PRECHARGING;
+    assert_true(contactors_transient_expected(&model));
+
+    // Just after closing, but not once settled
+    model.contactor_sm.state = CONTACTORS_STATE_CLOSED;
+    model.contactor_sm.last_transition_time = stored_millis64;
+    assert_true(contactors_transient_expected(&model));
+    stored_millis64 += 5000;
+    assert_false(contactors_transient_expected(&model));
+
+    // ...until asked to open
+    model.contactor_req = CONTACTORS_REQUEST_OPEN;
+    assert_true(contactors_transient_expected(&model));
+}
+
 static void test_calibrate_request(void **state) {
     (void) state;
     bms_model_t model = {0};
@@ -279,6 +300,7 @@ int main(void) {
         cmocka_unit_test(test_precharge_success),
         cmocka_unit_test(test_precharge_failure_timeout),
         cmocka_unit_test(test_pos_weld_failure_detection),
+        cmocka_unit_test(test_transient_expected),
         // cmocka_unit_test(test_open_request_from_closed),
         // cmocka_unit_test(test_delayed_open_request_from_closed),
         // cmocka_unit_test(test_force_open_request),
@@ -0,0 +1,219 @@
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <cmocka.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "lib/filters.h"
+
+static void test_cic_boxcar(void **state) {
+    (void) state;
+
+    // Order 1 is a plain average over each block
+    filter_cic_t f;
+    filter_cic_init(&f, 1, 4);
+    assert_false(filter_cic_add(&f, 10));
+    assert_false(filter_cic_add(&f, 20));
+    assert_false(filter_cic_add(&f, 30));
+    assert_true(filter_cic_add(&f, 40));
+    assert_int_equal(f.value, 25);
+
+    assert_false(filter_cic_add(&f, -100));
+    assert_false(filter_cic_add(&f, -100));
+    assert_false(filter_cic_add(&f, -100));
+    assert_true(filter_cic_add(&f, -100));
+    assert_int_equal(f.value, -100);
+}
+
+static void test_cic_settles(void **state) {
+    (void) state;
+
+    // A third order CIC settles to the input after order blocks, and keeps
+    // working once the integrators have wrapped
+    filter_cic_t f;
+    filter_cic_init(&f, 3, 64);
+    int outputs = 0;
+    for(int i=0; i<64*2000; i++) {
+        if(filter_cic_add(&f, 4095)) {
+            outputs++;
+            if(outputs > 3) {
+                assert_int_equal(f.value, 4095);
+            }
+        }
+    }
+    assert_int_equal(outputs, 2000);
+}
+
+static void test_ema(void **state) {
+    (void) state;
+
+    filter_ema_t f;
+    filter_ema_init(&f, 4);
+    // First sample primes the filter
+    assert_int_equal(filter_ema_add(&f, 1000), 1000);
+
+    // Step response reaches ~63% after 16 samples
+    int32_t value = 0;
+    for(int i=0; i<16; i++) {
+        value = filter_ema_add(&f, 2000);
+    }
+    assert_in_range(value, 1600, 1680);
+
+    for(int i=0; i<500; i++) {
+        value = filter_ema_add(&f, 2000);
+    }
+    assert_in_range(value, 1985, 2000);
+
+    // Negative values work too
+    filter_ema_init(&f, 3);
+    for(int i=0; i<500; i++) {
+        value = filter_ema_add(&f, -1234);
+    }
+    assert_int_equal(value, -1234);
+}
+
+static void test_median(void **state) {
+    (void) state;
+
+    filter_median_t f;
+    filter_median_init(&f, 3);
+    filter_median_add(&f, 100);
+    filter_median_add(&f, 101);
+    // A single spike is removed
+    assert_int_equal(filter_median_add(&f, 5000), 101);
+    assert_int_equal(filter_median_add(&f, 102), 102);
+    // But a step comes through after two samples
+    filter_median_add(&f, 200);
+    assert_int_equal(filter_median_add(&f, 200), 200);
+
+    // Even sizes are rounded up
+    filter_median_init(&f, 4);
+    assert_int_equal(f.size, 5);
+}
+
+static void test_stats(void **state) {
+    (void) state;
+
+    filter_stats_t f;
+    filter_stats_init(&f, 4);
+    assert_false(filter_stats_add(&f, 1000));
+    assert_false(filter_stats_add(&f, 1002));
+    assert_false(filter_stats_add(&f, 998));
+    assert_true(filter_stats_add(&f, 1000));
+    assert_int_equal(f.mean, 1000);
+    assert_int_equal(f.min, 998);
+    assert_int_equal(f.max, 1002);
+    // (0 + 4 + 4 + 0) / 4
+    assert_int_equal(f.variance, 2);
+
+    // Large offsets don't lose precision
+    filter_stats_init(&f, 1000);
+    for(int i=0; i<1000; i++) {
+        filter_stats_add(&f, 20000000 + ((i & 1) ? 10 : -10));
+    }
+    assert_int_equal(f.mean, 20000000);
+    assert_int_equal(f.variance, 100);
+}
+
+static void test_outlier(void **state) {
+    (void) state;
+
+    filter_outlier_t f;
+    filter_outlier_init(&f, 3, 4, 5, 3);
+
+    // Noisy signal around 1000 is all accepted
+    srand(1);
+    for(int i=0; i<200; i++) {
+        assert_true(filter_outlier_check(&f, 1000 + (rand() % 11) - 5));
+    }
+
+    // A spike is rejected
+    assert_false(filter_outlier_check(&f, 3000));
+    assert_true(filter_outlier_check(&f, 1001));
+    assert_int_equal(f.rejected_total, 1);
+
+    // A real step is accepted after max_rejects samples
+    assert_false(filter_outlier_check(&f, 2000));
+    assert_false(filter_outlier_check(&f, 2000));
+    assert_true(filter_outlier_check(&f, 2000));
+    assert_true(filter_outlier_check(&f, 2001));
+}
+
+// Not really a test, but prints how long each stage takes per sample on the
+// host, as a rough guide to their relative cost.
+static void test_benchmark(void **state) {
+    (void) state;
+
+    const int n = 1000000;
+    int32_t *input = malloc(n * sizeof(int32_t));
+    srand(2);
+    for(int i=0; i<n; i++) {
+        input[i] = 2048 + (rand() % 64);
+    }
+
+    volatile int32_t sink = 0;
+    clock_t start;
+
+    filter_cic_t cic;
+    filter_cic_init(&cic, 3, 16);
+    start = clock();
+    for(int i=0; i<n; i++) {
+        if(filter_cic_add(&cic, input[i])) sink = cic.value;
+    }
+    double cic_ns = (double)(clock() - start) * 1e9 / CLOCKS_PER_SEC / n;
+
+    filter_ema_t ema;
+    filter_ema_init(&ema, 4);
+    start = clock();
+    for(int i=0; i<n; i++) {
+        sink = filter_ema_add(&ema, input[i]);
+    }
+    double ema_ns = (double)(clock() - start) * 1e9 / CLOCKS_PER_SEC / n;
+
+    filter_median_t median;
+    filter_median_init(&median, 5);
+    start = clock();
+    for(int i=0; i<n; i++) {
+        sink = filter_median_add(&median, input[i]);
+    }
+    double median_ns = (double)(clock() - start) * 1e9 / CLOCKS_PER_SEC / n;
+
+    filter_stats_t stats;
+    filter_stats_init(&stats, 256);
+    start = clock();
+    for(int i=0; i<n; i++) {
+        if(filter_stats_add(&stats, input[i])) sink = stats.mean;
+    }
+    double stats_ns = (double)(clock() - start) * 1e9 / CLOCKS_PER_SEC / n;
+
+    filter_outlier_t outlier;
+    filter_outlier_init(&outlier, 4, 4, 8, 4);
+    start = clock();
+    for(int i=0; i<n; i++) {
+        sink = filter_outlier_check(&outlier, input[i]);
+    }
+    double outlier_ns = (double)(clock() - start) * 1e9 / CLOCKS_PER_SEC / n;
+
+    (void)sink;
+    free(input);
+
+    printf("ns/sample: cic3 %.1f, ema %.1f, median5 %.1f, stats %.1f, outlier %.1f\n",
+        cic_ns, ema_ns, median_ns, stats_ns, outlier_ns);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_cic_boxcar),
+        cmocka_unit_test(test_cic_settles),
+        cmocka_unit_test(test_ema),
+        cmocka_unit_test(test_median),
+        cmocka_unit_test(test_stats),
+        cmocka_unit_test(test_outlier),
+        cmocka_unit_test(test_benchmark),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,290 @@
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <cmocka.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "drivers/comms/duart_echo.h"
+#include "protocols/hmi_serial/hmi_slots.h"
+
+// Simulates a shared HMI bus with several BMS nodes, each ticking every 20ms
+// at an arbitrary phase, to check the slot scheduling never lets two nodes
+// talk over each other and to measure the throughput it leaves us with. Both
+// ways of receiving requests are covered: polled from hmi_serial_tick, and
+// (HMI_SERIAL_RX_IRQ) handled from the RX IRQ while the main loop is idle.
+
+#define SIM_BAUD            460800
+#define SIM_TICK_US         20000
+#define SIM_BYTE_US         (10.0 * 1000000.0 / SIM_BAUD)
+#define SIM_REQUEST_BYTES   (8 + 4)   // READ_REGISTERS with a few registers
+#define SIM_RESPONSE_BYTES  (256 + 4) // biggest possible response
+#define SIM_FRAMES          50
+#define SIM_MAX_NODES       16
+#define SIM_RX_IDLE_CHARS   4         // DUART_RX_IDLE_CHARS
+
+typedef struct {
+    double start_us;
+    double end_us;
+    int node; // -1 for the HMI
+} transmission_t;
+
+typedef struct {
+    hmi_slots_t slots;
+    double phase_us;
+    // Time from the start of each tick until hmi_serial_tick runs
+    double busy_us;
+    uint32_t timestep_base;
+    bool pending;
+    int sent;
+} sim_node_t;
+
+typedef struct {
+    int collisions;
+    int delivered_bytes;
+    double duration_us;
+} sim_result_t;
+
+static transmission_t transmissions[SIM_FRAMES * (SIM_MAX_NODES + 1)];
+static int transmission_count;
+
+static uint32_t rng_state = 12345;
+static uint32_t sim_rand() {
+    rng_state = rng_state * 1103515245 + 12345;
+    return rng_state >> 8;
+}
+
+static void sim_transmit(double start_us, int bytes, int node) {
+    transmission_t *t = &transmissions[transmission_count++];
+    t->start_us = start_us;
+    t->end_us = start_us + bytes * SIM_BYTE_US;
+    t->node = node;
+}
+
+static bool sim_overlaps(const transmission_t *a, const transmission_t *b) {
+    return a->start_us < b->end_us && b->start_us < a->end_us;
+}
+
+static double sim_serial_tick_us(const sim_node_t *node, uint32_t k) {
+    return node->phase_us + k * (double)SIM_TICK_US + node->busy_us;
+}
+
+static sim_result_t simulate_bus(int node_count, bool slotted, bool rx_irq) {
+    sim_node_t nodes[SIM_MAX_NODES] = {0};
+    transmission_count = 0;
+
+    // Frame long enough for every node to get a slot
+    double frame_us = (double)node_count * HMI_SLOT_DEFAULT_TICKS * SIM_TICK_US;
+
+    for(int n = 0; n < node_count; n++) {
+        nodes[n].phase_us = sim_rand() % SIM_TICK_US;
+        nodes[n].busy_us = sim_rand() % (SIM_TICK_US / 2);
+        nodes[n].timestep_base = sim_rand();
+        if(slotted) {
+            hmi_slots_assign(&nodes[n].slots, n, node_count, HMI_SLOT_DEFAULT_TICKS);
+        }
+    }
+
+    for(int frame = 0; frame < SIM_FRAMES; frame++) {
+        // HMI polls at the start of each frame (after every node has started
+        // ticking), and every node has a full packet to send back.
+        double request_start_us = SIM_TICK_US + frame * frame_us;
+        double request_end_us = request_start_us + SIM_REQUEST_BYTES * SIM_BYTE_US;
+        sim_transmit(request_start_us, SIM_REQUEST_BYTES, -1);
+
+        for(int n = 0; n < node_count; n++) {
+            sim_node_t *node = &nodes[n];
+
+            // Work out which tick sees the request, and when it is handled
+            uint32_t k;
+            double handled_us;
+            if(rx_irq) {
+                // The RX IRQ fires once the line goes idle, but is held off
+                // until hmi_serial_tick if the main loop is still busy.
+                double rx_us = request_end_us + SIM_RX_IDLE_CHARS * SIM_BYTE_US;
+                k = (uint32_t)floor((rx_us - node->phase_us) / SIM_TICK_US);
+                handled_us = fmax(rx_us, sim_serial_tick_us(node, k));
+            } else {
+                // First tick after the request has been fully received
+                k = (uint32_t)ceil((request_end_us - node->phase_us - node->busy_us) / SIM_TICK_US);
+                handled_us = sim_serial_tick_us(node, k);
+            }
+            bool received = false;
+
+            for(;; k++) {
+                double tick_us = sim_serial_tick_us(node, k);
+                if(tick_us >= request_start_us + frame_us) {
+                    break;
+                }
+                uint32_t now = node->timestep_base + k;
+
+                // Same ordering as hmi_serial_tick: deferred send, then read
+                bool can_transmit = hmi_slots_can_transmit(&node->slots, now);
+                if(can_transmit && node->pending) {
+                    sim_transmit(tick_us, SIM_RESPONSE_BYTES, n);
+                    node->pending = false;
+                    node->sent++;
+                }
+                if(!received) {
+                    received = true;
+                    hmi_slots_sync(&node->slots, now);
+                    if(hmi_slots_can_transmit(&node->slots, now)) {
+                        sim_transmit(handled_us, SIM_RESPONSE_BYTES, n);
+                        node->sent++;
+                    } else {
+                        node->pending = true;
+                    }
+                }
+            }
+        }
+    }
+
+    sim_result_t result = {0};
+    result.duration_us = SIM_FRAMES * frame_us;
+    for(int i = 0; i < transmission_count; i++) {
+        bool collided = false;
+        for(int j = 0; j < transmission_count; j++) {
+            if(i != j && sim_overlaps(&transmissions[i], &transmissions[j])) {
+                collided = true;
+                break;
+            }
+        }
+        if(collided) {
+            result.collisions++;
+        } else if(transmissions[i].node >= 0) {
+            result.delivered_bytes += SIM_RESPONSE_BYTES - 4;
+        }
+    }
+
+    return result;
+}
+
+static void test_slots_unassigned(void **state) {
+    (void) state;
+    hmi_slots_t slots = {0};
+
+    // Without an assignment we can always transmit
+    for(uint32_t t = 0; t < 10; t++) {
+        assert_true(hmi_slots_can_transmit(&slots, t));
+    }
+
+    // Invalid assignments leave us unslotted
+    hmi_slots_assign(&slots, 4, 4, 2);
+    assert_int_equal(slots.slot_count, 0);
+    assert_true(hmi_slots_can_transmit(&slots, 1));
+}
+
+static void test_slots_window(void **state) {
+    (void) state;
+    hmi_slots_t slots = {0};
+
+    hmi_slots_assign(&slots, 2, 4, 3);
+    hmi_slots_sync(&slots, 1000);
+
+    // Only the first tick of slot 2 (ticks 6..8 of a 12 tick frame)
+    for(uint32_t t = 1000; t < 1024; t++) {
+        uint32_t position = (t - 1000) % 12;
+        assert_int_equal(hmi_slots_can_transmit(&slots, t), position == 6);
+    }
+
+    // Frame position survives the timestep wrapping around
+    hmi_slots_sync(&slots, 0xFFFFFFFE);
+    assert_true(hmi_slots_can_transmit(&slots, 0xFFFFFFFE + 6));
+    assert_false(hmi_slots_can_transmit(&slots, 0xFFFFFFFE + 7));
+
+    // Zero slot length falls back to the default
+    hmi_slots_assign(&slots, 1, 2, 0);
+    assert_int_equal(slots.slot_ticks, HMI_SLOT_DEFAULT_TICKS);
+}
+
+static void check_bus_slotted_no_collisions(bool rx_irq) {
+    printf("nodes  collisions  throughput (kbit/s)\n");
+    for(int node_count = 2; node_count <= SIM_MAX_NODES; node_count++) {
+        sim_result_t result = simulate_bus(node_count, true, rx_irq);
+        double kbps = result.delivered_bytes * 8.0 / result.duration_us * 1000.0;
+        printf("%5d  %10d  %8.1f\n", node_count, result.collisions, kbps);
+
+        assert_int_equal(result.collisions, 0);
+        // Every node gets its packet through every frame
+        assert_int_equal(result.delivered_bytes, node_count * SIM_FRAMES * (SIM_RESPONSE_BYTES - 4));
+    }
+}
+
+static void test_bus_slotted_no_collisions(void **state) {
+    (void) state;
+    check_bus_slotted_no_collisions(false);
+}
+
+static void test_bus_slotted_rx_irq_no_collisions(void **state) {
+    (void) state;
+    check_bus_slotted_no_collisions(true);
+}
+
+static void test_bus_unslotted_collides(void **state) {
+    (void) state;
+
+    // Without slots, everyone answers within a tick of the request and the
+    // bus is unusable.
+    assert_true(simulate_bus(8, false, false).collisions > 0);
+    assert_true(simulate_bus(8, false, true).collisions > 0);
+}
+
+static void test_echo_own_packet(void **state) {
+    (void) state;
+    duart_echo_queue_t q;
+    duart_echo_init(&q);
+
+    // Our packet comes back intact and is swallowed
+    duart_echo_push(&q, 10, 0x1234, 1000);
+    assert_false(duart_echo_match(&q, 10, 0x4321));
+    assert_true(duart_echo_match(&q, 10, 0x1234));
+    assert_int_equal(q.count, 0);
+
+    // Our packet comes back mangled, which is a collision
+    duart_echo_push(&q, 10, 0x1234, 1000);
+    assert_true(duart_echo_corrupt(&q, 10));
+    assert_int_equal(q.count, 0);
+
+    // Our packet never comes back
+    duart_echo_push(&q, 10, 0x1234, 1000);
+    assert_int_equal(duart_echo_expire(&q, 1000 + DUART_ECHO_TIMEOUT_MS), 0);
+    assert_int_equal(duart_echo_expire(&q, 1001 + DUART_ECHO_TIMEOUT_MS), 1);
+    assert_int_equal(q.count, 0);
+}
+
+static void test_echo_third_node_corrupt(void **state) {
+    (void) state;
+    duart_echo_queue_t q;
+    duart_echo_init(&q);
+
+    // Two other nodes collide while our echo is outstanding. That isn't our
+    // collision, and our own packet still arrives afterwards.
+    duart_echo_push(&q, 10, 0x1234, 1000);
+    assert_false(duart_echo_corrupt(&q, 200));
+    assert_int_equal(q.count, 1);
+    assert_true(duart_echo_match(&q, 10, 0x1234));
+
+    // No echo outstanding at all
+    assert_false(duart_echo_corrupt(&q, 10));
+
+    // If ours was mangled beyond recognition too, it's counted once it times
+    // out instead.
+    duart_echo_push(&q, 10, 0x1234, 1000);
+    assert_false(duart_echo_corrupt(&q, 200));
+    assert_int_equal(duart_echo_expire(&q, 1001 + DUART_ECHO_TIMEOUT_MS), 1);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_slots_unassigned),
+        cmocka_unit_test(test_slots_window),
+        cmocka_unit_test(test_bus_slotted_no_collisions),
+        cmocka_unit_test(test_bus_slotted_rx_irq_no_collisions),
+        cmocka_unit_test(test_bus_unslotted_collides),
+        cmocka_unit_test(test_echo_own_packet),
+        cmocka_unit_test(test_echo_third_node_corrupt),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,82 @@
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <cmocka.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "app/model.h"
+#include "app/battery/overcurrent_trip.h"
+#include "config/limits.h"
+
+static void test_shunt_limit(void **state) {
+    (void) state;
+
+    // 100A through the 25µΩ shunt is 2.5mV, or 2026 LSBs of 1.25µV
+    assert_int_equal(overcurrent_trip_shunt_limit(1000, 0), 2026);
+    assert_int_equal(overcurrent_trip_shunt_limit(-1000, 0), -2026);
+
+    // The offset is in the shunt voltage, so shifts both limits
+    assert_int_equal(overcurrent_trip_shunt_limit(1000, 4000), 2046);
+    assert_int_equal(overcurrent_trip_shunt_limit(-1000, 4000), -2006);
+
+    // Beyond the register's range
+    assert_int_equal(overcurrent_trip_shunt_limit(200000, 0), INT16_MAX);
+    assert_int_equal(overcurrent_trip_shunt_limit(-200000, 0), INT16_MIN);
+}
+
+static void test_follows_limits(void **state) {
+    (void) state;
+
+    bms_model_t model = {0};
+    overcurrent_trip_t trip = {0};
+    millis_t now = 1000;
+
+    // Well above large limits, and a margin above small ones
+    model.charge_current_limit_dA = 1000;
+    model.discharge_current_limit_dA = 100;
+    assert_true(overcurrent_trip_update(&trip, &model, now));
+    assert_int_equal(trip.charge_trip_dA, 1000 * OVERCURRENT_TRIP_PERCENT / 100);
+    assert_int_equal(trip.discharge_trip_dA, 100 + OVERCURRENT_TRIP_MARGIN_dA);
+    assert_int_equal(trip.sovl, overcurrent_trip_shunt_limit(trip.charge_trip_dA, 0));
+    assert_int_equal(trip.suvl, overcurrent_trip_shunt_limit(-trip.discharge_trip_dA, 0));
+
+    // Until they've been programmed, they're asked for again
+    assert_true(overcurrent_trip_update(&trip, &model, now));
+    trip.programmed = true;
+    now += 20;
+    assert_false(overcurrent_trip_update(&trip, &model, now));
+
+    // Falling limits are followed slowly
+    model.charge_current_limit_dA = 0;
+    int32_t from_dA = trip.charge_trip_dA;
+    for(int i=0; i<50; i++) {
+        now += 20;
+        if(overcurrent_trip_update(&trip, &model, now)) {
+            trip.programmed = true;
+        }
+    }
+    int32_t fallen_dA = from_dA - trip.charge_trip_dA;
+    assert_in_range(fallen_dA, OVERCURRENT_TRIP_FALL_dA_PER_S - 20, OVERCURRENT_TRIP_FALL_dA_PER_S);
+    for(int i=0; i<1000; i++) {
+        now += 20;
+        overcurrent_trip_update(&trip, &model, now);
+    }
+    assert_int_equal(trip.charge_trip_dA, OVERCURRENT_TRIP_MARGIN_dA);
+
+    // ...but rising ones immediately, and reprogrammed
+    trip.programmed = true;
+    now += 20;
+    model.discharge_current_limit_dA = 800;
+    assert_true(overcurrent_trip_update(&trip, &model, now));
+    assert_int_equal(trip.discharge_trip_dA, 800 * OVERCURRENT_TRIP_PERCENT / 100);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_shunt_limit),
+        cmocka_unit_test(test_follows_limits),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,129 @@
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <cmocka.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib/rainflow.h"
+
+// Feeds a ramp from the last value to the next, with a little noise
+static int32_t ramp_to(rainflow_t *rf, rainflow_histogram_t *hist, int32_t from, int32_t to) {
+    int32_t step = to > from ? 50 : -50;
+    for(int32_t v = from + step; v != to; v += step) {
+        rainflow_add(rf, hist, v + (rand() % 21) - 10, 250);
+    }
+    rainflow_add(rf, hist, to, 250);
+    return to;
+}
+
+// Half cycles at each depth bin, summed over mean and temperature
+static void depth_counts(const rainflow_histogram_t *hist, int counts[RAINFLOW_DEPTH_BINS]) {
+    for(int d=0; d<RAINFLOW_DEPTH_BINS; d++) {
+        counts[d] = 0;
+        for(int m=0; m<RAINFLOW_MEAN_BINS; m++) {
+            for(int t=0; t<RAINFLOW_TEMPERATURE_BINS; t++) {
+                counts[d] += hist->bins[d][m][t];
+            }
+        }
+    }
+}
+
+static void test_astm_example(void **state) {
+    (void) state;
+
+    // The example from ASTM E1049 (-2, 1, -3, 5, -1, 3, -4, 4, -2), scaled
+    // onto 0-10000
+    const int32_t points[] = {-2, 1, -3, 5, -1, 3, -4, 4, -2};
+    rainflow_t rf;
+    rainflow_histogram_t hist = {0};
+    rainflow_init(&rf, 100, 10000);
+    srand(1);
+
+    int32_t v = (points[0] + 5) * 1000;
+    rainflow_add(&rf, &hist, v, 250);
+    for(int i=1; i<9; i++) {
+        v = ramp_to(&rf, &hist, v, (points[i] + 5) * 1000);
+    }
+    rainflow_flush(&rf, &hist);
+
+    // Expected: range 3 x0.5, 4 x1.5, 6 x0.5, 8 x1, 9 x0.5
+    int counts[RAINFLOW_DEPTH_BINS];
+    depth_counts(&hist, counts);
+    const int expected[RAINFLOW_DEPTH_BINS] = {0, 0, 0, 1, 3, 0, 1, 0, 2, 1};
+    for(int d=0; d<RAINFLOW_DEPTH_BINS; d++) {
+        assert_int_equal(counts[d], expected[d]);
+    }
+}
+
+static void test_bins(void **state) {
+    (void) state;
+
+    rainflow_t rf;
+    rainflow_histogram_t hist = {0};
+    rainflow_init(&rf, 100, 10000);
+
+    // Repeated 20% swings around 70%, cold. Equal swings never enclose one
+    // another, so each reversal closes a half cycle.
+    rainflow_add(&rf, &hist, 6000, 50);
+    for(int i=0; i<10; i++) {
+        rainflow_add(&rf, &hist, 8000, 50);
+        rainflow_add(&rf, &hist, 6000, 50);
+    }
+    assert_int_equal(hist.bins[2][3][0], 18);
+
+    // A small cycle inside a big swing is a full cycle, closed once the
+    // signal passes back through it
+    memset(&hist, 0, sizeof(hist));
+    rainflow_init(&rf, 100, 10000);
+    rainflow_add(&rf, &hist, 1000, 300);
+    rainflow_add(&rf, &hist, 9000, 300);
+    rainflow_add(&rf, &hist, 5000, 300);
+    rainflow_add(&rf, &hist, 6000, 300);
+    assert_false(rainflow_add(&rf, &hist, 2000, 300));
+    assert_true(rainflow_add(&rf, &hist, 3000, 300));
+    assert_int_equal(hist.bins[1][2][2], 2);
+
+    // Noise within the hysteresis isn't counted
+    rainflow_init(&rf, 100, 10000);
+    memset(&hist, 0, sizeof(hist));
+    for(int i=0; i<1000; i++) {
+        assert_false(rainflow_add(&rf, &hist, 5000 + (i & 1) * 99, 450));
+    }
+    rainflow_flush(&rf, &hist);
+    assert_int_equal(hist.bins[0][2][3], 0);
+}
+
+static void test_bounded_stack(void **state) {
+    (void) state;
+
+    // Ever-narrowing swings never close a cycle, so would grow the residue
+    // without bound
+    rainflow_t rf;
+    rainflow_histogram_t hist = {0};
+    rainflow_init(&rf, 10, 10000);
+    for(int i=0; i<200; i++) {
+        int32_t swing = 4000 - 19 * i;
+        rainflow_add(&rf, &hist, 5000 + ((i & 1) ? swing : -swing), 250);
+    }
+    assert_int_equal(rf.count, RAINFLOW_STACK_SIZE);
+
+    // The dropped points were counted as half cycles
+    int counts[RAINFLOW_DEPTH_BINS];
+    depth_counts(&hist, counts);
+    int total = 0;
+    for(int d=0; d<RAINFLOW_DEPTH_BINS; d++) total += counts[d];
+    assert_true(total > 0);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_astm_example),
+        cmocka_unit_test(test_bins),
+        cmocka_unit_test(test_bounded_stack),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -6,10 +6,21 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <math.h>
+#include <stdlib.h>
 
 #include "app/model.h"
+#include "app/estimators/current_history.h"
 #include "app/estimators/ekf.h"
+#include "app/estimators/ocv.h"
+#include "app/estimators/runtime.h"
+#include "app/estimators/soh.h"
+#include "app/battery/state_of_power.h"
+#include "config/limits.h"
+#include "config/settings.h"
+#include "app/monitoring/counters.h"
+#include "app/monitoring/energy.h"
 #include "protocols/inverter/inverter.h"
+#include "physical_model.h"
 
 // Mock globals
 millis_t stored_millis = 0;
@@ -27,11 +38,30 @@ struct can2040_msg {
     uint8_t data[8];
 };
 
+#define CAN2040_NOTIFY_RX (1<<20)
+
 struct can2040_msg last_transmit_msg;
+// Number of upcoming transmits to reject, as if the TX queue were full
+int transmit_failures = 0;
+// Log of accepted transmits
+uint32_t transmit_ids[1024];
+uint32_t transmit_timesteps[1024];
+int transmit_count = 0;
+
 int can2040_transmit(struct can2040 *cd, struct can2040_msg *msg) {
     (void)cd;
+    if(transmit_failures > 0) {
+        transmit_failures--;
+        return -1;
+    }
+
     // Store the last transmitted message for inspection
     last_transmit_msg = *msg;
+    if(transmit_count < 1024) {
+        transmit_ids[transmit_count] = msg->id;
+        transmit_timesteps[transmit_count] = stored_timestep;
+        transmit_count++;
+    }
 
     // check_expected(msg->id);
     // for (int i = 0; i < msg->dlc; i++) {
@@ -42,8 +72,16 @@ int can2040_transmit(struct can2040 *cd, struct can2040_msg *msg) {
 
 void can2040_setup(struct can2040 *cd, uint32_t pio_num) { (void)cd; (void)pio_num; }
 void can2040_start(struct can2040 *cd, uint32_t sys_clock, uint32_t bitrate, uint32_t gpio_rx, uint32_t gpio_tx) { (void)cd; (void)sys_clock; (void)bitrate; (void)gpio_rx; (void)gpio_tx; }
-void can2040_callback_config(struct can2040 *cd, void (*cb)(struct can2040 *, uint32_t, struct can2040_msg *)) { (void)cd; (void)cb; }
+static void (*can_callback)(struct can2040 *, uint32_t, struct can2040_msg *);
+void can2040_callback_config(struct can2040 *cd, void (*cb)(struct can2040 *, uint32_t, struct can2040_msg *)) { (void)cd; can_callback = cb; }
 void can2040_pio_irq_handler(struct can2040 *cd) { (void)cd; }
+struct can2040_stats {
+    uint32_t rx_total, tx_total;
+    uint32_t tx_attempt;
+    uint32_t parse_error;
+};
+void can2040_get_statistics(struct can2040 *cd, struct can2040_stats *stats) { (void)cd; *stats = (struct can2040_stats){0}; }
+uint32_t time_us_32(void) { return stored_millis * 1000; }
 
 // Mock pico/stdlib.h functions
 void gpio_init(uint32_t gpio) { (void)gpio; }
@@ -51,9 +89,20 @@ void gpio_set_dir(uint32_t gpio, bool out) { (void)gpio; (void)out; }
 void gpio_set_function(uint32_t gpio, uint32_t fn) { (void)gpio; (void)fn; }
 uint32_t stdio_getchar_timeout_us(uint32_t us) { (void)us; return 0xFF; }
 
+// Mock NVM for the SoH engine
+int soh_saves = 0;
+bool nvm_save_soh(const soh_state_t *state) { (void)state; soh_saves++; return true; }
+bool nvm_load_soh(soh_state_t *state) { (void)state; return false; }
+
+// Mock NVM for the energy totals
+int energy_saves = 0;
+bool nvm_save_energy(const energy_totals_t *totals) { (void)totals; energy_saves++; return true; }
+bool nvm_load_energy(energy_totals_t *totals) { (void)totals; return false; }
+
 // External model from model.c
 extern bms_model_t model;
 
+#if CHEMISTRY == NMC
 static void test_ekf_soc_scaling(void **state) {
     (void) state;
     
@@ -71,7 +120,7 @@ static void test_ekf_soc_scaling(void **state) {
 
     // Initialize EKF with a voltage that corresponds to some SoC
     // E.g. 3.7V is roughly 50% SoC
-    uint32_t soc_out = ekf_tick(0, 0, 3700); 
+    uint32_t soc_out = ekf_tick(&ekf_tracker, &model, 0, 0, 3700); 
 
     // Without scaling, we expect soc_out to be in the vicinity of 5000 (50.00%)
     assert_greater(soc_out, 4000); // >40.00%
@@ -79,6 +128,8 @@ static void test_ekf_soc_scaling(void **state) {
 
 }
 
+#endif
+
 static void test_inverter_soc_scaling(void **state) {
     (void) state;
     
@@ -120,10 +171,892 @@ static void test_inverter_soc_scaling(void **state) {
     // So I have to call inverter_tick.
 }
 
+static void receive_inverter_status() {
+    struct can2040_msg msg = {
+        .id = 0x091,
+        .dlc = 8,
+        .data = {0x0F, 0xA0, 0x00, 0x64, 0x00, 0xFA, 0x00, 0x00}, // 400.0V, 10.0A, 25.0C
+    };
+    can_callback(NULL, CAN2040_NOTIFY_RX, &msg);
+}
+
+static void inverter_run_ticks(int ticks) {
+    for(int i=0; i<ticks; i++) {
+        stored_timestep++;
+        stored_millis += 20;
+        if((stored_timestep % 50) == 0) {
+            receive_inverter_status();
+        }
+        inverter_tick(&model);
+    }
+}
+
+static void test_inverter_schedule(void **state) {
+    (void) state;
+
+    for(int i=0; i<sizeof(bms_model_t); i++) ((uint8_t*)&model)[i] = 0;
+    model.soc_millis = 1000;
+    model.battery_voltage_millis = 1000;
+    model.current_millis = 1000;
+    model.temperature_millis = 1000;
+    model.contactor_sm.enable_current = true;
+    stored_millis = 1000;
+    stored_timestep = 0;
+
+    init_inverter();
+
+    // Frames for other devices are dropped by the acceptance filter
+    struct can2040_msg other = { .id = 0x300, .dlc = 8 };
+    can_callback(NULL, CAN2040_NOTIFY_RX, &other);
+    assert_int_equal(debug_counters.can_rx_filtered, 1);
+
+    receive_inverter_status();
+
+    // The init sequence goes out first, even if the TX queue is briefly full
+    transmit_failures = 2;
+    inverter_run_ticks(3);
+    assert_int_equal(model.inverter_voltage_mV, 400000);
+    assert_int_equal(model.inverter_current_mA, 10000);
+    assert_int_equal(model.inverter_temperature_dC, 250);
+    assert_int_equal(transmit_count, 7);
+    assert_int_equal(transmit_ids[0], 0x250);
+    assert_int_equal(transmit_ids[6], 0x3D0);
+
+    transmit_count = 0;
+    inverter_run_ticks(1000);
+
+    // 0x110 goes out exactly every 100ms, and the slow frames never share
+    // its tick
+    int count_110 = 0, count_150 = 0;
+    uint32_t last_110 = 0;
+    for(int i=0; i<transmit_count; i++) {
+        if(transmit_ids[i] == 0x110) {
+            if(count_110 > 0) {
+                assert_int_equal(transmit_timesteps[i] - last_110, 5);
+            }
+            last_110 = transmit_timesteps[i];
+            count_110++;
+        } else {
+            assert_int_not_equal(transmit_timesteps[i] % 5, last_110 % 5);
+            if(transmit_ids[i] == 0x150) count_150++;
+        }
+    }
+    assert_int_equal(count_110, 200);
+    assert_int_equal(count_150, 2);
+
+    // A full TX queue delays 0x110 by a tick, but the next one is back on
+    // schedule
+    while(((stored_timestep + 1) % 5) != (last_110 % 5)) {
+        inverter_run_ticks(1);
+    }
+    transmit_count = 0;
+    transmit_failures = 1;
+    inverter_run_ticks(6);
+    int retried = -1, next = -1;
+    for(int i=0; i<transmit_count; i++) {
+        if(transmit_ids[i] != 0x110) continue;
+        if(retried < 0) retried = i; else if(next < 0) next = i;
+    }
+    assert_true(retried >= 0 && next >= 0);
+    assert_int_equal(transmit_timesteps[retried] % 5, (last_110 + 1) % 5);
+    assert_int_equal(transmit_timesteps[next] % 5, last_110 % 5);
+
+    // The retried frame was a tick late, the one after it on time
+    uint32_t id, sent, dropped, jitter_ms, jitter_max_ms;
+    assert_true(inverter_get_tx_frame_stats(0, &id, &sent, &dropped, &jitter_ms, &jitter_max_ms));
+    assert_int_equal(id, 0x110);
+    assert_int_equal(dropped, 0);
+    assert_int_equal(jitter_ms, 0);
+    assert_int_equal(jitter_max_ms, TIMESTEP_PERIOD_MS);
+}
+
+#if CHEMISTRY == NMC
+static void test_ocv_inverse(void **state) {
+    (void) state;
+
+    // Ends of the curve
+    assert_int_equal(ocv_mV_to_soc(2000, 250), 0);
+    assert_int_equal(ocv_mV_to_soc(4300, 250), 10000);
+
+    // Knots of the curve land on whole percentages
+    assert_in_range(ocv_to_soc(3100319, 250), 99, 101);
+    assert_in_range(ocv_to_soc(3691444, 250), 4995, 5005);
+    assert_in_range(ocv_to_soc(4098163, 250), 9195, 9205);
+    // Halfway between two knots
+    assert_in_range(ocv_to_soc((3691444 + 3697044) / 2, 250), 5045, 5055);
+
+    // And back again
+    assert_int_equal(ocv_from_soc(5000, 250), 3691444);
+    assert_int_equal(ocv_from_soc(5050, 250), (3691444 + 3697044) / 2);
+    // 3.69704364 - 3.69144414 V per percent
+    assert_int_equal(ocv_slope(5050, 250), 5600);
+
+    // Monotonic, and round trips
+    uint16_t last = 0;
+    for(int32_t mV = 2400; mV <= 4300; mV++) {
+        uint16_t soc = ocv_mV_to_soc(mV, 250);
+        assert_true(soc >= last);
+        last = soc;
+    }
+    assert_int_equal(last, 10000);
+    for(uint16_t soc = 100; soc <= 10000; soc += 37) {
+        assert_in_range(ocv_to_soc(ocv_from_soc(soc, 250), 250), soc - 5, soc + 5);
+    }
+}
+
+#endif
+
+static void test_ocv_temperature(void **state) {
+    (void) state;
+
+    // A made-up curve that's 100mV lower at 0C than at 40C
+    static const int16_t temperatures_dC[] = { 0, 400 };
+    static int32_t ocv_uV[2][OCV_SOC_POINTS];
+    static uint16_t inverse[2 * 1001];
+    for(int i=0; i<OCV_SOC_POINTS; i++) {
+        ocv_uV[0][i] = 3000000 + i * 10000;
+        ocv_uV[1][i] = 3100000 + i * 10000;
+    }
+    ocv_table_t table = {
+        .temperature_points = 2,
+        .temperatures_dC = temperatures_dC,
+        .ocv_uV = &ocv_uV[0][0],
+        .inverse_min_uV = 3000000,
+        .inverse_step_uV = 1000,
+        .inverse_points = 1001,
+        .inverse = inverse,
+    };
+
+    assert_int_equal(ocv_table_from_soc(&table, 5000, 0), 3500000);
+    assert_int_equal(ocv_table_from_soc(&table, 5000, 400), 3600000);
+    assert_int_equal(ocv_table_from_soc(&table, 5000, 200), 3550000);
+    // Clamped beyond the ends of the table
+    assert_int_equal(ocv_table_from_soc(&table, 5000, -200), 3500000);
+    assert_int_equal(ocv_table_from_soc(&table, 5000, 600), 3600000);
+    assert_int_equal(ocv_table_slope(&table, 5000, 100), 10000);
+
+    assert_in_range(ocv_table_to_soc(&table, 3500000, 0), 4999, 5001);
+    assert_in_range(ocv_table_to_soc(&table, 3500000, 400), 3999, 4001);
+    assert_in_range(ocv_table_to_soc(&table, 3550000, 200), 4999, 5001);
+}
+
+#if CHEMISTRY == NMC
+static void test_ocv_scaling_cache(void **state) {
+    (void) state;
+
+    ocv_scaling_t a = {0}, b = {0};
+    assert_true(ocv_scaling_update(&a, 3100, 4100));
+    assert_false(ocv_scaling_update(&a, 3100, 4100));
+    // A different range elsewhere doesn't disturb the first
+    assert_true(ocv_scaling_update(&b, 3300, 4000));
+    assert_false(ocv_scaling_update(&a, 3100, 4100));
+
+    assert_int_equal(ocv_to_soc_scaled(&a, 3100000, 250), 0);
+    assert_int_equal(ocv_to_soc_scaled(&a, 4100000, 250), 10000);
+    assert_int_equal(ocv_to_soc_scaled(&b, 4000000, 250), 10000);
+    assert_in_range(ocv_to_soc_scaled(&a, 3700000, 250), 4000, 6000);
+}
+
+#endif
+
+#if CHEMISTRY == LFP
+// A simulated LFP cell, using the same OCV curve as the estimator but with
+// more hysteresis than it assumes, plus polarisation, series resistance and
+// measurement noise.
+typedef struct {
+    float soc;
+    float capacity_Ah;
+    float v_h;
+    float v_c1;
+} sim_cell_t;
+
+static float sim_cell_step(sim_cell_t *cell, float current_A) {
+    const float R0 = 0.02f, R1 = 0.03f, C1 = 2000.0f, M = 0.02f;
+    float charge_Ah = current_A / 3600.0f;
+    cell->soc += charge_Ah / cell->capacity_Ah;
+
+    float decay = expf(-20.0f * fabsf(charge_Ah) / cell->capacity_Ah);
+    if(current_A != 0.0f) {
+        cell->v_h = cell->v_h * decay + (current_A > 0 ? M : -M) * (1.0f - decay);
+    }
+    float exp_val = expf(-1.0f / (R1 * C1));
+    cell->v_c1 = cell->v_c1 * exp_val - current_A * R1 * (1.0f - exp_val);
+
+    float noise = ((rand() % 2001) - 1000) / 1000000.0f * 3.0f; // +/-3mV
+    float ocv = ocv_from_soc((uint16_t)(cell->soc * 10000.0f), 250) / 1000000.0f;
+    return ocv + cell->v_h - cell->v_c1 + current_A * R0 + noise;
+}
+
+// Discharges the simulated cell down to end_soc, stepping the filter once a
+// second. Returns the largest SoC error seen while on the plateau.
+static float sim_discharge(EKF *ekf, sim_cell_t *cell, float current_A, float end_soc) {
+    float worst_plateau_error = 0.0f;
+    while(cell->soc > end_soc) {
+        float v = sim_cell_step(cell, current_A);
+        ekf_step(ekf, current_A / 3600.0f, current_A, v);
+        float error = fabsf(ekf_get_soc(ekf) - cell->soc);
+        if(cell->soc > 0.25f && cell->soc < 0.85f && error > worst_plateau_error) {
+            worst_plateau_error = error;
+        }
+    }
+    return worst_plateau_error;
+}
+
+static void test_lfp_plateau(void **state) {
+    (void) state;
+
+    // Starting from a known SoC, the plateau shouldn't pull the estimate away
+    // from the coulomb count
+    srand(3);
+    sim_cell_t cell = { .soc = 0.9f, .capacity_Ah = 50.0f };
+    EKF ekf;
+    ekf_init(&ekf, 0.9f, 50.0f);
+    // As uncertain as a start from the voltage on the plateau would be
+    ekf.P[0][0] = 25.0f;
+    assert_true(ekf.hysteresis_V > 0.0f);
+    float error = sim_discharge(&ekf, &cell, -10.0f, 0.3f);
+    printf("LFP plateau: worst error %.2f%% (hysteresis %.1fmV, R %.3f)\n",
+        error * 100.0f, ekf.x[3] * 1000.0f, ekf.R_effective);
+    assert_true(error < 0.03f);
+
+    // Whereas treating it like NMC gets thrown around by the hysteresis
+    srand(3);
+    cell = (sim_cell_t){ .soc = 0.9f, .capacity_Ah = 50.0f };
+    ekf_init(&ekf, 0.9f, 50.0f);
+    ekf.P[0][0] = 25.0f;
+    ekf.hysteresis_V = 0.0f;
+    ekf.flat_slope = 0.0f;
+    float plain_error = sim_discharge(&ekf, &cell, -10.0f, 0.3f);
+    printf("LFP plateau without hysteresis model: worst error %.2f%%\n", plain_error * 100.0f);
+    assert_true(plain_error > error * 2);
+}
+
+static void test_lfp_knee_correction(void **state) {
+    (void) state;
+
+    // Starting 10% out, the estimate should stay put across the plateau and
+    // then be pulled in at the lower knee
+    srand(4);
+    sim_cell_t cell = { .soc = 0.6f, .capacity_Ah = 50.0f };
+    EKF ekf;
+    ekf_init(&ekf, 0.7f, 50.0f);
+    ekf.P[0][0] = 25.0f;
+    float plateau_error = sim_discharge(&ekf, &cell, -10.0f, 0.3f);
+    printf("LFP knee: error on plateau %.2f%%\n", plateau_error * 100.0f);
+    assert_true(plateau_error < 0.12f);
+
+    sim_discharge(&ekf, &cell, -10.0f, 0.05f);
+    float final_error = fabsf(ekf_get_soc(&ekf) - cell.soc);
+    printf("LFP knee: error at 5%% SoC %.2f%%\n", final_error * 100.0f);
+    assert_true(final_error < 0.02f);
+}
+#endif
+
+static void test_current_history(void **state) {
+    (void) state;
+
+    current_history_reset();
+    int32_t current_mA;
+    assert_false(current_history_at(1000, &current_mA));
+
+    // Readings either side of the microsecond counter wrapping
+    const micros_t t0 = 0xFFFFFFFFu - 400000;
+    current_history_add(10000, t0);
+    current_history_add(20000, t0 + 530000);
+    current_history_add(-10000, t0 + 1060000);
+
+    // Interpolated between readings
+    assert_true(current_history_at(t0 + 265000, &current_mA));
+    assert_int_equal(current_mA, 15000);
+    assert_true(current_history_at(t0 + 795000, &current_mA));
+    assert_int_equal(current_mA, 5000);
+
+    // Held for a while after the newest
+    assert_true(current_history_at(t0 + 1200000, &current_mA));
+    assert_int_equal(current_mA, -10000);
+    assert_false(current_history_at(t0 + 2000000, &current_mA));
+
+    // Too old
+    assert_false(current_history_at(t0 - 1000, &current_mA));
+}
+
+static void test_soh_capacity(void **state) {
+    (void) state;
+
+    for(int i=0; i<sizeof(bms_model_t); i++) ((uint8_t*)&model)[i] = 0;
+    model.nameplate_capacity_mC = 100 * 3600 * 1000; // 100Ah
+    soh_reset();
+    assert_int_equal(soh_capacity_health(model.nameplate_capacity_mC), 10000);
+
+    // A 90Ah pack discharged from 90% to 30%
+    const int64_t ah = 3600 * 1000;
+    assert_false(soh_add_rest(9000, 5000, 0, 1000));
+    // Rests on the flat part of the curve are ignored
+    assert_false(soh_add_rest(6000, 500, -27 * ah, 2000));
+    // Too small a swing keeps the first rest to pair with later
+    assert_false(soh_add_rest(8000, 5000, -9 * ah, 3000));
+    assert_true(soh_add_rest(3000, 5000, -54 * ah, 4000));
+    assert_int_equal(soh_state.capacity_mC, 90 * ah);
+    assert_int_equal(soh_capacity_health(model.nameplate_capacity_mC), 9000);
+
+    // A partial charge estimate is blended in, weighted by its swing
+    assert_true(soh_add_rest(5000, 5000, -54 * ah + 17 * ah, 5000));
+    assert_int_equal(soh_state.capacity_mC, (90 * 3600 + 85 * 400) * ah / 4000);
+
+    // A nonsense estimate (eg, after the counter was reset) is discarded
+    assert_false(soh_add_rest(9000, 5000, -54 * ah, 6000));
+    assert_int_equal(soh_state.capacity_count, 2);
+
+    // Rests too far apart aren't paired
+    soh_add_rest(5000, 5000, 0, 7000);
+    assert_false(soh_add_rest(9000, 5000, 40 * ah, 7000 + 4 * 24 * 3600 * 1000u));
+    assert_int_equal(soh_state.capacity_count, 2);
+}
+
+static void test_soh_resistance(void **state) {
+    (void) state;
+
+    soh_reset();
+    assert_int_equal(soh_resistance_growth(), 10000);
+
+    // 50mOhm pack, stepping between 0A and 20A charge
+    millis_t t = 1000;
+    for(int i=0; i<20; i++) {
+        soh_add_sample(50000, 0, t);
+        t += 200;
+        assert_true(soh_add_sample(51000, 20000, t));
+        t += 200;
+    }
+    assert_int_equal(soh_state.resistance_uOhm, 50000);
+    assert_int_equal(soh_state.resistance_new_uOhm, 50000);
+
+    // Small steps, and samples too far apart, are ignored
+    assert_false(soh_add_sample(51010, 19000, t));
+    t += 5000;
+    assert_false(soh_add_sample(50000, 0, t));
+
+    // It ages to 60mOhm
+    for(int i=0; i<400; i++) {
+        t += 200;
+        soh_add_sample(48800, -20000, t);
+        t += 200;
+        soh_add_sample(50000, 0, t);
+    }
+    assert_in_range(soh_state.resistance_uOhm, 59000, 60000);
+    assert_in_range(soh_resistance_growth(), 11800, 12000);
+}
+
+static void test_soh_tick(void **state) {
+    (void) state;
+
+    for(int i=0; i<sizeof(bms_model_t); i++) ((uint8_t*)&model)[i] = 0;
+    model.nameplate_capacity_mC = 100 * 3600 * 1000; // 100Ah
+    soh_reset();
+    soh_init(&model);
+    assert_int_equal(model.capacity_mC, model.nameplate_capacity_mC);
+    assert_int_equal(model.soh, 10000);
+
+    // Find two points on the steep ends of the curve
+    uint16_t high_soc = 9800, low_soc = 300;
+    assert_true(ocv_slope(high_soc, 250) >= 2000);
+    assert_true(ocv_slope(low_soc, 250) >= 2000);
+
+    const int64_t ah = 3600 * 1000;
+    const int64_t capacity_mC = 80 * ah;
+    int64_t charge_mC = 0;
+    stored_millis = 1000;
+    int saves = soh_saves;
+
+    // Rest, discharge, rest, then start charging
+    uint16_t socs[] = {high_soc, low_soc, low_soc};
+    int32_t currents[] = {0, 0, 10000};
+    for(int phase=0; phase<3; phase++) {
+        if(phase == 1) {
+            // Discharge at 40A
+            model.current_mA = -40000;
+            int64_t to_go = capacity_mC * (high_soc - low_soc) / 10000;
+            while(to_go > 0) {
+                stored_millis += 1000;
+                charge_mC -= 40000;
+                to_go -= 40000;
+                soh_tick(&model, charge_mC);
+            }
+        }
+        model.current_mA = currents[phase];
+        model.cell_voltage_total_mV = ocv_from_soc(socs[phase], 250) / 1000 * NUM_CELLS;
+        model.cell_voltage_millis = stored_millis;
+        for(int i=0; i<3600; i++) {
+            stored_millis += 1000;
+            soh_tick(&model, charge_mC);
+        }
+    }
+
+    assert_int_equal(soh_state.capacity_count, 1);
+    assert_in_range(model.capacity_mC, 79 * ah, 81 * ah);
+    assert_in_range(model.soh, 7900, 8100);
+    assert_true(soh_saves > saves);
+    assert_true(model.ignore_missed_deadline);
+
+    // The working capacity is derated
+    ekf_tick(&ekf_tracker, &model, 0, 0, ocv_from_soc(5000, 250) / 1000);
+    ocv_scaling_t scaling = {0};
+    ocv_scaling_update(&scaling, CELL_VOLTAGE_WORKING_MIN_mV, CELL_VOLTAGE_WORKING_MAX_mV);
+    assert_int_equal(model.working_capacity_mC,
+        (uint64_t)(scaling.soc_max - scaling.soc_min) * model.capacity_mC / 10000);
+}
+
+static void test_rc_identification(void **state) {
+    (void) state;
+
+    // A cell quite unlike the EKF's defaults (R0 20mOhm, R1 30mOhm, 60s), whose
+    // voltage is only seen to the nearest mV
+    const float R0 = 0.005f, R1 = 0.01f, C1 = 3000.0f;
+    for(int i=0; i<sizeof(bms_model_t); i++) ((uint8_t*)&model)[i] = 0;
+    battery_model_t bat = {
+        .capacity_Ah = 100.0f,
+        .soc = 0.5f,
+        .internal_resistance_Ohm = R0,
+        .polarization_resistance_Ohm = R1,
+        .polarization_capacitance_F = C1,
+        .quiet = true,
+    };
+    EKF ekf;
+    ekf_init(&ekf, 0.5f, 100.0f);
+
+    // Random steps in current, every minute and a half
+    srand(5);
+    const float currents[] = {-50.0f, -20.0f, 0.0f, 10.0f, 30.0f, 40.0f, -10.0f};
+    float current_A = 0.0f;
+    for(int t=0; t<4*3600; t++) {
+        if(t % 90 == 0) {
+            current_A = currents[rand() % 7];
+        }
+        battery_model_tick(&bat, &model, current_A, 1000);
+        ekf_identify(&ekf, model.current_mA / 1000.0f, model.cell_voltage_min_mV / 1000.0f, 1.0f);
+        ekf_step(&ekf, current_A / 3600.0f, model.current_mA / 1000.0f, model.cell_voltage_min_mV / 1000.0f);
+    }
+
+    printf("RC identification: R0 %.2fmOhm, R1 %.2fmOhm, tau %.1fs (after %u updates)\n",
+        ekf.R0 * 1000.0f, ekf.R1 * 1000.0f, ekf.R1 * ekf.C1, ekf.rls.updates);
+    assert_true(fabsf(ekf.R0 - R0) < R0 * 0.1f);
+    assert_true(fabsf(ekf.R1 - R1) < R1 * 0.2f);
+    assert_true(fabsf(ekf.R1 * ekf.C1 - R1 * C1) < R1 * C1 * 0.25f);
+
+    // Holding a steady current (no excitation) leaves the parameters alone
+    float R0_before = ekf.R0;
+    for(int t=0; t<3600; t++) {
+        battery_model_tick(&bat, &model, -10.0f, 1000);
+        ekf_identify(&ekf, model.current_mA / 1000.0f, model.cell_voltage_min_mV / 1000.0f, 1.0f);
+        ekf_step(&ekf, -10.0f / 3600.0f, model.current_mA / 1000.0f, model.cell_voltage_min_mV / 1000.0f);
+    }
+    assert_true(fabsf(ekf.R0 - R0_before) < R0 * 0.01f);
+}
+
+static void test_rc_identification_bmb_cadence(void **state) {
+    (void) state;
+
+    // As in the firmware: the filter steps every second, but the cell
+    // voltages are only snapshotted every 64 ticks (1.28s), so every few
+    // steps see the same voltage again, and there are pauses for balancing
+    const float R0 = 0.005f, R1 = 0.01f, C1 = 3000.0f;
+    for(int i=0; i<sizeof(bms_model_t); i++) ((uint8_t*)&model)[i] = 0;
+    model.nameplate_capacity_mC = 100 * 3600000;
+    stored_millis = 1000;
+    battery_model_t bat = {
+        .capacity_Ah = 100.0f,
+        .soc = 0.5f,
+        .internal_resistance_Ohm = R0,
+        .polarization_resistance_Ohm = R1,
+        .polarization_capacitance_F = C1,
+        .quiet = true,
+    };
+    ekf_tracker_t tracker = {0};
+
+    srand(5);
+    const float currents[] = {-50.0f, -20.0f, 0.0f, 10.0f, 30.0f, 40.0f, -10.0f};
+    float current_A = 0.0f;
+    int32_t snapshot_mV = 0, snapshot_mA = 0;
+    int64_t charge_mC = 0, last_charge_mC = 0;
+    uint32_t snapshots = 0, steps = 0;
+    for(uint32_t tick=0; tick<4*3600*50; tick++) {
+        // Steps in current about every minute and a half, just after a
+        // snapshot (so each holds over a whole sample period)
+        if(tick % (70 * 64) == 1) {
+            current_A = currents[rand() % 7];
+        }
+        battery_model_tick(&bat, &model, current_A, 20);
+        charge_mC += (int64_t)(current_A * 20.0f);
+
+        // A snapshot every 1.28s, except for a 30s balancing pause every
+        // 10 minutes
+        bool balancing = (tick % (600 * 50)) < 30 * 50;
+        if(tick % 64 == 0 && !balancing) {
+            snapshot_mV = model.cell_voltage_min_mV;
+            snapshot_mA = model.current_mA;
+            model.cell_voltages_millis = stored_millis;
+            model.cell_voltages_us = stored_millis * 1000;
+            snapshots++;
+        }
+
+        if(tick % 50 == 0 && snapshots > 0) {
+            ekf_tick(&tracker, &model, (int32_t)(charge_mC - last_charge_mC), snapshot_mA, snapshot_mV);
+            last_charge_mC = charge_mC;
+            steps++;
+        }
+    }
+
+    const EKF *ekf = &tracker.ekf;
+    printf("RC identification at 1.28s: R0 %.2fmOhm, R1 %.2fmOhm, tau %.1fs (after %u updates, %u steps)\n",
+        ekf->R0 * 1000.0f, ekf->R1 * 1000.0f, ekf->R1 * ekf->C1, ekf->rls.updates, steps);
+    // Only the new snapshots were used
+    assert_true(ekf->rls.updates < snapshots);
+    assert_true(fabsf(ekf->R0 - R0) < R0 * 0.02f);
+    assert_true(fabsf(ekf->R1 - R1) < R1 * 0.2f);
+    assert_true(fabsf(ekf->R1 * ekf->C1 - R1 * C1) < R1 * C1 * 0.25f);
+}
+
+#if CHEMISTRY == NMC
+// Gaussian noise, by Box-Muller
+static float gaussian(float sd) {
+    float u1 = (rand() + 1.0f) / (RAND_MAX + 2.0f);
+    float u2 = (rand() + 1.0f) / (RAND_MAX + 2.0f);
+    return sd * sqrtf(-2.0f * logf(u1)) * cosf(6.2831853f * u2);
+}
+
+// Runs the filter for an hour on a cell matching its model, whose voltage is
+// measured with the given noise
+static void run_noisy(EKF *ekf, float noise_sd) {
+    const float R0 = 0.02f, R1 = 0.03f, C1 = 2000.0f;
+    float soc = 0.6f, v_c1 = 0.0f;
+    float exp_val = expf(-1.0f / (R1 * C1));
+    for(int t=0; t<3600; t++) {
+        float current_A = (t / 300) % 2 ? 5.0f : -10.0f;
+        soc += current_A / 3600.0f / 100.0f;
+        v_c1 = v_c1 * exp_val - current_A * R1 * (1.0f - exp_val);
+        float ocv = ocv_from_soc((uint16_t)(soc * 10000.0f), OCV_DEFAULT_TEMPERATURE_dC) / 1000000.0f;
+        float v = ocv - v_c1 + current_A * R0 + gaussian(noise_sd);
+        ekf_step(ekf, current_A / 3600.0f, current_A, v);
+    }
+}
+
+static void test_ekf_adaptive_noise(void **state) {
+    (void) state;
+
+    // Packs with quiet and noisy voltage sensing each end up with R near the
+    // actual noise, from the same starting tuning, and a consistent filter
+    const float noise_sd[] = {0.005f, 0.02f};
+    for(int n=0; n<2; n++) {
+        srand(6);
+        EKF ekf;
+        ekf_init(&ekf, 0.6f, 100.0f);
+        ekf.identify = false;
+        run_noisy(&ekf, noise_sd[n]);
+        float variance = noise_sd[n] * noise_sd[n];
+        printf("Adaptive R: %.0fmV noise, R %.2e (actual %.2e), NIS %.2f\n",
+            noise_sd[n] * 1000.0f, ekf.R, variance, ekf.nis);
+        assert_true(ekf.R > variance * 0.5f && ekf.R < variance * 2.0f);
+        assert_in_range(ekf.nis * 100, 50, 200);
+    }
+
+    // Whereas the fixed tuning is far too cautious for the quieter one
+    srand(6);
+    EKF ekf;
+    ekf_init(&ekf, 0.6f, 100.0f);
+    ekf.identify = false;
+    ekf.adapt_R = false;
+    run_noisy(&ekf, noise_sd[0]);
+    printf("Fixed R: NIS %.2f\n", ekf.nis);
+    assert_true(ekf.nis < 0.1f);
+
+    // And it stays within bounds however wild the voltage
+    srand(6);
+    ekf_init(&ekf, 0.6f, 100.0f);
+    ekf.identify = false;
+    run_noisy(&ekf, 1.0f);
+    assert_true(ekf.R <= ekf.R_max);
+}
+#endif
+
+#if CHEMISTRY == NMC
+static void test_sop_reaches_soft_limit(void **state) {
+    (void) state;
+
+    // A cell at 8%, at rest
+    const float R0 = 0.005f, R1 = 0.01f, C1 = 3000.0f;
+    const battery_model_t start = {
+        .capacity_Ah = 100.0f,
+        .soc = 0.08f,
+        .internal_resistance_Ohm = R0,
+        .polarization_resistance_Ohm = R1,
+        .polarization_capacitance_F = C1,
+        .quiet = true,
+    };
+    sop_cell_t cell = { .R0 = R0, .R1 = R1, .C1 = C1, .capacity_Ah = 100.0f };
+    float slope = (soc_to_ocv(0.09f) - soc_to_ocv(0.07f)) / 0.02f;
+
+    const int horizons[] = {2, 10, 30};
+    float last_A = -1000.0f;
+    for(int h=0; h<3; h++) {
+        float current_A = sop_current_to_limit(&cell, soc_to_ocv(start.soc), 0.0f, slope,
+            CELL_VOLTAGE_SOFT_MIN_mV / 1000.0f, horizons[h]);
+        assert_true(current_A < 0.0f);
+        // Longer horizons allow less
+        assert_true(current_A > last_A);
+        last_A = current_A;
+
+        // Drawing that much for that long lands on the soft limit
+        battery_model_t bat = start;
+        for(int t=0; t<horizons[h]; t++) {
+            battery_model_tick(&bat, &model, current_A, 1000);
+            assert_true(model.cell_voltage_min_mV >= CELL_VOLTAGE_SOFT_MIN_mV - 3);
+        }
+        printf("SoP %ds: %.1fA, ending at %dmV\n", horizons[h], -current_A, model.cell_voltage_min_mV);
+        assert_in_range(model.cell_voltage_min_mV, CELL_VOLTAGE_SOFT_MIN_mV - 3, CELL_VOLTAGE_SOFT_MIN_mV + 3);
+    }
+
+    // Polarization from an earlier discharge leaves less
+    cell.polarization_V = -0.05f;
+    float polarized_A = sop_current_to_limit(&cell, soc_to_ocv(start.soc) - 0.05f, 0.0f, slope,
+        CELL_VOLTAGE_SOFT_MIN_mV / 1000.0f, 30);
+    assert_true(polarized_A > last_A);
+}
+#endif
+
+static void test_sop_drives_limits(void **state) {
+    (void) state;
+
+    for(int i=0; i<sizeof(bms_model_t); i++) ((uint8_t*)&model)[i] = 0;
+    model.nameplate_capacity_mC = 100 * 3600 * 1000; // 100Ah
+    stored_millis = 1000;
+    ekf_tick(&ekf_tracker, &model, 0, 0, ocv_from_soc(5000, 250) / 1000);
+    assert_non_null(ekf_instance_get());
+    current_history_reset();
+
+    // Without a state of power, the cell voltage derates apply
+    model.cell_voltages_millis = stored_millis;
+    for(int i=0; i<NUM_CELLS; i++) {
+        model.cell_voltages_mV[i] = ocv_from_soc(5000, 250) / 1000;
+    }
+    model_tick(&model);
+    assert_int_equal(model.cell_voltage_discharge_current_limit_dA, 0xFFFF);
+
+    sop_tick(&model);
+    assert_int_equal(model.sop_millis, stored_millis);
+    for(int h=1; h<SOP_HORIZONS; h++) {
+        assert_true(model.sop_discharge_current_limit_dA[h] <= model.sop_discharge_current_limit_dA[h-1]);
+        assert_true(model.sop_charge_current_limit_dA[h] <= model.sop_charge_current_limit_dA[h-1]);
+    }
+    model_tick(&model);
+    assert_int_equal(model.cell_voltage_discharge_current_limit_dA, model.sop_discharge_current_limit_dA[SOP_LIMIT_HORIZON]);
+    assert_int_equal(model.cell_voltage_charge_current_limit_dA, model.sop_charge_current_limit_dA[SOP_LIMIT_HORIZON]);
+
+    // A load that started after the snapshot isn't in the cell voltages, so
+    // its IR drop isn't taken back out of them
+    uint16_t rest_discharge_dA = model.sop_discharge_current_limit_dA[SOP_LIMIT_HORIZON];
+    current_history_reset();
+    model.cell_voltages_us = 1000000;
+    current_history_add(0, model.cell_voltages_us);
+    current_history_add(-50000, model.cell_voltages_us + 530000);
+    model.current_mA = -50000;
+    sop_tick(&model);
+    assert_int_equal(model.sop_discharge_current_limit_dA[SOP_LIMIT_HORIZON], rest_discharge_dA);
+
+    // ...unless there's no history to go on
+    current_history_reset();
+    sop_tick(&model);
+    assert_true(model.sop_discharge_current_limit_dA[SOP_LIMIT_HORIZON] > rest_discharge_dA);
+    model.current_mA = 0;
+
+    // Once stale, it's back to the derates
+    stored_millis += SOP_STALE_MS + 1;
+    model_tick(&model);
+    assert_int_equal(model.cell_voltage_discharge_current_limit_dA, 0xFFFF);
+}
+
+static void test_runtime(void **state) {
+    (void) state;
+
+    // Away from the derates, it's just the capacity left over the current
+    assert_int_equal(runtime_to_limit_s(0.5f, 0.1f, 10.0f, 100.0f, 200.0f, 0.2f), 4 * 3600);
+    // Whereas once the derate is below the current, the rest tails off
+    // exponentially (20% left at 200A per unit to 10%: 0.5h * ln 2)
+    uint32_t tail_s = runtime_to_limit_s(0.2f, 0.1f, 100.0f, 100.0f, 200.0f, 0.3f);
+    assert_in_range(tail_s, 1247, 1248);
+    // ...and at a lower current, only once the derate drops below it
+    uint32_t knee_s = runtime_to_limit_s(0.5f, 0.1f, 20.0f, 100.0f, 200.0f, 0.3f);
+    float expected_s = 0.4f * 100.0f * 3600.0f / 20.0f + 100.0f * 3600.0f / 200.0f * logf(0.1f / 0.1f);
+    assert_in_range(knee_s, expected_s - 1, expected_s + 1);
+    assert_int_equal(runtime_to_limit_s(0.05f, 0.1f, 20.0f, 100.0f, 200.0f, 0.3f), 0);
+
+    for(int i=0; i<sizeof(bms_model_t); i++) ((uint8_t*)&model)[i] = 0;
+    model.nameplate_capacity_mC = 100 * 3600 * 1000; // 100Ah
+    stored_millis = 1000;
+    runtime_tick(&model);
+    assert_int_equal(model.time_to_empty_s, RUNTIME_UNKNOWN);
+    assert_int_equal(model.time_to_full_s, RUNTIME_UNKNOWN);
+
+    // Discharging steadily at 20A from half way, with a spike the trend
+    // should mostly ignore
+    model.soc = 5000;
+    model.battery_voltage_mV = 3600 * NUM_CELLS;
+    const int32_t power_mW = -20 * 3600 * NUM_CELLS;
+    for(int t=0; t<1500; t++) {
+        stored_millis += 500;
+        model.current_mA = t == 100 ? -200000 : -20000;
+        model.current_millis = stored_millis;
+        if(t % 2 == 0) {
+            model.soc_millis = stored_millis;
+        }
+        runtime_tick(&model);
+        if(t == 100) {
+            // Less than 10% off
+            assert_true(model.power_trend_mW > power_mW * 1.1f);
+        }
+    }
+    assert_true(abs(model.power_trend_mW - power_mW) < -power_mW / 200);
+    assert_int_equal(model.time_to_full_s, RUNTIME_UNKNOWN);
+    // Half the working range at 20A, plus a little for the tail
+    ocv_scaling_t scaling = {0};
+    ocv_scaling_update(&scaling, CELL_VOLTAGE_WORKING_MIN_mV, CELL_VOLTAGE_WORKING_MAX_mV);
+    uint32_t straight_s = (uint32_t)((scaling.soc_max - scaling.soc_min) / 20000.0f * 100.0f * 3600.0f / 20.0f);
+    printf("Time to empty: %u s (%u s without the derate)\n", model.time_to_empty_s, straight_s);
+    assert_true(model.time_to_empty_s >= straight_s);
+    assert_true(model.time_to_empty_s < straight_s * 1.2f);
+
+    // A fresh state of power takes over from the derate. Here it only allows
+    // 10A already, so it's all tail.
+    uint32_t derated_s = model.time_to_empty_s;
+    model.sop_discharge_current_limit_dA[SOP_LIMIT_HORIZON] = 100;
+    model.sop_millis = stored_millis;
+    model.soc_millis = stored_millis;
+    runtime_tick(&model);
+    printf("Time to empty with SoP: %u s\n", model.time_to_empty_s);
+    assert_true(model.time_to_empty_s > derated_s);
+    // ...until it goes stale
+    stored_millis += SOP_STALE_MS + 1;
+    model.current_millis = stored_millis;
+    model.soc_millis = stored_millis;
+    runtime_tick(&model);
+    assert_int_equal(model.time_to_empty_s, derated_s);
+
+    // A one second spike counts the same however often it's sampled, eg.
+    // every tick while the INA228 is in its fast profile
+    for(int t=0; t<50; t++) {
+        stored_millis += 20;
+        model.current_mA = -200000;
+        model.current_millis = stored_millis;
+        runtime_tick(&model);
+    }
+    float spike_mW = -180 * 3600 * NUM_CELLS * 1000.0f / RUNTIME_TREND_MS;
+    assert_in_range(model.power_trend_mW - power_mW, spike_mW * 1.1f, spike_mW * 0.9f);
+
+    // Charging
+    for(int t=0; t<600; t++) {
+        stored_millis += 500;
+        model.current_mA = 20000;
+        model.current_millis = stored_millis;
+        model.soc_millis = stored_millis;
+        runtime_tick(&model);
+    }
+    assert_true(model.power_trend_mW > 0);
+    assert_int_equal(model.time_to_empty_s, RUNTIME_UNKNOWN);
+    printf("Time to full: %u s\n", model.time_to_full_s);
+    assert_true(model.time_to_full_s >= straight_s);
+
+    // And idle
+    for(int t=0; t<2000; t++) {
+        stored_millis += 500;
+        model.current_mA = 0;
+        model.current_millis = stored_millis;
+        model.soc_millis = stored_millis;
+        runtime_tick(&model);
+    }
+    assert_int_equal(model.time_to_full_s, RUNTIME_UNKNOWN);
+}
+
+static void test_energy(void **state) {
+    (void) state;
+
+    for(int i=0; i<sizeof(bms_model_t); i++) ((uint8_t*)&model)[i] = 0;
+    stored_millis = 1000;
+    model.battery_voltage_mV = 350000;
+    model.battery_voltage_millis = stored_millis;
+    energy_init(&model);
+    assert_int_equal(model.energy_status, INA228_ENERGY_ACCOUNTING ? ENERGY_STATUS_WAITING : ENERGY_STATUS_DISABLED);
+
+    // Without a sensible bus voltage (eg, no divider), nothing is counted
+    model.bus_voltage_mV = 85000;
+    model.bus_voltage_millis = stored_millis;
+    for(int t=0; t<100; t++) {
+        stored_millis += 500;
+        model.energy_in_mJ += 10 * 1000 * 1000;
+        model.energy_millis = stored_millis;
+        energy_tick(&model);
+    }
+    assert_int_equal(model.energy_in_Wh, 0);
+    assert_int_equal(model.energy_status, ENERGY_STATUS_VBUS_MISMATCH);
+
+    // Charging at 1.8kW for 0.5s is 1/4 Wh per conversion, then discharging
+    // at twice that
+    model.bus_voltage_mV = 351000;
+    for(int t=0; t<400; t++) {
+        stored_millis += 500;
+        if(t < 200) {
+            model.energy_in_mJ += 900 * 1000;
+        } else {
+            model.energy_out_mJ += 1800 * 1000;
+        }
+        model.energy_millis = stored_millis;
+        energy_tick(&model);
+    }
+    assert_int_equal(model.energy_in_Wh, 50);
+    assert_int_equal(model.energy_out_Wh, 100);
+    assert_int_equal(model.energy_status, ENERGY_STATUS_COUNTING);
+
+    // Repeated readings aren't counted twice
+    energy_tick(&model);
+    assert_int_equal(model.energy_out_Wh, 100);
+
+    // The totals are only saved hourly
+    assert_int_equal(energy_saves, 0);
+    stored_millis += 60 * 60 * 1000;
+    model.energy_in_mJ += 3600 * 1000;
+    model.energy_millis = stored_millis;
+    energy_tick(&model);
+    assert_int_equal(model.energy_in_Wh, 51);
+    assert_int_equal(energy_saves, 1);
+}
+
 int main(void) {
     const struct CMUnitTest tests[] = {
+#if CHEMISTRY == NMC
         cmocka_unit_test(test_ekf_soc_scaling),
+#endif
         //cmocka_unit_test(test_inverter_soc_scaling),
+        cmocka_unit_test(test_inverter_schedule),
+        cmocka_unit_test(test_current_history),
+        cmocka_unit_test(test_soh_capacity),
+        cmocka_unit_test(test_soh_resistance),
+        cmocka_unit_test(test_soh_tick),
+        cmocka_unit_test(test_rc_identification),
+        cmocka_unit_test(test_rc_identification_bmb_cadence),
+#if CHEMISTRY == NMC
+        cmocka_unit_test(test_ekf_adaptive_noise),
+#endif
+        cmocka_unit_test(test_sop_drives_limits),
+        cmocka_unit_test(test_runtime),
+        cmocka_unit_test(test_energy),
+#if CHEMISTRY == NMC
+        cmocka_unit_test(test_sop_reaches_soft_limit),
+#endif
+#if CHEMISTRY == NMC
+        cmocka_unit_test(test_ocv_inverse),
+        cmocka_unit_test(test_ocv_scaling_cache),
+#else
+        cmocka_unit_test(test_lfp_plateau),
+        cmocka_unit_test(test_lfp_knee_correction),
+#endif
+        cmocka_unit_test(test_ocv_temperature),
     };
     return cmocka_run_group_tests(tests, NULL, NULL);
 }
@@ -0,0 +1,548 @@
+// Offline tuning of the SoC estimators: replays drive-cycle logs (recorded or
+// synthetic) through ekf_tick(), voltage_based_soc_estimate() and
+// basic_count_soc_estimate(), sweeping a grid of EKF tunings across all cores,
+// and reports the error of each against the true SoC.
+//
+// Built alongside the host tests (the soc_replay target in
+// tests/CMakeLists.txt), or by hand with:
+//
+//   cc -O2 -pthread -fms-extensions -I../bms -I../tests/include -o soc_replay
+//       soc_replay.c ../bms/app/estimators/{ekf,rls,ocv,basic_count,voltage_based}.c -lm
+//
+// (-fms-extensions is needed for the anonymous sm_t members in the model,
+// as in the firmware build). Then run with:
+//
+//   ./soc_replay -p R=1e-4,1e-3 -p Q1=1e-6,1e-5 drive1.csv drive2.csv
+//   ./soc_replay -s 24 -p R0=0.01,0.02,0.04 -p C1=1000,4000
+//
+// (with -DCHEMISTRY=LFP for LFP packs).
+//
+// Logs are CSV, with a header row naming the columns:
+//
+//   t_ms        time (ms)
+//   current_mA  pack current, positive when charging
+//   soc         the true SoC (0.01%), eg. worked back from a full charge
+//   v1, v2, ... cell voltages (mV), as many as there are
+//   charge_mC   (optional) charge counter, positive when charging, otherwise
+//               the current is integrated
+//   temp_dC     (optional) cell temperature (0.1C)
+//
+// Lines starting with # are skipped.
+//
+// Options:
+//
+//   -p NAME=V1,V2,...  values to try for Q0, Q1, Q2, R, R0, R1 or C1, with
+//                      every combination being run
+//   -f                 hold R and the RC model at the given values, rather
+//                      than starting from them and adapting
+//   -c AH              nameplate capacity (default 100)
+//   -s HOURS           add a synthetic drive cycle this long
+//   -j N               threads (default: one per core)
+//   -w S               skip the first S seconds of each log (default 300)
+//                      while the estimators settle
+//   -n N               show the best N tunings (default 20)
+//
+// Each run has its own filter and model, so runs share nothing but the logs
+// (read only) and the OCV tables (built before the threads start).
+
+#include "app/estimators/ekf.h"
+#include "app/estimators/estimators.h"
+#include "app/estimators/ocv.h"
+#include "app/model.h"
+#include "config/limits.h"
+#include "drivers/sensors/ina228.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct {
+    uint32_t t_ms;
+    int32_t current_mA;
+    int64_t charge_mC;
+    uint16_t soc; // true SoC (0.01%)
+    int16_t temperature_dC;
+    bool has_temperature;
+    uint16_t cell_min_mV;
+    uint16_t cell_max_mV;
+    uint32_t cell_total_mV;
+} sample_t;
+
+typedef struct {
+    const char *name;
+    sample_t *samples;
+    size_t count;
+} replay_log_t;
+
+#define PARAMS 7
+static const char *param_names[PARAMS] = {"Q0", "Q1", "Q2", "R", "R0", "R1", "C1"};
+
+#define MAX_VALUES 32
+
+typedef struct {
+    float values[PARAMS][MAX_VALUES];
+    int counts[PARAMS]; // zero to leave at the firmware's value
+} grid_t;
+
+typedef struct {
+    float params[PARAMS];
+    bool set[PARAMS];
+    double sum_squared;
+    size_t count;
+    float worst;
+} run_t;
+
+typedef struct {
+    const replay_log_t *logs;
+    int log_count;
+    run_t *runs;
+    size_t run_count;
+    size_t next_run; // claimed atomically by the workers
+    uint32_t capacity_mC;
+    uint32_t warmup_ms;
+    bool fixed;
+} job_t;
+
+// ---- Loading ----
+
+static bool append_sample(replay_log_t *log, size_t *capacity, const sample_t *sample) {
+    if(log->count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 4096;
+        sample_t *grown = realloc(log->samples, *capacity * sizeof(sample_t));
+        if(!grown) {
+            return false;
+        }
+        log->samples = grown;
+    }
+    log->samples[log->count++] = *sample;
+    return true;
+}
+
+static bool load_log(replay_log_t *log, const char *path) {
+    FILE *f = fopen(path, "r");
+    if(!f) {
+        perror(path);
+        return false;
+    }
+
+    enum { COL_NONE, COL_T, COL_CURRENT, COL_SOC, COL_CHARGE, COL_TEMPERATURE, COL_CELL };
+    int columns[256];
+    int column_count = 0;
+    bool has_charge = false;
+    size_t capacity = 0;
+    int64_t integrated_mC = 0;
+    char line[8192];
+
+    log->name = path;
+    log->samples = NULL;
+    log->count = 0;
+
+    while(fgets(line, sizeof(line), f)) {
+        if(line[0] == '#' || line[0] == '\n' || line[0] == '\r') {
+            continue;
+        }
+        if(column_count == 0) {
+            for(char *tok = strtok(line, ",\r\n"); tok && column_count < 256; tok = strtok(NULL, ",\r\n")) {
+                int col = COL_NONE;
+                if(!strcmp(tok, "t_ms")) col = COL_T;
+                else if(!strcmp(tok, "current_mA")) col = COL_CURRENT;
+                else if(!strcmp(tok, "soc")) col = COL_SOC;
+                else if(!strcmp(tok, "charge_mC")) col = COL_CHARGE, has_charge = true;
+                else if(!strcmp(tok, "temp_dC")) col = COL_TEMPERATURE;
+                else if(tok[0] == 'v' && tok[1] >= '0' && tok[1] <= '9') col = COL_CELL;
+                columns[column_count++] = col;
+            }
+            continue;
+        }
+
+        sample_t s = { .cell_min_mV = 0xFFFF };
+        int cells = 0;
+        int c = 0;
+        for(char *tok = strtok(line, ",\r\n"); tok && c < column_count; tok = strtok(NULL, ",\r\n"), c++) {
+            long long value = strtoll(tok, NULL, 10);
+            switch(columns[c]) {
+                case COL_T: s.t_ms = (uint32_t)value; break;
+                case COL_CURRENT: s.current_mA = (int32_t)value; break;
+                case COL_SOC: s.soc = (uint16_t)value; break;
+                case COL_CHARGE: s.charge_mC = value; break;
+                case COL_TEMPERATURE: s.temperature_dC = (int16_t)value; s.has_temperature = true; break;
+                case COL_CELL:
+                    if(value < s.cell_min_mV) s.cell_min_mV = (uint16_t)value;
+                    if(value > s.cell_max_mV) s.cell_max_mV = (uint16_t)value;
+                    s.cell_total_mV += (uint32_t)value;
+                    cells++;
+                    break;
+            }
+        }
+        if(cells == 0) {
+            continue;
+        }
+        // Scale the total up to the pack the firmware was built for, so that
+        // pack-level voltages come out right whatever was logged
+        s.cell_total_mV = (uint32_t)((uint64_t)s.cell_total_mV * NUM_CELLS / cells);
+        if(!has_charge) {
+            if(log->count > 0) {
+                const sample_t *prev = &log->samples[log->count - 1];
+                integrated_mC += (int64_t)prev->current_mA * (int32_t)(s.t_ms - prev->t_ms) / 1000;
+            }
+            s.charge_mC = integrated_mC;
+        }
+        if(!append_sample(log, &capacity, &s)) {
+            fclose(f);
+            return false;
+        }
+    }
+    fclose(f);
+
+    if(log->count < 2) {
+        fprintf(stderr, "%s: no samples (is there a header row?)\n", path);
+        return false;
+    }
+    return true;
+}
+
+// ---- Synthetic drive cycles ----
+
+static float gaussian(unsigned int *seed, float sd) {
+    float u1 = (rand_r(seed) + 1.0f) / (RAND_MAX + 2.0f);
+    float u2 = (rand_r(seed) + 1.0f) / (RAND_MAX + 2.0f);
+    return sd * sqrtf(-2.0f * logf(u1)) * cosf(6.2831853f * u2);
+}
+
+// A pack of cells with slightly different SoCs, each an RC model on the
+// firmware's own OCV curve, measured with 2mV of noise, driven by random steps
+// in current between the SoC limits.
+static bool synthesize_log(replay_log_t *log, float hours, float capacity_Ah, unsigned int seed) {
+    const float R0 = 0.001f, R1 = 0.001f, C1 = 60000.0f;
+    const float currents_A[] = {-80.0f, -40.0f, -20.0f, -5.0f, 0.0f, 0.0f, 10.0f, 30.0f, 50.0f};
+    const int cells = NUM_CELLS;
+
+    float offsets[NUM_CELLS];
+    for(int i=0; i<cells; i++) {
+        offsets[i] = gaussian(&seed, 0.005f);
+    }
+
+    size_t capacity = 0;
+    log->name = "synthetic";
+    log->samples = NULL;
+    log->count = 0;
+
+    float soc = 0.7f;
+    float v_c1 = 0.0f;
+    float current_A = 0.0f;
+    uint32_t next_change_s = 0;
+    int64_t charge_mC = 0;
+    float exp_val = expf(-1.0f / (R1 * C1));
+    uint32_t seconds = (uint32_t)(hours * 3600.0f);
+
+    for(uint32_t t=0; t<seconds; t++) {
+        if(t >= next_change_s) {
+            current_A = currents_A[rand_r(&seed) % (sizeof(currents_A) / sizeof(currents_A[0]))];
+            next_change_s = t + 60 + rand_r(&seed) % 540;
+        }
+        if(soc < 0.1f && current_A < 0.0f) current_A = 30.0f;
+        if(soc > 0.95f && current_A > 0.0f) current_A = -30.0f;
+
+        soc += current_A / 3600.0f / capacity_Ah;
+        charge_mC += (int64_t)(current_A * 1000.0f);
+        v_c1 = v_c1 * exp_val - current_A * R1 * (1.0f - exp_val);
+
+        sample_t s = {
+            .t_ms = t * 1000,
+            .current_mA = (int32_t)(current_A * 1000.0f),
+            .charge_mC = charge_mC,
+            .soc = (uint16_t)(soc * 10000.0f),
+            .temperature_dC = OCV_DEFAULT_TEMPERATURE_dC,
+            .has_temperature = true,
+            .cell_min_mV = 0xFFFF,
+        };
+        for(int i=0; i<cells; i++) {
+            float cell_soc = soc + offsets[i];
+            if(cell_soc < 0.0f) cell_soc = 0.0f;
+            if(cell_soc > 1.0f) cell_soc = 1.0f;
+            float ocv = ocv_from_soc((uint16_t)(cell_soc * 10000.0f), OCV_DEFAULT_TEMPERATURE_dC) / 1000000.0f;
+            float v = ocv - v_c1 + current_A * R0 + gaussian(&seed, 0.002f);
+            uint16_t mV = (uint16_t)(v * 1000.0f + 0.5f);
+            if(mV < s.cell_min_mV) s.cell_min_mV = mV;
+            if(mV > s.cell_max_mV) s.cell_max_mV = mV;
+            s.cell_total_mV += mV;
+        }
+        if(!append_sample(log, &capacity, &s)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// ---- Replay ----
+
+static void model_from_sample(bms_model_t *model, const sample_t *s) {
+    model->current_mA = s->current_mA;
+    // The charge counter in INA228 units (the inverse of raw_charge_to_mC)
+    model->charge_raw = s->charge_mC * 1000 / INA228_CHARGE_LSB_uC;
+    model->cell_voltage_min_mV = s->cell_min_mV;
+    model->cell_voltage_max_mV = s->cell_max_mV;
+    model->cell_voltage_total_mV = s->cell_total_mV;
+    model->battery_voltage_mV = s->cell_total_mV;
+    // Each sample is taken as a fresh snapshot of the cell voltages
+    model->cell_voltages_millis = s->t_ms ? s->t_ms : 1;
+    model->cell_voltages_us = s->t_ms * 1000;
+    if(s->has_temperature) {
+        model->temperature_min_dC = s->temperature_dC;
+        model->temperature_max_dC = s->temperature_dC;
+        model->temperature_millis = s->t_ms ? s->t_ms : 1;
+    }
+}
+
+static void apply_params(EKF *ekf, const run_t *run, bool fixed) {
+    float *targets[PARAMS] = {&ekf->Q[0], &ekf->Q[1], &ekf->Q[2], &ekf->R, &ekf->R0, &ekf->R1, &ekf->C1};
+    for(int p=0; p<PARAMS; p++) {
+        if(run->set[p]) {
+            *targets[p] = run->params[p];
+        }
+    }
+    rls_init(&ekf->rls, ekf->R0, ekf->R1, ekf->C1);
+    if(fixed) {
+        ekf->adapt_R = false;
+        ekf->identify = false;
+    }
+}
+
+static void replay_ekf(const job_t *job, run_t *run, const replay_log_t *log) {
+    bms_model_t model;
+    memset(&model, 0, sizeof(model));
+    model.nameplate_capacity_mC = job->capacity_mC;
+    // Working over the whole OCV curve, so that the SoC isn't rescaled
+    model.cell_voltage_working_min_mV = ocv_from_soc(0, OCV_DEFAULT_TEMPERATURE_dC) / 1000 + 1;
+    model.cell_voltage_working_max_mV = ocv_from_soc(10000, OCV_DEFAULT_TEMPERATURE_dC) / 1000;
+
+    ekf_tracker_t tracker;
+    memset(&tracker, 0, sizeof(tracker));
+
+    int64_t last_charge_mC = log->samples[0].charge_mC;
+    uint32_t last_tick_ms = 0;
+    bool first = true;
+    for(size_t i=0; i<log->count; i++) {
+        const sample_t *s = &log->samples[i];
+        if(!first && s->t_ms - last_tick_ms < 1000) {
+            continue;
+        }
+        model_from_sample(&model, s);
+        uint32_t soc = ekf_tick(&tracker, &model, (int32_t)(s->charge_mC - last_charge_mC),
+            s->current_mA, s->cell_total_mV / NUM_CELLS);
+        last_charge_mC = s->charge_mC;
+        last_tick_ms = s->t_ms;
+        if(soc == 0xFFFFFFFF) {
+            continue;
+        }
+        if(first) {
+            // The filter sets itself up from the first voltage, so the tuning
+            // goes in after that
+            apply_params(&tracker.ekf, run, job->fixed);
+            first = false;
+        }
+
+        if(s->t_ms - log->samples[0].t_ms >= job->warmup_ms) {
+            float error = ((float)soc - s->soc) / 100.0f;
+            run->sum_squared += error * error;
+            run->count++;
+            if(fabsf(error) > run->worst) run->worst = fabsf(error);
+        }
+    }
+}
+
+static void *worker(void *arg) {
+    job_t *job = arg;
+    for(;;) {
+        size_t r = __atomic_fetch_add(&job->next_run, 1, __ATOMIC_RELAXED);
+        if(r >= job->run_count) {
+            return NULL;
+        }
+        for(int l=0; l<job->log_count; l++) {
+            replay_ekf(job, &job->runs[r], &job->logs[l]);
+        }
+    }
+}
+
+// The estimators that aren't tuned here, once per log, for comparison
+static void replay_others(const job_t *job, const replay_log_t *log) {
+    bms_model_t model;
+    memset(&model, 0, sizeof(model));
+    model.nameplate_capacity_mC = job->capacity_mC;
+    basic_count_t basic_count;
+    memset(&basic_count, 0, sizeof(basic_count));
+
+    double sum_voltage = 0.0, sum_count = 0.0;
+    size_t count = 0;
+    for(size_t i=0; i<log->count; i++) {
+        const sample_t *s = &log->samples[i];
+        model_from_sample(&model, s);
+        float voltage_error = ((float)voltage_based_soc_estimate(&model) - s->soc) / 100.0f;
+        float count_error = ((float)basic_count_soc_estimate(&basic_count, &model) - s->soc) / 100.0f;
+        if(s->t_ms - log->samples[0].t_ms >= job->warmup_ms) {
+            sum_voltage += voltage_error * voltage_error;
+            sum_count += count_error * count_error;
+            count++;
+        }
+    }
+    if(count) {
+        printf("%s: %zu samples, voltage based RMSE %.2f%%, basic count RMSE %.2f%%\n",
+            log->name, log->count, sqrt(sum_voltage / count), sqrt(sum_count / count));
+    }
+}
+
+// ---- Grid ----
+
+static bool parse_param(grid_t *grid, const char *arg) {
+    const char *eq = strchr(arg, '=');
+    if(!eq) {
+        return false;
+    }
+    for(int p=0; p<PARAMS; p++) {
+        if(strlen(param_names[p]) == (size_t)(eq - arg) && !strncmp(arg, param_names[p], eq - arg)) {
+            grid->counts[p] = 0;
+            const char *v = eq + 1;
+            while(*v && grid->counts[p] < MAX_VALUES) {
+                char *end;
+                grid->values[p][grid->counts[p]++] = strtof(v, &end);
+                if(end == v) {
+                    return false;
+                }
+                v = *end == ',' ? end + 1 : end;
+            }
+            return grid->counts[p] > 0;
+        }
+    }
+    return false;
+}
+
+static run_t *expand_grid(const grid_t *grid, size_t *run_count) {
+    size_t total = 1;
+    for(int p=0; p<PARAMS; p++) {
+        if(grid->counts[p]) total *= grid->counts[p];
+    }
+    run_t *runs = calloc(total, sizeof(run_t));
+    if(!runs) {
+        return NULL;
+    }
+    for(size_t r=0; r<total; r++) {
+        size_t index = r;
+        for(int p=0; p<PARAMS; p++) {
+            if(grid->counts[p]) {
+                runs[r].params[p] = grid->values[p][index % grid->counts[p]];
+                runs[r].set[p] = true;
+                index /= grid->counts[p];
+            }
+        }
+    }
+    *run_count = total;
+    return runs;
+}
+
+static double run_rmse(const run_t *run) {
+    return run->count ? sqrt(run->sum_squared / run->count) : INFINITY;
+}
+
+static int compare_runs(const void *a, const void *b) {
+    double ra = run_rmse(a), rb = run_rmse(b);
+    return ra < rb ? -1 : (ra > rb ? 1 : 0);
+}
+
+static void usage() {
+    fprintf(stderr, "usage: soc_replay [-p NAME=V1,V2,...] [-f] [-c AH] [-s HOURS] [-j N] [-w S] [-n N] [LOG.csv ...]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    grid_t grid = {0};
+    float capacity_Ah = 100.0f;
+    float synthetic_hours = 0.0f;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int warmup_s = 300;
+    int show = 20;
+    bool fixed = false;
+
+    int opt;
+    while((opt = getopt(argc, argv, "p:fc:s:j:w:n:")) != -1) {
+        switch(opt) {
+            case 'p':
+                if(!parse_param(&grid, optarg)) {
+                    fprintf(stderr, "bad parameter: %s\n", optarg);
+                    usage();
+                }
+                break;
+            case 'f': fixed = true; break;
+            case 'c': capacity_Ah = strtof(optarg, NULL); break;
+            case 's': synthetic_hours = strtof(optarg, NULL); break;
+            case 'j': threads = strtol(optarg, NULL, 10); break;
+            case 'w': warmup_s = atoi(optarg); break;
+            case 'n': show = atoi(optarg); break;
+            default: usage();
+        }
+    }
+    if(threads < 1) threads = 1;
+
+    // Builds the OCV inverse table, which is otherwise done lazily on first
+    // use (and would race between the threads)
+    ocv_mV_to_soc(3700, OCV_DEFAULT_TEMPERATURE_dC);
+
+    int log_count = argc - optind + (synthetic_hours > 0.0f ? 1 : 0);
+    if(log_count == 0) {
+        usage();
+    }
+    replay_log_t *logs = calloc(log_count, sizeof(replay_log_t));
+    int loaded = 0;
+    if(synthetic_hours > 0.0f && !synthesize_log(&logs[loaded++], synthetic_hours, capacity_Ah, 1)) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for(int i=optind; i<argc; i++) {
+        if(!load_log(&logs[loaded++], argv[i])) {
+            return 1;
+        }
+    }
+
+    job_t job = {
+        .logs = logs,
+        .log_count = log_count,
+        .capacity_mC = (uint32_t)(capacity_Ah * 3600000.0f),
+        .warmup_ms = (uint32_t)warmup_s * 1000,
+        .fixed = fixed,
+    };
+    job.runs = expand_grid(&grid, &job.run_count);
+    if(!job.runs) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    for(int l=0; l<log_count; l++) {
+        replay_others(&job, &logs[l]);
+    }
+
+    if(threads > (long)job.run_count) threads = (long)job.run_count;
+    pthread_t *ids = calloc(threads, sizeof(pthread_t));
+    for(long t=0; t<threads; t++) {
+        pthread_create(&ids[t], NULL, worker, &job);
+    }
+    for(long t=0; t<threads; t++) {
+        pthread_join(ids[t], NULL);
+    }
+
+    qsort(job.runs, job.run_count, sizeof(run_t), compare_runs);
+    printf("%zu tunings over %d logs (%ld threads)\n", job.run_count, log_count, threads);
+    for(size_t r=0; r<job.run_count && r<(size_t)show; r++) {
+        printf("EKF RMSE %6.2f%% worst %6.2f%%", run_rmse(&job.runs[r]), job.runs[r].worst);
+        for(int p=0; p<PARAMS; p++) {
+            if(job.runs[r].set[p]) {
+                printf("  %s=%g", param_names[p], job.runs[r].params[p]);
+            }
+        }
+        printf("\n");
+    }
+    return 0;
+}
@@ -0,0 +1,189 @@
+// Decoder for the binary USB telemetry stream (see bms/app/monitoring/telemetry.h).
+//
+// Build and run with:
+//
+//   cc -O2 -I../bms -o telemetry_decode telemetry_decode.c
+//   stty -F /dev/ttyACM0 raw && ./telemetry_decode < /dev/ttyACM0
+//
+// Prints one line per packet. Anything that isn't a valid packet (eg. text
+// from printf warnings) is skipped.
+
+#include "protocols/hmi_serial/hmi_serial.h"
+#include "lib/delta_coding.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define CRC16_INIT ((uint16_t)-1l)
+
+static const char *register_name(uint16_t reg_id) {
+    switch(reg_id) {
+        case HMI_REG_SERIAL: return "serial";
+        case HMI_REG_MILLIS: return "millis";
+        case HMI_REG_SOC: return "soc";
+        case HMI_REG_CURRENT: return "current_mA";
+        case HMI_REG_CHARGE: return "charge_mC";
+        case HMI_REG_BATTERY_VOLTAGE: return "battery_mV";
+        case HMI_REG_OUTPUT_VOLTAGE: return "output_mV";
+        case HMI_REG_POS_CONTACTOR_VOLTAGE: return "pos_contactor_mV";
+        case HMI_REG_NEG_CONTACTOR_VOLTAGE: return "neg_contactor_mV";
+        case HMI_REG_TEMPERATURE_MIN: return "temp_min_dC";
+        case HMI_REG_TEMPERATURE_MAX: return "temp_max_dC";
+        case HMI_REG_CELL_VOLTAGE_MIN: return "cell_min_mV";
+        case HMI_REG_CELL_VOLTAGE_MAX: return "cell_max_mV";
+        case HMI_REG_SYSTEM_STATE: return "system_state";
+        case HMI_REG_CONTACTORS_STATE: return "contactors_state";
+        case HMI_REG_SOC_VOLTAGE_BASED: return "soc_vb";
+        case HMI_REG_SOC_BASIC_COUNT: return "soc_bc";
+        case HMI_REG_SUPPLY_VOLTAGE_3V3: return "supply_3v3_mV";
+        case HMI_REG_SUPPLY_VOLTAGE_5V: return "supply_5v_mV";
+        case HMI_REG_SUPPLY_VOLTAGE_12V: return "supply_12v_mV";
+        case HMI_REG_SUPPLY_VOLTAGE_CTR: return "supply_ctr_mV";
+    }
+    return NULL;
+}
+
+static uint16_t crc16_update(uint16_t crc16, uint8_t b) {
+    crc16 ^= b;
+    for(int j=0; j<8; j++) {
+        if(crc16 & 1) {
+            crc16 = (crc16 >> 1) ^ 0xA001;
+        } else {
+            crc16 >>= 1;
+        }
+    }
+    return crc16;
+}
+
+static uint64_t get_le(const uint8_t *buf, uint8_t size) {
+    uint64_t value = 0;
+    for(uint8_t i = 0; i < size; i++) {
+        value |= (uint64_t)buf[i] << (8 * i);
+    }
+    return value;
+}
+
+static void decode_registers(const uint8_t *buf, size_t len) {
+    printf("regs");
+    size_t idx = 2;
+    while(idx + 3 <= len) {
+        uint16_t reg_id = get_le(&buf[idx], 2);
+        uint8_t type = buf[idx + 2];
+        uint8_t size = type & 0x0F;
+        idx += 3;
+        if(idx + size > len) {
+            break;
+        }
+
+        uint64_t raw = get_le(&buf[idx], size);
+        idx += size;
+
+        const char *name = register_name(reg_id);
+        if(name) {
+            printf(" %s=", name);
+        } else {
+            printf(" r%u=", reg_id);
+        }
+
+        if((type & 0xF0) == 0x20) {
+            // Signed, sign extend from size bytes
+            int64_t value = (int64_t)(raw << (64 - 8 * size)) >> (64 - 8 * size);
+            printf("%lld", (long long)value);
+        } else {
+            printf("%llu", (unsigned long long)raw);
+        }
+    }
+    printf("\n");
+}
+
+static void decode_cell_voltages(const uint8_t *buf, size_t len) {
+    if(len < 3) {
+        return;
+    }
+    uint8_t count = buf[2];
+    int16_t cells[256];
+    if(!delta_decode_i16(cells, count, &buf[3], len - 3)) {
+        printf("cells truncated\n");
+        return;
+    }
+    printf("cells");
+    for(uint8_t i = 0; i < count; i++) {
+        printf(" %d", cells[i]);
+    }
+    printf("\n");
+}
+
+static void decode_events(const uint8_t *buf, size_t len) {
+    if(len < 6) {
+        return;
+    }
+    uint16_t count = get_le(&buf[4], 2);
+    size_t idx = 6;
+    for(uint16_t i = 0; i < count && idx + 22 <= len; i++, idx += 22) {
+        printf("event type=%u level=%u count=%u timestamp=%llu data=0x%016llx\n",
+            (unsigned)get_le(&buf[idx], 2),
+            (unsigned)get_le(&buf[idx + 2], 2),
+            (unsigned)get_le(&buf[idx + 4], 2),
+            (unsigned long long)get_le(&buf[idx + 6], 8),
+            (unsigned long long)get_le(&buf[idx + 14], 8)
+        );
+    }
+}
+
+static void decode_payload(const uint8_t *buf, size_t len) {
+    switch(buf[0]) {
+        case HMI_MSG_READ_REGISTERS_RESPONSE:
+            decode_registers(buf, len);
+            break;
+        case HMI_MSG_READ_CELL_VOLTAGES_RESPONSE:
+            decode_cell_voltages(buf, len);
+            break;
+        case HMI_MSG_READ_EVENTS_RESPONSE:
+            decode_events(buf, len);
+            break;
+        default:
+            printf("unknown 0x%02x len %zu\n", buf[0], len);
+            break;
+    }
+}
+
+int main() {
+    uint8_t packet[256 + 4];
+    size_t idx = 0;
+    size_t crc_errors = 0;
+    int c;
+
+    while((c = getchar()) != EOF) {
+        if(idx == 0 && c != 0xff) {
+            // Search for sync byte
+            continue;
+        }
+        packet[idx++] = (uint8_t)c;
+        if(idx < 2) {
+            continue;
+        }
+
+        size_t payload_len = (size_t)packet[1] + 1;
+        if(idx < payload_len + 4) {
+            continue;
+        }
+
+        uint16_t crc16 = CRC16_INIT;
+        for(size_t i = 0; i < payload_len + 2; i++) {
+            crc16 = crc16_update(crc16, packet[i]);
+        }
+        uint16_t msg_crc16 = packet[payload_len + 2] | (packet[payload_len + 3] << 8);
+
+        if(crc16 == msg_crc16) {
+            decode_payload(&packet[2], payload_len);
+            fflush(stdout);
+        } else {
+            crc_errors++;
+            fprintf(stderr, "crc error (%zu)\n", crc_errors);
+        }
+        idx = 0;
+    }
+
+    return 0;
+}